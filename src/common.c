@@ -31,15 +31,195 @@
 
 #include <sys/types.h>
 #include <pwd.h>
+#include <arpa/inet.h>
 
 #include "pppoe.h"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2_CHECKSUM 1
+#endif
+
 /* Are we running SUID or SGID? */
 int IsSetID = 0;
 
+/* Verify the whole TCP checksum before clamping MSS? */
+int ClampMSSVerify = 0;
+
 static uid_t saved_uid = (uid_t) -2;
 static uid_t saved_gid = (uid_t) -2;
 
+/**********************************************************************
+*%FUNCTION: tagSlot
+*%ARGUMENTS:
+* type -- tag type
+*%RETURNS:
+* The slot in TagIndex.first for "type", or -1 if it has none.
+***********************************************************************/
+static int
+tagSlot(uint16_t type)
+{
+    unsigned int lo = type & 0xFF;
+
+    switch(type >> 8) {
+    case 0x01:
+	return (lo < 0x30) ? (int) lo : -1;
+    case 0x02:
+	return (lo < 0x10) ? (int) (0x30 + lo) : -1;
+    }
+    return -1;
+}
+
+/**********************************************************************
+*%FUNCTION: indexPacket
+*%ARGUMENTS:
+* packet -- the PPPoE discovery packet to index
+* ti -- filled in with the packet's tags
+*%RETURNS:
+* 0 if everything went well; -1 if there was an error
+*%DESCRIPTION:
+* Validates a PPPoE discovery packet and records where each of its tags
+* is, in a single pass.  After this, indexTag finds a tag of a known type
+* without rescanning, and walkTags visits the tags without re-checking
+* them.  The index points into "packet", so it is only good until the
+* packet is modified.
+***********************************************************************/
+int
+indexPacket(PPPoEPacket *packet, TagIndex *ti)
+{
+    uint16_t len = ntohs(packet->length);
+    unsigned int off, rest = 0;
+    uint16_t tagType, tagLen;
+    unsigned char *curTag;
+    int slot, numTags = 0;
+
+    if (PPPOE_VER(packet->vertype) != 1) {
+	syslog(LOG_ERR, "Invalid PPPoE version (%d)", PPPOE_VER(packet->vertype));
+	return -1;
+    }
+    if (PPPOE_TYPE(packet->vertype) != 1) {
+	syslog(LOG_ERR, "Invalid PPPoE type (%d)", PPPOE_TYPE(packet->vertype));
+	return -1;
+    }
+
+    /* Do some sanity checks on packet */
+    if (len > ETH_JUMBO_LEN - PPPOE_OVERHEAD) { /* 6-byte overhead for PPPoE header */
+	syslog(LOG_ERR, "Invalid PPPoE packet length (%u)", len);
+	return -1;
+    }
+
+    ti->packet = packet;
+    memset(ti->first, 0, sizeof(ti->first));
+
+    /* Step through the tags */
+    off = 0;
+    while (off + TAG_HDR_SIZE <= len) {
+	curTag = packet->payload + off;
+	/* Alignment is not guaranteed, so do this by hand... */
+	tagType = (curTag[0] << 8) + curTag[1];
+	tagLen = (curTag[2] << 8) + curTag[3];
+	if (tagType == TAG_END_OF_LIST) {
+	    break;
+	}
+	if (off + tagLen + TAG_HDR_SIZE > len) {
+	    syslog(LOG_ERR, "Invalid PPPoE tag length (%u)", tagLen);
+	    return -1;
+	}
+	if (numTags < MAX_INDEXED_TAGS) {
+	    ti->tags[numTags].type = tagType;
+	    ti->tags[numTags].offset = off;
+	    ti->tags[numTags].length = tagLen;
+	    numTags++;
+	    rest = off + TAG_HDR_SIZE + tagLen;
+	}
+	slot = tagSlot(tagType);
+	if (slot >= 0 && !ti->first[slot]) {
+	    ti->first[slot] = off + 1;
+	}
+	off += TAG_HDR_SIZE + tagLen;
+    }
+    ti->numTags = numTags;
+    ti->rest = (numTags < MAX_INDEXED_TAGS) ? off : rest;
+    ti->end = off;
+    return 0;
+}
+
+/**********************************************************************
+*%FUNCTION: indexTag
+*%ARGUMENTS:
+* ti -- index filled in by indexPacket
+* type -- the type of the tag to look for
+* tag -- if non-NULL, filled in with tag contents
+*%RETURNS:
+* A pointer to the first tag of the specified type if there is one; NULL
+* otherwise.
+*%DESCRIPTION:
+* Looks up a specific tag type in an indexed packet.
+***********************************************************************/
+unsigned char *
+indexTag(TagIndex const *ti, uint16_t type, PPPoETag *tag)
+{
+    unsigned char *payload = ti->packet->payload;
+    unsigned char *curTag = NULL;
+    unsigned int off;
+    int slot = tagSlot(type);
+    int i;
+
+    if (slot >= 0) {
+	if (ti->first[slot]) curTag = payload + ti->first[slot] - 1;
+    } else {
+	for (i=0; i<ti->numTags; i++) {
+	    if (ti->tags[i].type == type) {
+		curTag = payload + ti->tags[i].offset;
+		break;
+	    }
+	}
+	for (off = ti->rest; !curTag && off < ti->end;
+	     off += TAG_HDR_SIZE + ((payload[off+2] << 8) + payload[off+3])) {
+	    if (((payload[off] << 8) + payload[off+1]) == type) {
+		curTag = payload + off;
+	    }
+	}
+    }
+    if (curTag && tag) {
+	memcpy(tag, curTag, TAG_HDR_SIZE + ((curTag[2] << 8) + curTag[3]));
+    }
+    return curTag;
+}
+
+/**********************************************************************
+*%FUNCTION: walkTags
+*%ARGUMENTS:
+* ti -- index filled in by indexPacket
+* func -- function called for each tag in the packet
+* extra -- an opaque data pointer supplied to parsing function
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Calls "func" for each tag of an indexed packet, in order.
+***********************************************************************/
+void
+walkTags(TagIndex const *ti, ParseFunc *func, void *extra)
+{
+    unsigned char *payload = ti->packet->payload;
+    unsigned int off;
+    uint16_t tagLen;
+    int i;
+
+    for (i=0; i<ti->numTags; i++) {
+	func(ti->tags[i].type, ti->tags[i].length,
+	     payload + ti->tags[i].offset + TAG_HDR_SIZE, extra);
+    }
+
+    /* Packets with more tags than we index: the rest were checked by
+       indexPacket, so just step through them */
+    for (off = ti->rest; off < ti->end; off += TAG_HDR_SIZE + tagLen) {
+	tagLen = (payload[off+2] << 8) + payload[off+3];
+	func((payload[off] << 8) + payload[off+1], tagLen,
+	     payload + off + TAG_HDR_SIZE, extra);
+    }
+}
+
 /**********************************************************************
 *%FUNCTION: parsePacket
 *%ARGUMENTS:
@@ -260,6 +440,140 @@ printErr(char const *fmt, ...)
     free(str);
 }
 
+/**********************************************************************
+*%FUNCTION: cpuHasAVX2
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Non-zero if the CPU supports AVX2
+***********************************************************************/
+int
+cpuHasAVX2(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+    static int haveAVX2 = -1;
+
+    if (haveAVX2 < 0) {
+	__builtin_cpu_init();
+	haveAVX2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return haveAVX2;
+#else
+    return 0;
+#endif
+}
+
+#ifdef HAVE_AVX2_CHECKSUM
+/**********************************************************************
+*%FUNCTION: checksumAVX2
+*%ARGUMENTS:
+* addr -- data to sum
+* count -- number of bytes; a multiple of 32
+*%RETURNS:
+* The sum of "addr" as 32-bit words, in a 64-bit accumulator
+*%DESCRIPTION:
+* Widens each 32-byte block to 64-bit lanes and adds them; the lanes
+* cannot overflow for any buffer this is called on.
+***********************************************************************/
+__attribute__((target("avx2")))
+static uint64_t
+checksumAVX2(unsigned char const *addr, int count)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    __m256i v;
+    __m128i s;
+
+    while (count >= 32) {
+	v = _mm256_loadu_si256((__m256i const *) addr);
+	acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+	acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+	addr += 32;
+	count -= 32;
+    }
+    s = _mm_add_epi64(_mm256_castsi256_si128(acc),
+		      _mm256_extracti128_si256(acc, 1));
+    return (uint64_t) _mm_cvtsi128_si64(s) +
+	(uint64_t) _mm_extract_epi64(s, 1);
+}
+#endif
+
+/**********************************************************************
+*%FUNCTION: inetChecksumAdd
+*%ARGUMENTS:
+* sum -- running sum, 0 to start
+* data -- data to add
+* count -- number of bytes
+*%RETURNS:
+* The running sum with "data" added
+*%DESCRIPTION:
+* Adds data to an Internet (RFC 1071) checksum.  Words are summed in host
+* byte order, so the finished checksum can be stored as-is.  Data may
+* have any alignment.  The sum is kept 64 bits at a time, with an AVX2
+* kernel for long buffers where the CPU has it.  Every call but the last
+* for a given checksum must have an even "count".  Finish the checksum
+* with inetChecksumFinish.
+***********************************************************************/
+uint32_t
+inetChecksumAdd(uint32_t sum, void const *data, int count)
+{
+    unsigned char const *addr = data;
+    uint64_t acc = sum;
+    uint64_t v;
+    uint16_t tmp;
+
+#ifdef HAVE_AVX2_CHECKSUM
+    if (count >= 128 && cpuHasAVX2()) {
+	v = checksumAVX2(addr, count & ~31);
+	acc += v;
+	acc += (acc < v);
+	addr += count & ~31;
+	count &= 31;
+    }
+#endif
+    while (count >= 8) {
+	memcpy(&v, addr, sizeof(v));
+	acc += v;
+	acc += (acc < v);	/* End-around carry */
+	addr += sizeof(v);
+	count -= sizeof(v);
+    }
+    while (count > 1) {
+	memcpy(&tmp, addr, sizeof(tmp));
+	acc += tmp;
+	acc += (acc < tmp);
+	addr += sizeof(tmp);
+	count -= sizeof(tmp);
+    }
+    if (count > 0) {
+	tmp = 0;
+	memcpy(&tmp, addr, 1);
+	acc += tmp;
+	acc += (acc < tmp);
+    }
+
+    /* Fold to 32 bits */
+    acc = (acc & 0xffffffff) + (acc >> 32);
+    acc = (acc & 0xffffffff) + (acc >> 32);
+    return (uint32_t) acc;
+}
+
+/**********************************************************************
+*%FUNCTION: inetChecksumFinish
+*%ARGUMENTS:
+* sum -- running sum from inetChecksumAdd
+*%RETURNS:
+* The folded, complemented 16-bit checksum
+***********************************************************************/
+uint16_t
+inetChecksumFinish(uint32_t sum)
+{
+    while(sum >> 16) {
+	sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (uint16_t) ((~sum) & 0xFFFF);
+}
+
 /**********************************************************************
 *%FUNCTION: computeTCPChecksum
 *%ARGUMENTS:
@@ -271,11 +585,8 @@ printErr(char const *fmt, ...)
 uint16_t
 computeTCPChecksum(unsigned char *ipHdr, unsigned char *tcpHdr)
 {
-    uint32_t sum = 0;
+    uint32_t sum;
     uint16_t count = ipHdr[2] * 256 + ipHdr[3];
-    uint16_t tmp;
-
-    unsigned char *addr = tcpHdr;
     unsigned char pseudoHeader[12];
 
     /* Count number of bytes in TCP header and data */
@@ -287,29 +598,143 @@ computeTCPChecksum(unsigned char *ipHdr, unsigned char *tcpHdr)
     pseudoHeader[10] = (count >> 8) & 0xFF;
     pseudoHeader[11] = (count & 0xFF);
 
-    /* Checksum the pseudo-header */
-    sum += * (uint16_t *) pseudoHeader;
-    sum += * ((uint16_t *) (pseudoHeader+2));
-    sum += * ((uint16_t *) (pseudoHeader+4));
-    sum += * ((uint16_t *) (pseudoHeader+6));
-    sum += * ((uint16_t *) (pseudoHeader+8));
-    sum += * ((uint16_t *) (pseudoHeader+10));
+    /* Checksum the pseudo-header, then the TCP header and data */
+    sum = inetChecksumAdd(0, pseudoHeader, sizeof(pseudoHeader));
+    sum = inetChecksumAdd(sum, tcpHdr, count);
+    return inetChecksumFinish(sum);
+}
 
-    /* Checksum the TCP header and data */
-    while (count > 1) {
-	memcpy(&tmp, addr, sizeof(tmp));
-	sum += (uint32_t) tmp;
-	addr += sizeof(tmp);
-	count -= sizeof(tmp);
+/**********************************************************************
+*%FUNCTION: computeTCP6Checksum
+*%ARGUMENTS:
+* ip6Hdr -- pointer to IPv6 header
+* tcpHdr -- pointer to TCP header
+* count -- number of bytes in TCP header and data
+*%RETURNS:
+* The computed TCP checksum
+***********************************************************************/
+uint16_t
+computeTCP6Checksum(unsigned char *ip6Hdr, unsigned char *tcpHdr, int count)
+{
+    uint32_t sum;
+    unsigned char pseudoHeader[40];
+
+    /* Source and destination addresses, upper-layer length, next header */
+    memcpy(pseudoHeader, ip6Hdr+8, 32);
+    pseudoHeader[32] = (count >> 24) & 0xFF;
+    pseudoHeader[33] = (count >> 16) & 0xFF;
+    pseudoHeader[34] = (count >> 8) & 0xFF;
+    pseudoHeader[35] = count & 0xFF;
+    pseudoHeader[36] = 0;
+    pseudoHeader[37] = 0;
+    pseudoHeader[38] = 0;
+    pseudoHeader[39] = IPPROTO_TCP;
+
+    sum = inetChecksumAdd(0, pseudoHeader, sizeof(pseudoHeader));
+    sum = inetChecksumAdd(sum, tcpHdr, count);
+    return inetChecksumFinish(sum);
+}
+
+/**********************************************************************
+*%FUNCTION: adjustChecksum
+*%ARGUMENTS:
+* csum -- pointer to a checksum field in a packet
+* offset -- offset of the changed 16-bit value from the start of the
+*           checksummed data
+* oldVal -- old value (host order)
+* newVal -- new value (host order)
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Updates the Internet checksum at "csum" for one changed 16-bit value,
+* using equation 3 of RFC 1624: HC' = ~(~HC + ~m + m').  A value at an
+* odd offset straddles two checksum words, so it enters the sum byte-
+* swapped.  A checksum that was wrong before stays exactly as wrong.
+***********************************************************************/
+static void
+adjustChecksum(unsigned char *csum, int offset, uint16_t oldVal, uint16_t newVal)
+{
+    uint32_t sum;
+
+    if (offset & 1) {
+	oldVal = (uint16_t) ((oldVal << 8) | (oldVal >> 8));
+	newVal = (uint16_t) ((newVal << 8) | (newVal >> 8));
     }
-    if (count > 0) {
-	sum += (unsigned char) *addr;
+    sum = (uint16_t) ~((csum[0] << 8) | csum[1]);
+    sum += (uint16_t) ~oldVal;
+    sum += newVal;
+    while (sum >> 16) {
+	sum = (sum & 0xffff) + (sum >> 16);
     }
+    sum = ~sum & 0xffff;
+    csum[0] = (sum >> 8) & 0xFF;
+    csum[1] = sum & 0xFF;
+}
 
-    while(sum >> 16) {
-	sum = (sum & 0xffff) + (sum >> 16);
+/**********************************************************************
+*%FUNCTION: sourceAddr
+*%ARGUMENTS:
+* ipHdr -- pointer to IPv4 or IPv6 header
+* buf -- buffer for the result, at least INET6_ADDRSTRLEN bytes
+*%RETURNS:
+* "buf", holding the packet's source address in printable form
+***********************************************************************/
+static char const *
+sourceAddr(unsigned char const *ipHdr, char *buf)
+{
+    if ((ipHdr[0] & 0xF0) == 0x60) {
+	return inet_ntop(AF_INET6, ipHdr+8, buf, INET6_ADDRSTRLEN);
+    }
+    return inet_ntop(AF_INET, ipHdr+12, buf, INET6_ADDRSTRLEN);
+}
+
+/**********************************************************************
+*%FUNCTION: findIPv6TCPHeader
+*%ARGUMENTS:
+* ip6Hdr -- pointer to IPv6 header
+* end -- end of packet data
+*%RETURNS:
+* Pointer to the TCP header, or NULL if the packet is not TCP, is a
+* non-initial fragment, is protected by AH or ESP, or cannot be parsed
+*%DESCRIPTION:
+* Walks the IPv6 extension header chain.
+***********************************************************************/
+static unsigned char *
+findIPv6TCPHeader(unsigned char *ip6Hdr, unsigned char const *end)
+{
+    unsigned char nextHdr = ip6Hdr[6];
+    unsigned char *hdr = ip6Hdr + 40;
+    int hdrLen;
+
+    for (;;) {
+	switch(nextHdr) {
+	case IPPROTO_TCP:
+	    return hdr;
+
+	case IPPROTO_HOPOPTS:
+	case IPPROTO_ROUTING:
+	case IPPROTO_DSTOPTS:
+	    if (hdr + 2 > end) return NULL;
+	    hdrLen = (hdr[1] + 1) * 8;
+	    break;
+
+	case IPPROTO_FRAGMENT:
+	    if (hdr + 8 > end) return NULL;
+	    /* Don't touch anything but the first fragment */
+	    if ((hdr[2] << 8 | (hdr[3] & 0xF8)) != 0) return NULL;
+	    hdrLen = 8;
+	    break;
+
+	default:
+	    /* AH (rewriting the MSS would break its ICV, so leave it
+	       alone as the IPv4 path does), ESP, no next header, or not
+	       TCP */
+	    return NULL;
+	}
+	nextHdr = hdr[0];
+	hdr += hdrLen;
+	if (hdr > end) return NULL;
     }
-    return (uint16_t) ((~sum) & 0xFFFF);
 }
 
 /**********************************************************************
@@ -321,7 +746,9 @@ computeTCPChecksum(unsigned char *ipHdr, unsigned char *tcpHdr)
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* Clamps MSS option if TCP SYN flag is set.
+* Clamps MSS option if TCP SYN flag is set, for IPv4 and IPv6.  The TCP
+* checksum is adjusted incrementally; it is verified over the whole
+* segment first only if ClampMSSVerify is set.
 ***********************************************************************/
 void
 clampMSS(PPPoEPacket *packet, char const *dir, int clampMss)
@@ -330,79 +757,114 @@ clampMSS(PPPoEPacket *packet, char const *dir, int clampMss)
     unsigned char *ipHdr;
     unsigned char *opt;
     unsigned char *endHdr;
+    unsigned char *end;
     unsigned char *mssopt = NULL;
     uint16_t csum;
+    uint16_t proto;
+    char addr[INET6_ADDRSTRLEN];
 
-    int len, minlen;
+    int len, tcpLen;
 
     /* check PPP protocol type */
+    len = (int) ntohs(packet->length);
+    if (len < 1) {
+	return;
+    }
     if (packet->payload[0] & 0x01) {
         /* 8 bit protocol type */
-
-        /* Is it IPv4? */
-        if (packet->payload[0] != 0x21) {
-            /* Nope, ignore it */
-            return;
-        }
-
+	proto = packet->payload[0];
         ipHdr = packet->payload + 1;
-	minlen = 41;
     } else {
         /* 16 bit protocol type */
-
-        /* Is it IPv4? */
-        if (packet->payload[0] != 0x00 ||
-            packet->payload[1] != 0x21) {
-            /* Nope, ignore it */
-            return;
-        }
-
+	if (len < 2) {
+	    return;
+	}
+	proto = packet->payload[0] << 8 | packet->payload[1];
         ipHdr = packet->payload + 2;
-	minlen = 42;
     }
+    end = packet->payload + len;
 
-    /* Is it too short? */
-    len = (int) ntohs(packet->length);
-    if (len < minlen) {
-	/* 20 byte IP header; 20 byte TCP header; at least 1 or 2 byte PPP protocol */
-	return;
-    }
+    if (proto == 0x0021) {
+	/* IPv4: 20 byte IP header; 20 byte TCP header */
+	if (end - ipHdr < 40) {
+	    return;
+	}
 
-    /* Verify once more that it's IPv4 */
-    if ((ipHdr[0] & 0xF0) != 0x40) {
-	return;
-    }
+	/* Verify once more that it's IPv4 */
+	if ((ipHdr[0] & 0xF0) != 0x40) {
+	    return;
+	}
 
-    /* Is it a fragment that's not at the beginning of the packet? */
-    if ((ipHdr[6] & 0x1F) || ipHdr[7]) {
-	/* Yup, don't touch! */
+	/* Is it a fragment that's not at the beginning of the packet? */
+	if ((ipHdr[6] & 0x1F) || ipHdr[7]) {
+	    /* Yup, don't touch! */
+	    return;
+	}
+	/* Is it TCP? */
+	if (ipHdr[9] != 0x06) {
+	    return;
+	}
+
+	/* Get start of TCP header */
+	tcpHdr = ipHdr + (ipHdr[0] & 0x0F) * 4;
+	tcpLen = (int) (ipHdr[2] * 256 + ipHdr[3]) - (int) (tcpHdr - ipHdr);
+    } else if (proto == 0x0057) {
+	/* IPv6: 40 byte IP header; 20 byte TCP header */
+	if (end - ipHdr < 60) {
+	    return;
+	}
+	if ((ipHdr[0] & 0xF0) != 0x60) {
+	    return;
+	}
+	/* Don't read past the IPv6 payload */
+	if (ipHdr + 40 + (ipHdr[4] * 256 + ipHdr[5]) < end) {
+	    end = ipHdr + 40 + (ipHdr[4] * 256 + ipHdr[5]);
+	}
+	tcpHdr = findIPv6TCPHeader(ipHdr, end);
+	if (!tcpHdr) {
+	    return;
+	}
+	tcpLen = (int) (ipHdr + 40 + (ipHdr[4] * 256 + ipHdr[5]) - tcpHdr);
+    } else {
+	/* Nope, ignore it */
 	return;
     }
-    /* Is it TCP? */
-    if (ipHdr[9] != 0x06) {
+
+    /* Is the TCP header all there? */
+    if (tcpHdr + 20 > end || tcpLen < 20) {
 	return;
     }
 
-    /* Get start of TCP header */
-    tcpHdr = ipHdr + (ipHdr[0] & 0x0F) * 4;
-
     /* Is SYN set? */
     if (!(tcpHdr[13] & 0x02)) {
 	return;
     }
 
-    /* Compute and verify TCP checksum -- do not touch a packet with a bad
-       checksum */
-    csum = computeTCPChecksum(ipHdr, tcpHdr);
-    if (csum) {
-	syslog(LOG_ERR, "Bad TCP checksum %x", (unsigned int) csum);
+    /* Optionally verify TCP checksum -- do not touch a packet with a bad
+       checksum.  Without this, a bad checksum stays bad after the
+       incremental update below, so upper layers still drop it. */
+    if (ClampMSSVerify) {
+	if (tcpHdr + tcpLen > end) {
+	    return;
+	}
+	if (proto == 0x0021) {
+	    csum = computeTCPChecksum(ipHdr, tcpHdr);
+	} else {
+	    csum = computeTCP6Checksum(ipHdr, tcpHdr, tcpLen);
+	}
+	if (csum) {
+	    syslog(LOG_ERR, "Bad TCP checksum %x", (unsigned int) csum);
 
-	/* Upper layers will drop it */
-	return;
+	    /* Upper layers will drop it */
+	    return;
+	}
     }
 
     /* Look for existing MSS option */
     endHdr = tcpHdr + ((tcpHdr[12] & 0xF0) >> 2);
+    if (endHdr > end) {
+	return;
+    }
     opt = tcpHdr + 20;
     while (opt < endHdr) {
 	if (!*opt) break;	/* End of options */
@@ -412,15 +874,11 @@ clampMSS(PPPoEPacket *packet, char const *dir, int clampMss)
 	    break;
 
 	case 2:
-	    if (opt[1] != 4) {
+	    if (opt[1] != 4 || opt + 4 > endHdr) {
 		/* Something fishy about MSS option length. */
 		syslog(LOG_ERR,
-		       "Bogus length for MSS option (%u) from %u.%u.%u.%u",
-		       (unsigned int) opt[1],
-		       (unsigned int) ipHdr[12],
-		       (unsigned int) ipHdr[13],
-		       (unsigned int) ipHdr[14],
-		       (unsigned int) ipHdr[15]);
+		       "Bogus length for MSS option (%u) from %s",
+		       (unsigned int) opt[1], sourceAddr(ipHdr, addr));
 		return;
 	    }
 	    mssopt = opt;
@@ -429,12 +887,8 @@ clampMSS(PPPoEPacket *packet, char const *dir, int clampMss)
 	    if (opt[1] < 2) {
 		/* Someone's trying to attack us? */
 		syslog(LOG_ERR,
-		       "Bogus TCP option length (%u) from %u.%u.%u.%u",
-		       (unsigned int) opt[1],
-		       (unsigned int) ipHdr[12],
-		       (unsigned int) ipHdr[13],
-		       (unsigned int) ipHdr[14],
-		       (unsigned int) ipHdr[15]);
+		       "Bogus TCP option length (%u) from %s",
+		       (unsigned int) opt[1], sourceAddr(ipHdr, addr));
 		return;
 	    }
 	    opt += (opt[1]);
@@ -453,16 +907,14 @@ clampMSS(PPPoEPacket *packet, char const *dir, int clampMss)
 
 	mssopt[2] = (((unsigned) clampMss) >> 8) & 0xFF;
 	mssopt[3] = ((unsigned) clampMss) & 0xFF;
+
+	/* Update TCP checksum */
+	adjustChecksum(tcpHdr+16, (int) (mssopt + 2 - tcpHdr),
+		       (uint16_t) mss, (uint16_t) clampMss);
     } else {
 	/* No MSS option.  Don't add one; we'll have to use 536. */
 	return;
     }
-
-    /* Recompute TCP checksum */
-    tcpHdr[16] = 0;
-    tcpHdr[17] = 0;
-    csum = computeTCPChecksum(ipHdr, tcpHdr);
-    (* (uint16_t *) (tcpHdr+16)) = csum;
 }
 
 /***********************************************************************
@@ -21,6 +21,7 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <time.h>
+#include <limits.h>
 
 #ifdef HAVE_SYS_UIO_H
 #include <sys/uio.h>
@@ -51,12 +52,6 @@ int persist = 1;
 int persist = 0;
 #endif
 
-/* Structure used by parseForHostUniq */
-struct HostUniqInfo {
-    char *hostUniq;
-    int forMe;
-};
-
 /* Calculate time remaining until *expire_at into *tv, returns 0 if now >= *expire_at */
 static int
 time_left(struct timeval *tv, struct timeval *expire_at)
@@ -86,35 +81,199 @@ time_left(struct timeval *tv, struct timeval *expire_at)
 }
 
 /**********************************************************************
-*%FUNCTION: parseForHostUniq
+*%FUNCTION: retryDefaults
 *%ARGUMENTS:
-* type -- tag type
-* len -- tag length
-* data -- tag data.
-* extra -- user-supplied pointer.  This is assumed to be a pointer to a
-*          HostUniqInfo structure
+* rs -- retry schedule to initialize
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Sets up the default discovery retry schedule.
+***********************************************************************/
+void
+retryDefaults(RetrySchedule *rs)
+{
+    rs->firstMs = RETRY_FIRST_MS;
+    rs->maxMs = RETRY_MAX_MS;
+    rs->jitterPct = RETRY_JITTER_PCT;
+    rs->attempts = RETRY_ATTEMPTS;
+    rs->seed = 0;
+}
+
+/**********************************************************************
+*%FUNCTION: retryLegacy
+*%ARGUMENTS:
+* rs -- retry schedule
+* seconds -- initial timeout, as given to -t
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Sets up the old schedule: MAX_PADI_ATTEMPTS waits of "seconds", twice
+* that, and so on.  Jitter is left alone.
+***********************************************************************/
+void
+retryLegacy(RetrySchedule *rs, int seconds)
+{
+    if (seconds < 1) seconds = 1;
+    if (seconds > 3600) seconds = 3600;
+    rs->firstMs = seconds * 1000;
+    rs->maxMs = rs->firstMs << (MAX_PADI_ATTEMPTS - 1);
+    rs->attempts = MAX_PADI_ATTEMPTS;
+}
+
+/**********************************************************************
+*%FUNCTION: parseRetrySchedule
+*%ARGUMENTS:
+* rs -- retry schedule to fill in
+* spec -- "first[,max[,jitter[,attempts]]]"; times in milliseconds,
+*         jitter in percent
+*%RETURNS:
+* 0 if "spec" is valid; -1 otherwise (and "rs" is unchanged)
+*%DESCRIPTION:
+* Parses a retry schedule given as an option.  Fields that are left out
+* keep their current values, except that max is raised to first if it
+* would be smaller.
+***********************************************************************/
+int
+parseRetrySchedule(RetrySchedule *rs, char const *spec)
+{
+    RetrySchedule tmp = *rs;
+    int *fields[4];
+    int i;
+    char *end;
+    long v;
+
+    fields[0] = &tmp.firstMs;
+    fields[1] = &tmp.maxMs;
+    fields[2] = &tmp.jitterPct;
+    fields[3] = &tmp.attempts;
+
+    for (i=0; i<4; i++) {
+	v = strtol(spec, &end, 10);
+	if (end == spec || v < 0 || v > 3600000) return -1;
+	*fields[i] = (int) v;
+	if (!*end) break;
+	if (*end != ',') return -1;
+	spec = end + 1;
+    }
+    if (i == 4) return -1;
+
+    if (tmp.firstMs < 10 || tmp.jitterPct > 100 || tmp.attempts < 1) {
+	return -1;
+    }
+    if (tmp.maxMs < tmp.firstMs) tmp.maxMs = tmp.firstMs;
+    *rs = tmp;
+    return 0;
+}
+
+/**********************************************************************
+*%FUNCTION: retryWait
+*%ARGUMENTS:
+* rs -- retry schedule
+* attempt -- number of earlier attempts in this round
+*%RETURNS:
+* How long to wait for a reply, in milliseconds
+*%DESCRIPTION:
+* firstMs doubled "attempt" times and capped at maxMs, then randomized
+* by up to +/- jitterPct percent.
+***********************************************************************/
+int
+retryWait(RetrySchedule *rs, int attempt)
+{
+    long ms = rs->firstMs;
+    int spread;
+
+    while (attempt-- > 0 && ms < rs->maxMs) {
+	ms *= 2;
+    }
+    if (ms > rs->maxMs) ms = rs->maxMs;
+
+    if (rs->jitterPct) {
+	spread = (int) (rand_r(&rs->seed) % (2 * rs->jitterPct + 1)) - rs->jitterPct;
+	ms += ms * spread / 100;
+    }
+    return (ms < 10) ? 10 : (int) ms;
+}
+
+/**********************************************************************
+*%FUNCTION: retrySeed
+*%ARGUMENTS:
+* rs -- retry schedule
+* mac -- our MAC address
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Seeds the jitter.  Mixing in the MAC address keeps CPEs that booted
+* together, and so may share a PID and clock, from picking the same waits.
+***********************************************************************/
+static void
+retrySeed(RetrySchedule *rs, unsigned char const *mac)
+{
+    struct timeval now;
+    int i;
+
+    if (rs->seed) return;
+    gettimeofday(&now, NULL);
+    rs->seed = (unsigned int) getpid() ^ (unsigned int) now.tv_usec ^
+	((unsigned int) now.tv_sec << 12);
+    for (i=0; i<ETH_ALEN; i++) {
+	rs->seed = rs->seed * 31 + mac[i];
+    }
+    if (!rs->seed) rs->seed = 1;
+}
+
+/**********************************************************************
+*%FUNCTION: useLink
+*%ARGUMENTS:
+* conn -- PPPoE connection info
+* link -- index into conn->links
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* If a HostUnique tag is found which matches our PID, sets *extra to 1.
+* Makes "link" the connection's current interface, so everything that
+* works on conn->ifName, conn->discoverySocket and conn->myEth uses it.
+***********************************************************************/
+void
+useLink(PPPoEConnection *conn, int link)
+{
+    DiscoveryLink *dl = &conn->links[link];
+
+    conn->link = link;
+    conn->ifName = dl->ifName;
+    conn->discoverySocket = dl->discoverySocket;
+    conn->sessionSocket = dl->sessionSocket;
+    memcpy(conn->myEth, dl->myEth, ETH_ALEN);
+}
+
+/**********************************************************************
+*%FUNCTION: closeOtherLinks
+*%ARGUMENTS:
+* conn -- PPPoE connection info
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Once a session is up on the current link, closes the sockets of all
+* the others.
 ***********************************************************************/
 static void
-parseForHostUniq(uint16_t type, uint16_t len, unsigned char *data,
-		 void *extra)
+closeOtherLinks(PPPoEConnection *conn)
 {
-    struct HostUniqInfo *hi = (struct HostUniqInfo *) extra;
-    if (!hi->hostUniq) return;
+    int i;
 
-    if (type == TAG_HOST_UNIQ && len == strlen(hi->hostUniq) && !memcmp(data, hi->hostUniq, len)) {
-	hi->forMe = 1;
+    for (i=0; i<conn->numLinks; i++) {
+	DiscoveryLink *dl = &conn->links[i];
+	if (i == conn->link) continue;
+	if (dl->discoverySocket >= 0) closeInterface(dl->discoverySocket);
+	if (dl->sessionSocket >= 0) closeInterface(dl->sessionSocket);
+	dl->discoverySocket = dl->sessionSocket = -1;
     }
+    conn->numLinks = 0;
 }
 
 /**********************************************************************
 *%FUNCTION: packetIsForMe
 *%ARGUMENTS:
 * conn -- PPPoE connection info
-* packet -- a received PPPoE packet
+* ti -- a received PPPoE packet, indexed
 *%RETURNS:
 * 1 if packet is for this PPPoE daemon; 0 otherwise.
 *%DESCRIPTION:
@@ -122,22 +281,42 @@ parseForHostUniq(uint16_t type, uint16_t len, unsigned char *data,
 * our unique identifier.
 ***********************************************************************/
 static int
-packetIsForMe(PPPoEConnection *conn, PPPoEPacket *packet)
+packetIsForMe(PPPoEConnection *conn, TagIndex const *ti)
 {
-    struct HostUniqInfo hi;
+    unsigned char *tag;
 
     /* If packet is not directed to our MAC address, forget it */
-    if (memcmp(packet->ethHdr.h_dest, conn->myEth, ETH_ALEN)) return 0;
+    if (memcmp(ti->packet->ethHdr.h_dest, conn->myEth, ETH_ALEN)) return 0;
 
     /* If we're not using the Host-Unique tag, then accept the packet */
     if (!conn->hostUniq) return 1;
 
-    hi.hostUniq = conn->hostUniq;
-    hi.forMe = 0;
-    parsePacket(packet, parseForHostUniq, &hi);
-    return hi.forMe;
+    tag = indexTag(ti, TAG_HOST_UNIQ, NULL);
+    return tag && ((tag[2] << 8) + tag[3]) == strlen(conn->hostUniq) &&
+	!memcmp(tag + TAG_HDR_SIZE, conn->hostUniq, strlen(conn->hostUniq));
 }
 
+#ifdef PLUGIN
+/**********************************************************************
+*%FUNCTION: useMaxPayload
+*%ARGUMENTS:
+* conn -- PPPoE connection info
+* mru -- PPP-Max-Payload offered by the AC we are talking to, or 0
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Lowers pppd's MRU to what the AC can take (RFC 4638).
+***********************************************************************/
+static void
+useMaxPayload(PPPoEConnection *conn, int mru)
+{
+    if (!mru) return;
+    if (lcp_allowoptions[0].mru > mru) lcp_allowoptions[0].mru = mru;
+    if (lcp_wantoptions[0].mru > mru) lcp_wantoptions[0].mru = mru;
+    conn->seenMaxPayload = 1;
+}
+#endif
+
 /**********************************************************************
 *%FUNCTION: parsePADOTags
 *%ARGUMENTS:
@@ -212,6 +391,21 @@ parsePADOTags(uint16_t type, uint16_t len, unsigned char *data,
 	conn->relayId.length = htons(len);
 	memcpy(conn->relayId.payload, data, len);
 	break;
+    case TAG_VENDOR_SPECIFIC:
+	if (conn->loadVendor && len >= 4 &&
+	    (((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) |
+	     ((uint32_t) data[2] << 8) | data[3]) == conn->loadVendor) {
+	    /* Sub-options: type, length, value */
+	    for (i=4; i+2 <= len && i+2+data[i+1] <= len; i += 2 + data[i+1]) {
+		if (data[i] == LOAD_SUBOPT_PERCENT && data[i+1] == 1) {
+		    pc->load = (data[i+2] > 100) ? 100 : data[i+2];
+		}
+	    }
+	    if (conn->printACNames && pc->load >= 0) {
+		printf("       Load: %d%%\n", pc->load);
+	    }
+	}
+	break;
     case TAG_SERVICE_NAME_ERROR:
 	if (conn->printACNames) {
 	    printf("Got a Service-Name-Error tag: %.*s\n", (int) len, data);
@@ -247,13 +441,12 @@ parsePADOTags(uint16_t type, uint16_t len, unsigned char *data,
 	break;
 #ifdef PLUGIN
     case TAG_PPP_MAX_PAYLOAD:
+	/* Applied only if this AC is the one chosen */
 	if (len == sizeof(mru)) {
 	    memcpy(&mru, data, sizeof(mru));
 	    mru = ntohs(mru);
 	    if (mru >= ETH_PPPOE_MTU) {
-		if (lcp_allowoptions[0].mru > mru) lcp_allowoptions[0].mru = mru;
-		if (lcp_wantoptions[0].mru > mru) lcp_wantoptions[0].mru = mru;
-		conn->seenMaxPayload = 1;
+		pc->maxPayload = mru;
 	    }
 	}
 	break;
@@ -302,9 +495,7 @@ parsePADSTags(uint16_t type, uint16_t len, unsigned char *data,
 	    memcpy(&mru, data, sizeof(mru));
 	    mru = ntohs(mru);
 	    if (mru >= ETH_PPPOE_MTU) {
-		if (lcp_allowoptions[0].mru > mru) lcp_allowoptions[0].mru = mru;
-		if (lcp_wantoptions[0].mru > mru) lcp_wantoptions[0].mru = mru;
-		conn->seenMaxPayload = 1;
+		useMaxPayload(conn, mru);
 	    }
 	}
 	break;
@@ -405,11 +596,137 @@ sendPADI(PPPoEConnection *conn)
 #endif
 }
 
+/* A PADO seen during the collection window */
+typedef struct PadoCandidateStruct {
+    unsigned char mac[ETH_ALEN]; /* AC's MAC address */
+    int link;			/* Link it came in on */
+    long latencyUs;		/* Time since the PADI went out */
+    int load;			/* Advertised load, or -1 */
+    int maxPayload;		/* PPP-Max-Payload offered, or 0 */
+    PPPoETag cookie;		/* AC-Cookie to echo in the PADR */
+    PPPoETag relayId;		/* Relay-Session-Id to echo in the PADR */
+} PadoCandidate;
+
+static PadoCandidate Candidates[MAX_PADO_CANDIDATES];
+static int NumCandidates;
+
+/**********************************************************************
+*%FUNCTION: parsePadoWindow
+*%ARGUMENTS:
+* conn -- PPPoE connection info
+* spec -- "ms[:vendor]"
+*%RETURNS:
+* 0 if "spec" is valid; -1 otherwise
+*%DESCRIPTION:
+* Sets up the PADO collection window.  "vendor" is the IANA enterprise
+* number of the Vendor-Specific tag carrying the AC's load, if any.
+***********************************************************************/
+int
+parsePadoWindow(PPPoEConnection *conn, char const *spec)
+{
+    char *end;
+    long ms;
+    unsigned long vendor = 0;
+
+    ms = strtol(spec, &end, 10);
+    if (end == spec || ms < 0 || ms > 60000) return -1;
+    if (*end == ':') {
+	spec = end + 1;
+	vendor = strtoul(spec, &end, 10);
+	if (end == spec || !vendor || vendor > 0xFFFFFF) return -1;
+    }
+    if (*end) return -1;
+    conn->padoWindowMs = (int) ms;
+    conn->loadVendor = (uint32_t) vendor;
+    return 0;
+}
+
+/**********************************************************************
+*%FUNCTION: addCandidate
+*%ARGUMENTS:
+* conn -- PPPoE connection info; its cookie and relayId are those of
+*         the PADO just parsed
+* mac -- AC's MAC address
+* latencyUs -- how long after the PADI it arrived
+* pc -- what was parsed out of the PADO
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Remembers an acceptable PADO.  Repeats from the same AC on the same
+* link are ignored; past MAX_PADO_CANDIDATES, later arrivals are too.
+***********************************************************************/
+static void
+addCandidate(PPPoEConnection *conn, unsigned char const *mac,
+	     long latencyUs, struct PacketCriteria const *pc)
+{
+    PadoCandidate *c;
+    int i;
+
+    for (i=0; i<NumCandidates; i++) {
+	if (Candidates[i].link == conn->link &&
+	    !memcmp(Candidates[i].mac, mac, ETH_ALEN)) return;
+    }
+    if (NumCandidates >= MAX_PADO_CANDIDATES) return;
+
+    c = &Candidates[NumCandidates++];
+    memcpy(c->mac, mac, ETH_ALEN);
+    c->link = conn->link;
+    c->latencyUs = latencyUs;
+    c->load = pc->load;
+    c->maxPayload = pc->maxPayload;
+    c->cookie = conn->cookie;
+    c->relayId = conn->relayId;
+}
+
+/**********************************************************************
+*%FUNCTION: pickCandidate
+*%ARGUMENTS:
+* conn -- PPPoE connection info
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Chooses the least-loaded AC among the PADOs collected, the quickest
+* to answer among equals (ACs that don't say count as LOAD_UNKNOWN),
+* and sets the connection up to send it a PADR.
+***********************************************************************/
+static void
+pickCandidate(PPPoEConnection *conn)
+{
+    PadoCandidate *best = NULL, *c;
+    int i, load, bestLoad = 0;
+
+    for (i=0; i<NumCandidates; i++) {
+	c = &Candidates[i];
+	load = (c->load < 0) ? LOAD_UNKNOWN : c->load;
+	if (!best || load < bestLoad ||
+	    (load == bestLoad && c->latencyUs < best->latencyUs)) {
+	    best = c;
+	    bestLoad = load;
+	}
+    }
+
+    if (conn->numLinks > 1) {
+	useLink(conn, best->link);
+    }
+    memcpy(conn->peerEth, best->mac, ETH_ALEN);
+    conn->cookie = best->cookie;
+    conn->relayId = best->relayId;
+#ifdef PLUGIN
+    useMaxPayload(conn, best->maxPayload);
+#endif
+    syslog(LOG_INFO, "Chose AC %02x:%02x:%02x:%02x:%02x:%02x on %s out of %d (%ld us, load %d%s)",
+	   best->mac[0], best->mac[1], best->mac[2],
+	   best->mac[3], best->mac[4], best->mac[5],
+	   conn->ifName, NumCandidates, best->latencyUs, bestLoad,
+	   (best->load < 0) ? " assumed" : "");
+    conn->discoveryState = STATE_RECEIVED_PADO;
+}
+
 /**********************************************************************
 *%FUNCTION: waitForPADO
 *%ARGUMENTS:
 * conn -- PPPoEConnection structure
-* timeout -- how long to wait (in seconds)
+* timeout -- how long to wait (in milliseconds)
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
@@ -422,10 +739,15 @@ waitForPADO(PPPoEConnection *conn, int timeout)
     int r;
     struct timeval tv;
     struct timeval expire_at;
+    struct timeval start, now;
+    long latencyUs;
 
     PPPoEPacket packet;
     int len;
 
+    int i, maxfd;
+
+    TagIndex ti;
     struct PacketCriteria pc;
     pc.conn          = conn;
 #ifdef PLUGIN
@@ -435,19 +757,33 @@ waitForPADO(PPPoEConnection *conn, int timeout)
     if (gettimeofday(&expire_at, NULL) < 0) {
 	fatalSys("gettimeofday (waitForPADO)");
     }
-    expire_at.tv_sec += timeout;
+    start = expire_at;
+    NumCandidates = 0;
+    expire_at.tv_sec += timeout / 1000;
+    expire_at.tv_usec += (timeout % 1000) * 1000;
+    if (expire_at.tv_usec >= 1000000) {
+	expire_at.tv_sec++;
+	expire_at.tv_usec -= 1000000;
+    }
 
     do {
         if(!time_left(&tv, &expire_at)) {
             /* Timed out */
-            return;
+            break;
         }
 
         FD_ZERO(&readable);
+        maxfd = conn->discoverySocket;
         FD_SET(conn->discoverySocket, &readable);
+        for (i=0; conn->numLinks > 1 && i<conn->numLinks; i++) {
+            FD_SET(conn->links[i].discoverySocket, &readable);
+            if (conn->links[i].discoverySocket > maxfd) {
+                maxfd = conn->links[i].discoverySocket;
+            }
+        }
 
         while(1) {
-            r = select(conn->discoverySocket+1, &readable, NULL, NULL, &tv);
+            r = select(maxfd+1, &readable, NULL, NULL, &tv);
             if (r >= 0 || errno != EINTR) break;
         }
         if (r < 0) {
@@ -455,9 +791,17 @@ waitForPADO(PPPoEConnection *conn, int timeout)
         }
         if (r == 0) {
             /* Timed out */
-            return;
+            break;
         }
 
+	/* With several uplinks, switch to one that has something */
+	for (i=0; conn->numLinks > 1 && i<conn->numLinks; i++) {
+	    if (FD_ISSET(conn->links[i].discoverySocket, &readable)) {
+		useLink(conn, i);
+		break;
+	    }
+	}
+
 	/* Get the packet */
 	receivePacket(conn->discoverySocket, &packet, &len);
 
@@ -475,8 +819,10 @@ waitForPADO(PPPoEConnection *conn, int timeout)
 	    fflush(conn->debugFile);
 	}
 #endif
+	if (indexPacket(&packet, &ti) < 0) continue;
+
 	/* If it's not for us, loop again */
-	if (!packetIsForMe(conn, &packet)) continue;
+	if (!packetIsForMe(conn, &ti)) continue;
 
 	if (packet.code == CODE_PADO) {
 	    if (BROADCAST(packet.ethHdr.h_source)) {
@@ -496,10 +842,15 @@ waitForPADO(PPPoEConnection *conn, int timeout)
 	    pc.acNameOK      = (conn->acName)      ? 0 : 1;
 	    pc.serviceNameOK = (conn->serviceName) ? 0 : 1;
 
+	    pc.load = -1;
+	    pc.maxPayload = 0;
+	    conn->cookie.type = 0;
+	    conn->relayId.type = 0;
+
             if (conn->printACNames && (conn->numPADOs > 0)) {
                 printf("\n");
             }
-	    parsePacket(&packet, parsePADOTags, &pc);
+	    walkTags(&ti, parsePADOTags, &pc);
 	    if (pc.gotError) {
 		printErr("Error in PADO packet");
 		continue;
@@ -526,11 +877,41 @@ waitForPADO(PPPoEConnection *conn, int timeout)
 			   (unsigned) conn->peerEth[5]);
 		    continue;
 		}
+		if (conn->padoWindowMs > 0) {
+		    /* Keep collecting until the window closes */
+		    gettimeofday(&now, NULL);
+		    latencyUs = (now.tv_sec - start.tv_sec) * 1000000L +
+			(now.tv_usec - start.tv_usec);
+		    if (!NumCandidates) {
+			now.tv_sec += conn->padoWindowMs / 1000;
+			now.tv_usec += (conn->padoWindowMs % 1000) * 1000;
+			if (now.tv_usec >= 1000000) {
+			    now.tv_sec++;
+			    now.tv_usec -= 1000000;
+			}
+			if (timercmp(&now, &expire_at, <)) {
+			    expire_at = now;
+			}
+		    }
+		    addCandidate(conn, packet.ethHdr.h_source, latencyUs, &pc);
+		    continue;
+		}
+		if (conn->numLinks > 1) {
+		    syslog(LOG_INFO, "First PADO came in on %s; using that link",
+			   conn->ifName);
+		}
+#ifdef PLUGIN
+		useMaxPayload(conn, pc.maxPayload);
+#endif
 		conn->discoveryState = STATE_RECEIVED_PADO;
 		break;
 	    }
 	}
     } while (conn->discoveryState != STATE_RECEIVED_PADO);
+
+    if (NumCandidates) {
+	pickCandidate(conn);
+    }
 }
 
 /***********************************************************************
@@ -633,7 +1014,7 @@ sendPADR(PPPoEConnection *conn)
 *%FUNCTION: waitForPADS
 *%ARGUMENTS:
 * conn -- PPPoE connection info
-* timeout -- how long to wait (in seconds)
+* timeout -- how long to wait (in milliseconds)
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
@@ -648,12 +1029,18 @@ waitForPADS(PPPoEConnection *conn, int timeout)
     struct timeval expire_at;
 
     PPPoEPacket packet;
+    TagIndex ti;
     int len;
 
     if (gettimeofday(&expire_at, NULL) < 0) {
 	fatalSys("gettimeofday (waitForPADS)");
     }
-    expire_at.tv_sec += timeout;
+    expire_at.tv_sec += timeout / 1000;
+    expire_at.tv_usec += (timeout % 1000) * 1000;
+    if (expire_at.tv_usec >= 1000000) {
+	expire_at.tv_sec++;
+	expire_at.tv_usec -= 1000000;
+    }
 
     do {
         if(!time_left(&tv, &expire_at)) {
@@ -696,14 +1083,16 @@ waitForPADS(PPPoEConnection *conn, int timeout)
 	/* If it's not from the AC, it's not for me */
 	if (memcmp(packet.ethHdr.h_source, conn->peerEth, ETH_ALEN)) continue;
 
+	if (indexPacket(&packet, &ti) < 0) continue;
+
 	/* If it's not for us, loop again */
-	if (!packetIsForMe(conn, &packet)) continue;
+	if (!packetIsForMe(conn, &ti)) continue;
 
 	/* Is it PADS?  */
 	if (packet.code == CODE_PADS) {
 	    /* Parse for goodies */
 	    conn->PADSHadError = 0;
-	    parsePacket(&packet, parsePADSTags, conn);
+	    walkTags(&ti, parsePADSTags, conn);
 	    if (!conn->PADSHadError) {
 		conn->discoveryState = STATE_SESSION;
 		break;
@@ -723,6 +1112,240 @@ waitForPADS(PPPoEConnection *conn, int timeout)
     }
 }
 
+/**********************************************************************
+*%FUNCTION: resumeHex
+*%ARGUMENTS:
+* fp -- file to write to
+* key -- line key
+* data, len -- bytes to write in hex ("-" if there are none)
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+resumeHex(FILE *fp, char const *key, unsigned char const *data, size_t len)
+{
+    size_t i;
+
+    fprintf(fp, "%s ", key);
+    if (!len) fputc('-', fp);
+    for (i=0; i<len; i++) {
+	fprintf(fp, "%02x", (unsigned int) data[i]);
+    }
+    fputc('\n', fp);
+}
+
+/**********************************************************************
+*%FUNCTION: resumeUnhex
+*%ARGUMENTS:
+* str -- hex string, or "-" for no bytes
+* buf -- where to put the bytes
+* max -- size of buf
+*%RETURNS:
+* Number of bytes decoded, or -1 if "str" is malformed or too long
+***********************************************************************/
+static int
+resumeUnhex(char const *str, unsigned char *buf, size_t max)
+{
+    size_t n = 0;
+    unsigned int b;
+
+    if (!strcmp(str, "-")) return 0;
+    while (str[0] && str[1]) {
+	if (n >= max || sscanf(str, "%2x", &b) != 1) return -1;
+	buf[n++] = (unsigned char) b;
+	str += 2;
+    }
+    return str[0] ? -1 : (int) n;
+}
+
+/**********************************************************************
+*%FUNCTION: resumeSameString
+*%ARGUMENTS:
+* hex -- string from the cache, hex-encoded
+* want -- string the current configuration asks for, or NULL
+*%RETURNS:
+* 1 if they are the same (NULL and empty being the same); 0 otherwise
+***********************************************************************/
+static int
+resumeSameString(char const *hex, char const *want)
+{
+    unsigned char buf[256];
+    int n = resumeUnhex(hex, buf, sizeof(buf));
+
+    if (n < 0) return 0;
+    if (!want) want = "";
+    return (size_t) n == strlen(want) && !memcmp(buf, want, n);
+}
+
+/**********************************************************************
+*%FUNCTION: resumeLoad
+*%ARGUMENTS:
+* conn -- PPPoE connection info
+*%RETURNS:
+* 1 if conn->resumeFile holds a usable session; 0 otherwise
+*%DESCRIPTION:
+* Reads the session left by the previous run.  It is used only if it was
+* made on the same interface with the same Service-Name and AC-Name
+* requirements.  On success, the AC's address, the old session number,
+* and the AC-Cookie and Relay-Session-Id to send back are filled in.
+***********************************************************************/
+static int
+resumeLoad(PPPoEConnection *conn)
+{
+    char line[2 * ETH_DATA_LEN + 64];
+    char key[16], val[2 * ETH_DATA_LEN + 1];
+    unsigned int m[ETH_ALEN], ses = 0;
+    unsigned char cookie[ETH_DATA_LEN], relayId[ETH_DATA_LEN];
+    int cookieLen = -1, relayIdLen = -1;
+    int seen = 0, bad = 0, i;
+    FILE *fp;
+
+    switchToRealID();
+    fp = fopen(conn->resumeFile, "r");
+    switchToEffectiveID();
+    if (!fp) return 0;
+
+    while (!bad && fgets(line, sizeof(line), fp)) {
+	if (sscanf(line, "%15s %3000s", key, val) != 2) continue;
+	if (!strcmp(key, "interface")) {
+	    bad = strcmp(val, conn->ifName) != 0;
+	    for (i=0; bad && i<conn->numLinks; i++) {
+		if (!strcmp(val, conn->links[i].ifName)) {
+		    useLink(conn, i);
+		    bad = 0;
+		}
+	    }
+	    seen |= 1;
+	} else if (!strcmp(key, "ac")) {
+	    bad = sscanf(val, "%2x:%2x:%2x:%2x:%2x:%2x",
+			 &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6;
+	    seen |= 2;
+	} else if (!strcmp(key, "session")) {
+	    bad = sscanf(val, "%u", &ses) != 1 || !ses || ses >= 0xFFFF;
+	    seen |= 4;
+	} else if (!strcmp(key, "service")) {
+	    bad = !resumeSameString(val, conn->serviceName);
+	    seen |= 8;
+	} else if (!strcmp(key, "acname")) {
+	    bad = !resumeSameString(val, conn->acName);
+	    seen |= 16;
+	} else if (!strcmp(key, "cookie")) {
+	    bad = (cookieLen = resumeUnhex(val, cookie, sizeof(cookie))) < 0;
+	} else if (!strcmp(key, "relayid")) {
+	    bad = (relayIdLen = resumeUnhex(val, relayId, sizeof(relayId))) < 0;
+	}
+    }
+    fclose(fp);
+    if (bad || seen != 31) return 0;
+
+    for (i=0; i<ETH_ALEN; i++) {
+	conn->peerEth[i] = (unsigned char) m[i];
+    }
+    if (NOT_UNICAST(conn->peerEth)) return 0;
+#ifdef PLUGIN
+    if (conn->req_peer && memcmp(conn->peerEth, conn->req_peer_mac, ETH_ALEN)) {
+	return 0;
+    }
+#endif
+    conn->session = htons(ses);
+    memset(&conn->cookie, 0, sizeof(conn->cookie));
+    memset(&conn->relayId, 0, sizeof(conn->relayId));
+    if (cookieLen > 0) {
+	conn->cookie.type = htons(TAG_AC_COOKIE);
+	conn->cookie.length = htons(cookieLen);
+	memcpy(conn->cookie.payload, cookie, cookieLen);
+    }
+    if (relayIdLen > 0) {
+	conn->relayId.type = htons(TAG_RELAY_SESSION_ID);
+	conn->relayId.length = htons(relayIdLen);
+	memcpy(conn->relayId.payload, relayId, relayIdLen);
+    }
+    return 1;
+}
+
+/**********************************************************************
+*%FUNCTION: resumeSave
+*%ARGUMENTS:
+* conn -- PPPoE connection info, with a session just established
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Records the session in conn->resumeFile for the next run.  The file
+* is written under a temporary name and renamed, so a crash never
+* leaves half a record behind.
+***********************************************************************/
+static void
+resumeSave(PPPoEConnection *conn)
+{
+    char tmp[PATH_MAX];
+    FILE *fp;
+    int ok;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", conn->resumeFile) >= (int) sizeof(tmp)) {
+	return;
+    }
+    switchToRealID();
+    fp = fopen(tmp, "w");
+    if (!fp) {
+	syslog(LOG_WARNING, "Cannot write session cache %s: %m", tmp);
+	switchToEffectiveID();
+	return;
+    }
+    fprintf(fp, "interface %s\n", conn->ifName);
+    fprintf(fp, "ac %02x:%02x:%02x:%02x:%02x:%02x\n",
+	    conn->peerEth[0], conn->peerEth[1], conn->peerEth[2],
+	    conn->peerEth[3], conn->peerEth[4], conn->peerEth[5]);
+    fprintf(fp, "session %u\n", (unsigned int) ntohs(conn->session));
+    resumeHex(fp, "service", (unsigned char const *) conn->serviceName,
+	      conn->serviceName ? strlen(conn->serviceName) : 0);
+    resumeHex(fp, "acname", (unsigned char const *) conn->acName,
+	      conn->acName ? strlen(conn->acName) : 0);
+    resumeHex(fp, "cookie", conn->cookie.payload,
+	      conn->cookie.type ? ntohs(conn->cookie.length) : 0);
+    resumeHex(fp, "relayid", conn->relayId.payload,
+	      conn->relayId.type ? ntohs(conn->relayId.length) : 0);
+    ok = !ferror(fp);
+    if (fclose(fp) || !ok || rename(tmp, conn->resumeFile) < 0) {
+	syslog(LOG_WARNING, "Cannot write session cache %s: %m", conn->resumeFile);
+	unlink(tmp);
+    }
+    switchToEffectiveID();
+}
+
+/**********************************************************************
+*%FUNCTION: resumeSession
+*%ARGUMENTS:
+* conn -- PPPoE connection info
+*%RETURNS:
+* 1 if a session was set up from the cache; 0 otherwise
+*%DESCRIPTION:
+* Tears down the session the previous run left behind with a PADT, then
+* goes straight to a PADR toward the same AC, skipping PADI/PADO.  If the
+* AC doesn't answer within one wait, discovery starts over from PADI.
+***********************************************************************/
+static int
+resumeSession(PPPoEConnection *conn)
+{
+    if (!resumeLoad(conn)) return 0;
+
+    syslog(LOG_INFO, "Resuming: closing old session %d and sending PADR to %02x:%02x:%02x:%02x:%02x:%02x",
+	   (int) ntohs(conn->session),
+	   conn->peerEth[0], conn->peerEth[1], conn->peerEth[2],
+	   conn->peerEth[3], conn->peerEth[4], conn->peerEth[5]);
+    sendPADT(conn, "RP-PPPoE: Stale session from before restart");
+
+    sendPADR(conn);
+    conn->discoveryState = STATE_SENT_PADR;
+    waitForPADS(conn, retryWait(&conn->retry, 0));
+    if (conn->discoveryState == STATE_SESSION) return 1;
+
+    syslog(LOG_INFO, "Resuming failed; falling back to full discovery");
+    memset(&conn->cookie, 0, sizeof(conn->cookie));
+    memset(&conn->relayId, 0, sizeof(conn->relayId));
+    memset(conn->peerEth, 0, ETH_ALEN);
+    return 0;
+}
+
 /**********************************************************************
 *%FUNCTION: discovery
 *%ARGUMENTS:
@@ -737,7 +1360,7 @@ discovery(PPPoEConnection *conn)
 {
     int padiAttempts;
     int padrAttempts;
-    int timeout = conn->discoveryTimeout;
+    int i;
 
     /* Skip discovery? */
     if (conn->skipDiscovery) {
@@ -749,29 +1372,39 @@ discovery(PPPoEConnection *conn)
 	return;
     }
 
+    retrySeed(&conn->retry, conn->myEth);
+
+    if (conn->resumeFile && !conn->printACNames && resumeSession(conn)) {
+	goto SESSION_UP;
+    }
+
   SEND_PADI:
     padiAttempts = 0;
     do {
 	padiAttempts++;
-	if (padiAttempts > MAX_PADI_ATTEMPTS) {
+	if (padiAttempts > conn->retry.attempts) {
 	    printErr("Timeout waiting for PADO packets");
 	    if (persist) {
-		padiAttempts = 0;
-		timeout = conn->discoveryTimeout;
+		padiAttempts = 1;
 	    } else {
                 break;
 	    }
 	}
-	sendPADI(conn);
+	if (conn->numLinks > 1) {
+	    for (i=0; i<conn->numLinks; i++) {
+		useLink(conn, i);
+		sendPADI(conn);
+	    }
+	} else {
+	    sendPADI(conn);
+	}
 	conn->discoveryState = STATE_SENT_PADI;
-	waitForPADO(conn, timeout);
 
 	/* If we're just probing for access concentrators, don't do
-	   exponential backoff.  This reduces the time for an unsuccessful
-	   probe to 15 seconds. */
-	if (!conn->printACNames) {
-	    timeout *= 2;
-	}
+	   exponential backoff.  This keeps an unsuccessful probe short. */
+	waitForPADO(conn, retryWait(&conn->retry,
+				    conn->printACNames ? 0 : padiAttempts - 1));
+
 	if (conn->printACNames && conn->numPADOs) {
 	    break;
 	}
@@ -786,15 +1419,12 @@ discovery(PPPoEConnection *conn)
         }
     }
 
-    timeout = conn->discoveryTimeout;
     padrAttempts = 0;
     do {
 	padrAttempts++;
-	if (padrAttempts > MAX_PADI_ATTEMPTS) {
+	if (padrAttempts > conn->retry.attempts) {
 	    printErr("Timeout waiting for PADS packets");
 	    if (persist) {
-		padrAttempts = 0;
-		timeout = conn->discoveryTimeout;
 		/* Go back to sending PADI again */
 		goto SEND_PADI;
 	    } else {
@@ -803,10 +1433,17 @@ discovery(PPPoEConnection *conn)
 	}
 	sendPADR(conn);
 	conn->discoveryState = STATE_SENT_PADR;
-	waitForPADS(conn, timeout);
-	timeout *= 2;
+	waitForPADS(conn, retryWait(&conn->retry, padrAttempts - 1));
     } while (conn->discoveryState == STATE_SENT_PADR);
 
+  SESSION_UP:
+    if (conn->numLinks > 1) {
+	closeOtherLinks(conn);
+    }
+    if (conn->resumeFile) {
+	resumeSave(conn);
+    }
+
 #ifdef PLUGIN
     if (!conn->seenMaxPayload) {
 	/* RFC 4638: MUST limit MTU/MRU to 1492 */
@@ -0,0 +1,289 @@
+/***********************************************************************
+*
+* fcs.c
+*
+* Implementation of user-space PPPoE redirector for Linux.
+*
+* PPP frame check sequence (CRC-16/X.25, RFC 1662) computation.
+*
+* Copyright (C) 2000-2012 by Roaring Penguin Software Inc.
+* Copyright (C) 2018-2023 Dianne Skoll
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+* SPDX-License-Identifier: GPL-2.0-or-later
+*
+***********************************************************************/
+
+#include "config.h"
+
+#include <string.h>
+#include <endian.h>
+
+#include "pppoe.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_CLMUL_FCS 1
+#endif
+
+static uint16_t const fcstab[256] = {
+    0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
+    0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
+    0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
+    0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
+    0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
+    0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
+    0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
+    0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
+    0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
+    0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
+    0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
+    0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
+    0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
+    0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
+    0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
+    0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
+    0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
+    0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
+    0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
+    0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
+    0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
+    0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
+    0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
+    0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
+    0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
+    0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
+    0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
+    0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
+    0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
+    0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
+    0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
+    0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
+};
+
+/* Slicing-by-8 tables: fcsSlice[k][b] is the FCS contribution of byte b
+   followed by k zero bytes.  fcsSlice[0] is fcstab. */
+static uint16_t fcsSlice[8][256];
+static int fcsSliceReady = 0;
+
+#ifdef HAVE_CLMUL_FCS
+/* Folding constants for the carry-less multiply kernel.  With P(x) =
+   x^16 + x^12 + x^5 + 1, these are x^191 mod P and x^127 mod P, bit-
+   reflected into the top 16 bits of a 64-bit lane.  (The extra factor of
+   x that a reflected carry-less product introduces makes them fold by
+   x^192 and x^128.) */
+#define FCS_FOLD_HI 0xa95d000000000000ULL
+#define FCS_FOLD_LO 0x7eea000000000000ULL
+
+/* Below this many bytes the sliced version is as fast */
+#define CLMUL_MIN_LEN 64
+
+/* -1 = not yet probed, 0 = no, 1 = yes */
+static int haveClmul = -1;
+#endif
+
+/**********************************************************************
+*%FUNCTION: pppFCS16
+*%ARGUMENTS:
+* fcs -- current fcs
+* cp -- a buffer's worth of data
+* len -- length of buffer "cp"
+*%RETURNS:
+* A new FCS
+*%DESCRIPTION:
+* Updates the PPP FCS one byte at a time.  This is the reference
+* implementation; pppFCS16Fast must always agree with it.
+***********************************************************************/
+uint16_t
+pppFCS16(uint16_t fcs,
+	 unsigned char * cp,
+	 int len)
+{
+    while (len--)
+	fcs = (fcs >> 8) ^ fcstab[(fcs ^ *cp++) & 0xff];
+
+    return (fcs);
+}
+
+/**********************************************************************
+*%FUNCTION: initSliceTables
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Derives the slicing-by-8 tables from fcstab.
+***********************************************************************/
+static void
+initSliceTables(void)
+{
+    int i, k;
+
+    for (i=0; i<256; i++) {
+	fcsSlice[0][i] = fcstab[i];
+    }
+    for (k=1; k<8; k++) {
+	for (i=0; i<256; i++) {
+	    fcsSlice[k][i] = (fcsSlice[k-1][i] >> 8) ^
+		fcstab[fcsSlice[k-1][i] & 0xff];
+	}
+    }
+    fcsSliceReady = 1;
+}
+
+/**********************************************************************
+*%FUNCTION: pppFCS16Sliced
+*%ARGUMENTS:
+* fcs -- current fcs
+* cp -- a buffer's worth of data
+* len -- length of buffer "cp"
+*%RETURNS:
+* A new FCS
+*%DESCRIPTION:
+* Updates the PPP FCS eight bytes at a time using slicing-by-8 tables.
+***********************************************************************/
+uint16_t
+pppFCS16Sliced(uint16_t fcs, unsigned char const *cp, int len)
+{
+    uint32_t lo, hi;
+
+    if (!fcsSliceReady) initSliceTables();
+
+    while (len >= 8) {
+	memcpy(&lo, cp, 4);
+	memcpy(&hi, cp + 4, 4);
+	lo = le32toh(lo) ^ fcs;
+	hi = le32toh(hi);
+	fcs = fcsSlice[7][lo & 0xff] ^
+	    fcsSlice[6][(lo >> 8) & 0xff] ^
+	    fcsSlice[5][(lo >> 16) & 0xff] ^
+	    fcsSlice[4][lo >> 24] ^
+	    fcsSlice[3][hi & 0xff] ^
+	    fcsSlice[2][(hi >> 8) & 0xff] ^
+	    fcsSlice[1][(hi >> 16) & 0xff] ^
+	    fcsSlice[0][hi >> 24];
+	cp += 8;
+	len -= 8;
+    }
+    while (len--) {
+	fcs = (fcs >> 8) ^ fcstab[(fcs ^ *cp++) & 0xff];
+    }
+    return fcs;
+}
+
+#ifdef HAVE_CLMUL_FCS
+/**********************************************************************
+*%FUNCTION: fcsClmulKernel
+*%ARGUMENTS:
+* fcs -- current fcs
+* cp -- a buffer's worth of data
+* len -- length of buffer "cp"; at least 32
+*%RETURNS:
+* A new FCS
+*%DESCRIPTION:
+* Folds the buffer 16 bytes at a time with PCLMULQDQ.  The running FCS is
+* XORed into the first two bytes, which turns the problem into a CRC with
+* zero initial value; each 128-bit block is then multiplied forward onto
+* the next, preserving the remainder modulo P.  The last folded block and
+* any odd tail are finished with the sliced version.
+***********************************************************************/
+__attribute__((target("pclmul,sse2")))
+static uint16_t
+fcsClmulKernel(uint16_t fcs, unsigned char const *cp, int len)
+{
+    __m128i k = _mm_set_epi64x((long long) FCS_FOLD_LO,
+			       (long long) FCS_FOLD_HI);
+    __m128i x, next;
+    unsigned char last[16];
+
+    x = _mm_loadu_si128((__m128i const *) cp);
+    x = _mm_xor_si128(x, _mm_cvtsi32_si128(fcs));
+    cp += 16;
+    len -= 16;
+
+    while (len >= 16) {
+	next = _mm_loadu_si128((__m128i const *) cp);
+	x = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+					_mm_clmulepi64_si128(x, k, 0x11)),
+			  next);
+	cp += 16;
+	len -= 16;
+    }
+
+    _mm_storeu_si128((__m128i *) last, x);
+    fcs = pppFCS16Sliced(0, last, 16);
+    return pppFCS16Sliced(fcs, cp, len);
+}
+
+/**********************************************************************
+*%FUNCTION: pppFCS16HaveClmul
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Non-zero if the CPU supports the carry-less multiply kernel
+***********************************************************************/
+int
+pppFCS16HaveClmul(void)
+{
+    if (haveClmul < 0) {
+	__builtin_cpu_init();
+	haveClmul = __builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("sse2");
+    }
+    return haveClmul;
+}
+#else
+int
+pppFCS16HaveClmul(void)
+{
+    return 0;
+}
+#endif
+
+/**********************************************************************
+*%FUNCTION: pppFCS16Clmul
+*%ARGUMENTS:
+* fcs -- current fcs
+* cp -- a buffer's worth of data
+* len -- length of buffer "cp"
+*%RETURNS:
+* A new FCS
+*%DESCRIPTION:
+* Updates the PPP FCS using carry-less multiplication.  Short buffers,
+* and CPUs without PCLMULQDQ, are handled by pppFCS16Sliced.
+***********************************************************************/
+uint16_t
+pppFCS16Clmul(uint16_t fcs, unsigned char const *cp, int len)
+{
+#ifdef HAVE_CLMUL_FCS
+    if (len >= 32 && pppFCS16HaveClmul()) {
+	return fcsClmulKernel(fcs, cp, len);
+    }
+#endif
+    return pppFCS16Sliced(fcs, cp, len);
+}
+
+/**********************************************************************
+*%FUNCTION: pppFCS16Fast
+*%ARGUMENTS:
+* fcs -- current fcs
+* cp -- a buffer's worth of data
+* len -- length of buffer "cp"
+*%RETURNS:
+* A new FCS
+*%DESCRIPTION:
+* Updates the PPP FCS with the quickest implementation for this CPU and
+* buffer length.
+***********************************************************************/
+uint16_t
+pppFCS16Fast(uint16_t fcs, unsigned char const *cp, int len)
+{
+#ifdef HAVE_CLMUL_FCS
+    if (len >= CLMUL_MIN_LEN && pppFCS16HaveClmul()) {
+	return fcsClmulKernel(fcs, cp, len);
+    }
+#endif
+    return pppFCS16Sliced(fcs, cp, len);
+}
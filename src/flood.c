@@ -0,0 +1,557 @@
+/***********************************************************************
+*
+* flood.c
+*
+* Implementation of user-space PPPoE redirector for Linux.
+*
+* Discovery load generator (the -F option).  Simulates many clients,
+* each with its own MAC address and Host-Uniq, from one event loop and
+* reports how the access concentrator coped.
+*
+* USED FOR STRESS-TESTING ONLY.  DO NOT USE IT AGAINST A REAL ISP.
+*
+* Copyright (C) 2000-2012 by Roaring Penguin Software Inc.
+* Copyright (C) 2018-2023 Dianne Skoll
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+* SPDX-License-Identifier: GPL-2.0-or-later
+*
+***********************************************************************/
+
+#include "config.h"
+
+#include <syslog.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+
+#include "pppoe.h"
+
+/* Client states */
+#define FC_IDLE      0		/* Not started yet */
+#define FC_WAIT_PADO 1		/* PADI sent */
+#define FC_WAIT_PADS 2		/* PADR sent */
+#define FC_HOLD      3		/* Session up; PADT due at deadline */
+#define FC_DONE      4		/* Finished, successfully or not */
+
+/* Simulated clients are numbered by the low three bytes of their MAC */
+#define MAX_FLOOD_CLIENTS (1 << 24)
+
+/* How often to look for clients that have timed out (ns) */
+#define SCAN_INTERVAL 10000000ULL
+
+/* Most clients started in one pass of the loop */
+#define START_BURST 64
+
+#define NSEC_PER_SEC 1000000000ULL
+
+typedef struct FloodClientStruct {
+    int state;			/* FC_IDLE etc. */
+    uint16_t session;		/* Session number from PADS */
+    unsigned char acMac[ETH_ALEN]; /* MAC address of AC that answered */
+    uint64_t sent;		/* When the last PADI or PADR went out */
+    uint64_t deadline;		/* When the current state expires */
+} FloodClient;
+
+typedef struct FloodStatsStruct {
+    unsigned long padiSent;
+    unsigned long padoRcvd;
+    unsigned long padoErrors;
+    unsigned long padoTimeouts;
+    unsigned long padrSent;
+    unsigned long padsRcvd;
+    unsigned long padsErrors;
+    unsigned long padsTimeouts;
+    unsigned long padtSent;
+    unsigned long padtRcvd;
+    unsigned long stray;	/* Frames that matched no waiting client */
+    uint32_t *padoLatency;	/* PADI to PADO, microseconds */
+    uint32_t *padsLatency;	/* PADR to PADS, microseconds */
+} FloodStats;
+
+/* What we need from a PADO or PADS */
+struct FloodTags {
+    int haveHostUniq;
+    uint32_t hostUniq;
+    int error;
+    unsigned char *cookie;	/* AC-Cookie tag, header included */
+    unsigned char *relayId;	/* Relay-Session-Id tag, header included */
+};
+
+static FloodClient *Clients;
+static int NumClients;
+static FloodStats Stats;
+static unsigned char MacPrefix[3];
+static volatile sig_atomic_t Interrupted = 0;
+
+/**********************************************************************
+*%FUNCTION: nowNsec
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* The monotonic clock in nanoseconds
+***********************************************************************/
+static uint64_t
+nowNsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**********************************************************************
+*%FUNCTION: floodInterrupt
+*%ARGUMENTS:
+* sig -- signal number
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* SIGINT handler: stops the run early so the report is still printed.
+***********************************************************************/
+static void
+floodInterrupt(int sig)
+{
+    (void) sig;
+    Interrupted = 1;
+}
+
+/**********************************************************************
+*%FUNCTION: clientMac
+*%ARGUMENTS:
+* idx -- client number
+* mac -- set to client's MAC address
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Synthetic MAC addresses are locally administered, share a three-byte
+* prefix taken from the interface and carry the client number in the
+* low three bytes.
+***********************************************************************/
+static void
+clientMac(int idx, unsigned char *mac)
+{
+    memcpy(mac, MacPrefix, 3);
+    mac[3] = (idx >> 16) & 0xFF;
+    mac[4] = (idx >> 8) & 0xFF;
+    mac[5] = idx & 0xFF;
+}
+
+/**********************************************************************
+*%FUNCTION: macToClient
+*%ARGUMENTS:
+* mac -- destination MAC address of a received frame
+*%RETURNS:
+* The client number, or -1 if the frame is not for one of our clients
+***********************************************************************/
+static int
+macToClient(unsigned char const *mac)
+{
+    int idx;
+
+    if (memcmp(mac, MacPrefix, 3)) return -1;
+    idx = (mac[3] << 16) | (mac[4] << 8) | mac[5];
+    return (idx < NumClients) ? idx : -1;
+}
+
+/**********************************************************************
+*%FUNCTION: putTag
+*%ARGUMENTS:
+* cursor -- where to write the tag; advanced past it
+* type -- tag type
+* len -- length of tag data
+* data -- tag data
+*%RETURNS:
+* Number of bytes written
+***********************************************************************/
+static int
+putTag(unsigned char **cursor, uint16_t type, uint16_t len, void const *data)
+{
+    unsigned char *c = *cursor;
+
+    c[0] = type >> 8;
+    c[1] = type & 0xFF;
+    c[2] = len >> 8;
+    c[3] = len & 0xFF;
+    if (len) memcpy(c + TAG_HDR_SIZE, data, len);
+    *cursor = c + TAG_HDR_SIZE + len;
+    return TAG_HDR_SIZE + len;
+}
+
+/**********************************************************************
+*%FUNCTION: floodSend
+*%ARGUMENTS:
+* conn -- PPPoE connection
+* idx -- client number
+* code -- PPPoE code (CODE_PADI, CODE_PADR or CODE_PADT)
+* dest -- destination MAC address
+* session -- session number (network order)
+* tags -- tags received in PADO, echoed in PADR; may be NULL
+*%RETURNS:
+* 0 if the frame was sent; -1 if its tags would not fit
+*%DESCRIPTION:
+* Builds and sends a discovery frame on behalf of a simulated client.
+***********************************************************************/
+static int
+floodSend(PPPoEConnection *conn, int idx, unsigned int code,
+	  unsigned char const *dest, uint16_t session,
+	  struct FloodTags const *tags)
+{
+    PPPoEPacket packet;
+    unsigned char *cursor = packet.payload;
+    uint32_t hostUniq = htonl((uint32_t) idx);
+    int plen = 0;
+    int len;
+
+    memcpy(packet.ethHdr.h_dest, dest, ETH_ALEN);
+    clientMac(idx, packet.ethHdr.h_source);
+    packet.ethHdr.h_proto = htons(Eth_PPPOE_Discovery);
+    packet.vertype = PPPOE_VER_TYPE(1, 1);
+    packet.code = code;
+    packet.session = session;
+
+    if (code != CODE_PADT) {
+	len = conn->serviceName ? strlen(conn->serviceName) : 0;
+	if (plen + TAG_HDR_SIZE + len > MAX_PPPOE_PAYLOAD) return -1;
+	plen += putTag(&cursor, TAG_SERVICE_NAME, len, conn->serviceName);
+    }
+    if (plen + TAG_HDR_SIZE + (int) sizeof(hostUniq) > MAX_PPPOE_PAYLOAD) return -1;
+    plen += putTag(&cursor, TAG_HOST_UNIQ, sizeof(hostUniq), &hostUniq);
+    if (tags && tags->cookie) {
+	len = TAG_HDR_SIZE + ((tags->cookie[2] << 8) | tags->cookie[3]);
+	if (plen + len > MAX_PPPOE_PAYLOAD) return -1;
+	memcpy(cursor, tags->cookie, len);
+	cursor += len;
+	plen += len;
+    }
+    if (tags && tags->relayId) {
+	len = TAG_HDR_SIZE + ((tags->relayId[2] << 8) | tags->relayId[3]);
+	if (plen + len > MAX_PPPOE_PAYLOAD) return -1;
+	memcpy(cursor, tags->relayId, len);
+	cursor += len;
+	plen += len;
+    }
+    packet.length = htons(plen);
+    sendPacket(conn, conn->discoverySocket, &packet, plen + HDR_SIZE);
+
+    switch(code) {
+    case CODE_PADI: Stats.padiSent++; break;
+    case CODE_PADR: Stats.padrSent++; break;
+    case CODE_PADT: Stats.padtSent++; break;
+    }
+    return 0;
+}
+
+/**********************************************************************
+*%FUNCTION: getFloodTags
+*%ARGUMENTS:
+* ti -- a received PADO or PADS, indexed
+* tags -- struct FloodTags to fill in
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Looks up the tags a simulated client needs from an indexed PADO or
+* PADS.
+***********************************************************************/
+static void
+getFloodTags(TagIndex const *ti, struct FloodTags *tags)
+{
+    unsigned char *tag;
+
+    tag = indexTag(ti, TAG_HOST_UNIQ, NULL);
+    if (tag && ((tag[2] << 8) | tag[3]) == sizeof(tags->hostUniq)) {
+	memcpy(&tags->hostUniq, tag + TAG_HDR_SIZE, sizeof(tags->hostUniq));
+	tags->haveHostUniq = 1;
+    }
+    tags->cookie = indexTag(ti, TAG_AC_COOKIE, NULL);
+    tags->relayId = indexTag(ti, TAG_RELAY_SESSION_ID, NULL);
+    tags->error = indexTag(ti, TAG_SERVICE_NAME_ERROR, NULL) ||
+	indexTag(ti, TAG_AC_SYSTEM_ERROR, NULL) ||
+	indexTag(ti, TAG_GENERIC_ERROR, NULL);
+}
+
+/**********************************************************************
+*%FUNCTION: floodReceive
+*%ARGUMENTS:
+* conn -- PPPoE connection
+* packet -- received discovery frame
+* size -- size of frame
+* hold -- seconds to hold a session before sending PADT
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Advances the client a PADO, PADS or PADT is addressed to.
+***********************************************************************/
+static void
+floodReceive(PPPoEConnection *conn, PPPoEPacket *packet, int size, int hold)
+{
+    struct FloodTags tags;
+    TagIndex ti;
+    FloodClient *fc;
+    uint64_t now;
+    int idx;
+
+    if (size < (int) HDR_SIZE || ntohs(packet->length) + HDR_SIZE > (unsigned int) size) {
+	Stats.stray++;
+	return;
+    }
+    idx = macToClient(packet->ethHdr.h_dest);
+    if (idx < 0) return;
+    fc = &Clients[idx];
+
+    if (indexPacket(packet, &ti) < 0) {
+	Stats.stray++;
+	return;
+    }
+    memset(&tags, 0, sizeof(tags));
+    getFloodTags(&ti, &tags);
+    if (packet->code != CODE_PADT &&
+	(!tags.haveHostUniq || ntohl(tags.hostUniq) != (uint32_t) idx)) {
+	Stats.stray++;
+	return;
+    }
+
+    now = nowNsec();
+    switch(packet->code) {
+    case CODE_PADO:
+	if (fc->state != FC_WAIT_PADO) break;
+	Stats.padoLatency[Stats.padoRcvd++] = (now - fc->sent) / 1000;
+	if (tags.error || NOT_UNICAST(packet->ethHdr.h_source)) {
+	    Stats.padoErrors++;
+	    fc->state = FC_DONE;
+	    return;
+	}
+	memcpy(fc->acMac, packet->ethHdr.h_source, ETH_ALEN);
+	if (floodSend(conn, idx, CODE_PADR, fc->acMac, 0, &tags) < 0) {
+	    /* Cookie and Relay-Session-Id too big to echo */
+	    Stats.padoErrors++;
+	    fc->state = FC_DONE;
+	    return;
+	}
+	fc->sent = now;
+	fc->deadline = now + (uint64_t) conn->retry.maxMs * 1000000;
+	fc->state = FC_WAIT_PADS;
+	return;
+
+    case CODE_PADS:
+	if (fc->state != FC_WAIT_PADS ||
+	    memcmp(packet->ethHdr.h_source, fc->acMac, ETH_ALEN)) {
+	    break;
+	}
+	Stats.padsLatency[Stats.padsRcvd++] = (now - fc->sent) / 1000;
+	if (tags.error || packet->session == 0) {
+	    Stats.padsErrors++;
+	    fc->state = FC_DONE;
+	    return;
+	}
+	fc->session = packet->session;
+	fc->deadline = now + (uint64_t) hold * NSEC_PER_SEC;
+	fc->state = FC_HOLD;
+	return;
+
+    case CODE_PADT:
+	if (fc->state != FC_HOLD || packet->session != fc->session) break;
+	Stats.padtRcvd++;
+	fc->state = FC_DONE;
+	return;
+    }
+    Stats.stray++;
+}
+
+/**********************************************************************
+*%FUNCTION: floodExpire
+*%ARGUMENTS:
+* conn -- PPPoE connection
+* fc -- client to check
+* now -- current time
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Handles a client whose deadline has passed: a discovery timeout, or
+* the end of its hold time, at which point it sends PADT.
+***********************************************************************/
+static void
+floodExpire(PPPoEConnection *conn, FloodClient *fc, uint64_t now)
+{
+    if (now < fc->deadline) return;
+
+    switch(fc->state) {
+    case FC_WAIT_PADO:
+	Stats.padoTimeouts++;
+	break;
+    case FC_WAIT_PADS:
+	Stats.padsTimeouts++;
+	break;
+    case FC_HOLD:
+	floodSend(conn, (int) (fc - Clients), CODE_PADT, fc->acMac,
+		  fc->session, NULL);
+	break;
+    default:
+	return;
+    }
+    fc->state = FC_DONE;
+}
+
+/**********************************************************************
+*%FUNCTION: cmpLatency
+*%ARGUMENTS:
+* a, b -- pointers to latencies
+*%RETURNS:
+* qsort comparison result
+***********************************************************************/
+static int
+cmpLatency(void const *a, void const *b)
+{
+    uint32_t x = *(uint32_t const *) a;
+    uint32_t y = *(uint32_t const *) b;
+    return (x > y) - (x < y);
+}
+
+/**********************************************************************
+*%FUNCTION: printLatency
+*%ARGUMENTS:
+* what -- label
+* lat -- latencies in microseconds
+* n -- number of latencies
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Prints latency percentiles in milliseconds.
+***********************************************************************/
+static void
+printLatency(char const *what, uint32_t *lat, unsigned long n)
+{
+    if (!n) {
+	printf("%s latency: no replies\n", what);
+	return;
+    }
+    qsort(lat, n, sizeof(lat[0]), cmpLatency);
+    printf("%s latency (ms): p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n", what,
+	   lat[(n - 1) * 50 / 100] / 1000.0,
+	   lat[(n - 1) * 90 / 100] / 1000.0,
+	   lat[(n - 1) * 99 / 100] / 1000.0,
+	   lat[n - 1] / 1000.0);
+}
+
+/**********************************************************************
+*%FUNCTION: floodDiscovery
+*%ARGUMENTS:
+* conn -- PPPoE connection; the discovery socket is opened here
+* clients -- number of simulated clients
+* rate -- clients started per second; 0 starts them all at once
+* hold -- seconds each client holds its session before sending PADT
+*%RETURNS:
+* Nothing; exits when all clients are done
+*%DESCRIPTION:
+* Runs "clients" simulated PPPoE clients against the access concentrator.
+* Each sends a PADI, answers the first PADO with a PADR, holds the
+* session for "hold" seconds and then sends PADT.  A client that gets no
+* reply within the longest wait of the retry schedule (conn->retry.maxMs:
+* 8 s by default, four times the -t value with -t) is counted as timed
+* out and gives up.  When every client is done, or on SIGINT, a summary with
+* latency percentiles is printed on standard output.
+***********************************************************************/
+void
+floodDiscovery(PPPoEConnection *conn, int clients, int rate, int hold)
+{
+    static PPPoEPacket batch[MAX_RECV_BATCH];
+    static int sizes[MAX_RECV_BATCH];
+    unsigned char bcast[ETH_ALEN] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    struct pollfd pfd;
+    uint64_t start, now, due, nextScan, interval, elapsed;
+    int next = 0, first = 0;
+    int i, n, burst, timeout;
+
+    if (clients > MAX_FLOOD_CLIENTS) {
+	rp_fatal("-F: too many clients");
+    }
+    NumClients = clients;
+    Clients = calloc(clients, sizeof(FloodClient));
+    Stats.padoLatency = calloc(clients, sizeof(uint32_t));
+    Stats.padsLatency = calloc(clients, sizeof(uint32_t));
+    if (!Clients || !Stats.padoLatency || !Stats.padsLatency) {
+	rp_fatal("Out of memory allocating flood clients");
+    }
+
+    conn->discoverySocket =
+	openInterface(conn->ifName, Eth_PPPOE_Discovery, conn->myEth, NULL);
+    setPromiscuous(conn->discoverySocket, conn->ifName);
+    MacPrefix[0] = (conn->myEth[0] | 0x02) & ~0x01;
+    MacPrefix[1] = conn->myEth[4];
+    MacPrefix[2] = conn->myEth[5];
+
+    signal(SIGINT, floodInterrupt);
+
+    pfd.fd = conn->discoverySocket;
+    pfd.events = POLLIN;
+    interval = rate > 0 ? NSEC_PER_SEC / rate : 0;
+    start = nowNsec();
+    nextScan = start + SCAN_INTERVAL;
+
+    while (!Interrupted && (next < clients || first < clients)) {
+	now = nowNsec();
+
+	/* Start clients that are due */
+	for (burst = 0; next < clients && burst < START_BURST; burst++) {
+	    if (start + next * interval > now) break;
+	    Clients[next].state = FC_WAIT_PADO;
+	    Clients[next].sent = now;
+	    Clients[next].deadline = now + (uint64_t) conn->retry.maxMs * 1000000;
+	    floodSend(conn, next, CODE_PADI, bcast, 0, NULL);
+	    next++;
+	}
+
+	/* Expire timed-out clients.  Clients start in order, so only the
+	   range from the oldest unfinished one needs looking at. */
+	if (now >= nextScan) {
+	    for (i = first; i < next; i++) {
+		floodExpire(conn, &Clients[i], now);
+	    }
+	    while (first < next && Clients[first].state == FC_DONE) first++;
+	    nextScan = now + SCAN_INTERVAL;
+	}
+
+	/* Sleep until the next client is due, the next scan, or a frame */
+	due = nextScan;
+	if (next < clients && start + next * interval < due) {
+	    due = start + next * interval;
+	}
+	timeout = (due > now) ? (int) ((due - now + 999999) / 1000000) : 0;
+	if (poll(&pfd, 1, timeout) < 0) {
+	    if (errno == EINTR) continue;
+	    fatalSys("poll (floodDiscovery)");
+	}
+	if (pfd.revents & POLLIN) {
+	    n = receivePackets(conn->discoverySocket, batch, sizes, MAX_RECV_BATCH);
+	    for (i = 0; i < n; i++) {
+		floodReceive(conn, &batch[i], sizes[i], hold);
+	    }
+	}
+    }
+
+    /* Tear down sessions still held if we were interrupted */
+    for (i = first; i < next; i++) {
+	if (Clients[i].state == FC_HOLD) {
+	    floodSend(conn, i, CODE_PADT, Clients[i].acMac,
+		      Clients[i].session, NULL);
+	}
+    }
+
+    elapsed = nowNsec() - start;
+    printf("Clients: %d started of %d in %.3f s%s\n", next, clients,
+	   elapsed / 1e9, Interrupted ? " (interrupted)" : "");
+    printf("PADI sent %lu; PADO received %lu, %lu with errors, %lu timeouts\n",
+	   Stats.padiSent, Stats.padoRcvd, Stats.padoErrors, Stats.padoTimeouts);
+    printf("PADR sent %lu; PADS received %lu, %lu with errors, %lu timeouts\n",
+	   Stats.padrSent, Stats.padsRcvd, Stats.padsErrors, Stats.padsTimeouts);
+    printf("PADT sent %lu, received %lu; %lu stray frames\n",
+	   Stats.padtSent, Stats.padtRcvd, Stats.stray);
+    printLatency("PADO", Stats.padoLatency, Stats.padoRcvd);
+    printLatency("PADS", Stats.padsLatency, Stats.padsRcvd);
+    fflush(stdout);
+    exit(EXIT_SUCCESS);
+}
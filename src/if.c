@@ -16,6 +16,8 @@
 *
 ***********************************************************************/
 
+#define _GNU_SOURCE 1
+
 #include <unistd.h>
 
 #include <net/ethernet.h>
@@ -28,7 +30,7 @@
 #include <string.h>
 #include <net/if_arp.h>
 
-#include "pppoe.h"
+#include "pktio.h"
 #include <linux/if.h>
 #include <linux/if_packet.h>
 
@@ -63,20 +65,32 @@ etherType(PPPoEPacket *packet)
     return type;
 }
 
+
+/* Backend and private state for each descriptor from openInterface */
+typedef struct IOSlotStruct {
+    PacketIO const *io;
+    void *state;
+} IOSlot;
+
+static IOSlot *Slots = NULL;
+static int NumSlots = 0;
+
 /**********************************************************************
-*%FUNCTION: openInterface
+*%FUNCTION: packetOpen
 *%ARGUMENTS:
 * ifname -- name of interface
 * type -- Ethernet frame type
 * hwaddr -- if non-NULL, set to the hardware address
 * mtu    -- if non-NULL, set to the MTU
+* state -- set to backend state (none for plain sockets)
 *%RETURNS:
 * A raw socket for talking to the Ethernet card.  Exits on error.
 *%DESCRIPTION:
 * Opens a raw Ethernet socket
 ***********************************************************************/
 int
-openInterface(char const *ifname, uint16_t type, unsigned char *hwaddr, uint16_t *mtu)
+packetOpen(char const *ifname, uint16_t type, unsigned char *hwaddr,
+	   uint16_t *mtu, void **state)
 {
     int optval=1;
     int fd;
@@ -90,6 +104,7 @@ openInterface(char const *ifname, uint16_t type, unsigned char *hwaddr, uint16_t
 #endif
 
     memset(&sa, 0, sizeof(sa));
+    *state = NULL;
 
 #ifdef HAVE_STRUCT_SOCKADDR_LL
     domain = PF_PACKET;
@@ -158,6 +173,10 @@ openInterface(char const *ifname, uint16_t type, unsigned char *hwaddr, uint16_t
 
 #else
     strcpy(sa.sa_data, ifname);
+    /* SOCK_PACKET needs the interface name on every send */
+    if (!(*state = strdup(ifname))) {
+	rp_fatal("Out of memory");
+    }
 #endif
 
     /* We're only interested in packets on specified interface */
@@ -169,20 +188,22 @@ openInterface(char const *ifname, uint16_t type, unsigned char *hwaddr, uint16_t
 }
 
 /***********************************************************************
-*%FUNCTION: sendPacket
+*%FUNCTION: packetSend
 *%ARGUMENTS:
 * sock -- socket to send to
+* state -- backend state
 * pkt -- the packet to transmit
 * size -- size of packet (in bytes)
 *%RETURNS:
 * 0 on success; -1 on failure
 *%DESCRIPTION:
-* Transmits a packet
+* Transmits a packet on an AF_PACKET socket
 ***********************************************************************/
-int
-sendPacket(PPPoEConnection *conn, int sock, PPPoEPacket *pkt, int size)
+static int
+packetSend(int sock, void *state, PPPoEPacket *pkt, int size)
 {
 #if defined(HAVE_STRUCT_SOCKADDR_LL)
+    (void) state;
     if (send(sock, pkt, size, 0) < 0 && (errno != ENOBUFS)) {
 	sysErr("send (sendPacket)");
 	return -1;
@@ -190,10 +211,10 @@ sendPacket(PPPoEConnection *conn, int sock, PPPoEPacket *pkt, int size)
 #else
     struct sockaddr sa;
 
-    if (!conn) {
-	rp_fatal("relay and server not supported on Linux 2.0 kernels");
+    if (!state) {
+	rp_fatal("sendPacket: socket was not opened with openInterface");
     }
-    strcpy(sa.sa_data, conn->ifName);
+    strcpy(sa.sa_data, (char const *) state);
     if (sendto(sock, pkt, size, 0, &sa, sizeof(sa)) < 0) {
 	sysErr("sendto (sendPacket)");
 	return -1;
@@ -203,22 +224,465 @@ sendPacket(PPPoEConnection *conn, int sock, PPPoEPacket *pkt, int size)
 }
 
 /***********************************************************************
-*%FUNCTION: receivePacket
+*%FUNCTION: packetRecv
 *%ARGUMENTS:
 * sock -- socket to read from
+* state -- backend state
 * pkt -- place to store the received packet
 * size -- set to size of packet in bytes
 *%RETURNS:
 * >= 0 if all OK; < 0 if error
 *%DESCRIPTION:
-* Receives a packet
+* Receives a packet from an AF_PACKET socket
 ***********************************************************************/
-int
-receivePacket(int sock, PPPoEPacket *pkt, int *size)
+static int
+packetRecv(int sock, void *state, PPPoEPacket *pkt, int *size)
 {
+    (void) state;
     if ((*size = recv(sock, pkt, sizeof(PPPoEPacket), 0)) < 0) {
 	sysErr("recv (receivePacket)");
 	return -1;
     }
     return 0;
 }
+
+/***********************************************************************
+*%FUNCTION: packetRecvBatch
+*%ARGUMENTS:
+* sock -- socket to read from
+* state -- backend state
+* pkts -- array of places to store received packets
+* sizes -- set to size of each packet in bytes
+* max -- number of entries in "pkts" and "sizes"
+*%RETURNS:
+* Number of packets received; < 0 on error
+*%DESCRIPTION:
+* Receives a single packet; the plain socket backend does not batch.
+***********************************************************************/
+static int
+packetRecvBatch(int sock, void *state, PPPoEPacket *pkts, int *sizes, int max)
+{
+    if (max < 1) return 0;
+    if (packetRecv(sock, state, pkts, sizes) < 0) {
+	return -1;
+    }
+    return 1;
+}
+
+/***********************************************************************
+*%FUNCTION: packetSendBatch
+*%ARGUMENTS:
+* sock -- socket to send to
+* state -- backend state
+* pkts -- the packets to transmit
+* sizes -- size of each packet (in bytes)
+* n -- number of packets
+*%RETURNS:
+* 0 on success; -1 on failure
+*%DESCRIPTION:
+* Transmits packets one system call at a time.
+***********************************************************************/
+static int
+packetSendBatch(int sock, void *state, PPPoEPacket *pkts,
+		int const *sizes, int n)
+{
+    int i;
+    for (i=0; i<n; i++) {
+	if (packetSend(sock, state, &pkts[i], sizes[i]) < 0) {
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+#if defined(HAVE_STRUCT_SOCKADDR_LL) && defined(MSG_WAITFORONE)
+/***********************************************************************
+*%FUNCTION: mmsgRecvBatch
+*%ARGUMENTS:
+* sock -- socket to read from
+* state -- backend state
+* pkts -- array of places to store received packets
+* sizes -- set to size of each packet in bytes
+* max -- number of entries in "pkts" and "sizes"
+*%RETURNS:
+* Number of packets received (0 if none were waiting); < 0 on error
+*%DESCRIPTION:
+* Receives as many waiting packets as fit, without blocking, with one
+* recvmmsg call.
+***********************************************************************/
+static int
+mmsgRecvBatch(int sock, void *state, PPPoEPacket *pkts, int *sizes, int max)
+{
+    struct mmsghdr msgs[MAX_RECV_BATCH];
+    struct iovec iov[MAX_RECV_BATCH];
+    int i, n;
+
+    (void) state;
+    if (max > MAX_RECV_BATCH) max = MAX_RECV_BATCH;
+    memset(msgs, 0, max * sizeof(msgs[0]));
+    for (i=0; i<max; i++) {
+	iov[i].iov_base = &pkts[i];
+	iov[i].iov_len = sizeof(PPPoEPacket);
+	msgs[i].msg_hdr.msg_iov = &iov[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    n = recvmmsg(sock, msgs, max, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+	    return 0;
+	}
+	sysErr("recvmmsg (receivePackets)");
+	return -1;
+    }
+    for (i=0; i<n; i++) {
+	sizes[i] = (int) msgs[i].msg_len;
+    }
+    return n;
+}
+
+/***********************************************************************
+*%FUNCTION: mmsgSendBatch
+*%ARGUMENTS:
+* sock -- socket to send to
+* state -- backend state
+* pkts -- the packets to transmit
+* sizes -- size of each packet (in bytes)
+* n -- number of packets
+*%RETURNS:
+* 0 on success; -1 on failure
+*%DESCRIPTION:
+* Transmits a batch of packets, usually with one sendmmsg call.  As with
+* sendPacket, a packet the kernel has no buffer space for is dropped
+* silently.
+***********************************************************************/
+static int
+mmsgSendBatch(int sock, void *state, PPPoEPacket *pkts,
+	      int const *sizes, int n)
+{
+    struct mmsghdr msgs[MAX_SEND_BATCH];
+    struct iovec iov[MAX_SEND_BATCH];
+    int i, r, done = 0;
+
+    (void) state;
+    while (n > 0) {
+	int count = (n > MAX_SEND_BATCH) ? MAX_SEND_BATCH : n;
+	memset(msgs, 0, count * sizeof(msgs[0]));
+	for (i=0; i<count; i++) {
+	    iov[i].iov_base = &pkts[done + i];
+	    iov[i].iov_len = sizes[done + i];
+	    msgs[i].msg_hdr.msg_iov = &iov[i];
+	    msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	r = sendmmsg(sock, msgs, count, 0);
+	if (r < 0) {
+	    if (errno == EINTR) continue;
+	    if (errno != ENOBUFS) {
+		sysErr("sendmmsg (sendPackets)");
+		return -1;
+	    }
+	    /* Drop the packet that did not fit and carry on */
+	    r = 1;
+	}
+	done += r;
+	n -= r;
+    }
+    return 0;
+}
+#else
+#define mmsgRecvBatch packetRecvBatch
+#define mmsgSendBatch packetSendBatch
+#endif
+
+/* AF_PACKET socket, one frame per system call */
+static PacketIO const PacketSocketIO = {
+    "packet", 1, packetOpen, packetSend, packetRecv,
+    packetRecvBatch, packetSendBatch, NULL
+};
+
+/* AF_PACKET socket, batches moved with recvmmsg/sendmmsg (the default) */
+static PacketIO const MmsgIO = {
+    "mmsg", 1, packetOpen, packetSend, packetRecv,
+    mmsgRecvBatch, mmsgSendBatch, NULL
+};
+
+/* Backends selectable with a "name:" interface prefix */
+static PacketIO const * const Backends[] = {
+    &MmsgIO,
+    &PacketSocketIO,
+#if defined(HAVE_STRUCT_SOCKADDR_LL) && !defined(PLUGIN)
+    &TpacketIO,
+    &PcapIO,
+    &LoopIO,
+#endif
+    NULL
+};
+
+/**********************************************************************
+*%FUNCTION: findBackend
+*%ARGUMENTS:
+* ifname -- interface name, optionally prefixed by "backend:"
+* spec -- set to the interface name with any prefix removed
+*%RETURNS:
+* The backend to use
+*%DESCRIPTION:
+* A prefix that is not the name of a backend is left alone, so that
+* names like "eth0:1" keep working.
+***********************************************************************/
+static PacketIO const *
+findBackend(char const *ifname, char const **spec)
+{
+    char const *colon = strchr(ifname, ':');
+    int i;
+
+    *spec = ifname;
+    if (colon) {
+	for (i=0; Backends[i]; i++) {
+	    if (strlen(Backends[i]->name) == (size_t) (colon - ifname) &&
+		!strncmp(Backends[i]->name, ifname, colon - ifname)) {
+		*spec = colon + 1;
+		return Backends[i];
+	    }
+	}
+    }
+    return &MmsgIO;
+}
+
+/**********************************************************************
+*%FUNCTION: slotFor
+*%ARGUMENTS:
+* sock -- descriptor
+*%RETURNS:
+* The backend slot for "sock".  Descriptors not from openInterface use
+* the default backend with no state.
+***********************************************************************/
+static IOSlot
+slotFor(int sock)
+{
+    IOSlot dflt = { &MmsgIO, NULL };
+
+    if (sock >= 0 && sock < NumSlots && Slots[sock].io) {
+	return Slots[sock];
+    }
+    return dflt;
+}
+
+/**********************************************************************
+*%FUNCTION: openInterface
+*%ARGUMENTS:
+* ifname -- name of interface, optionally prefixed by "backend:"
+* type -- Ethernet frame type
+* hwaddr -- if non-NULL, set to the hardware address
+* mtu    -- if non-NULL, set to the MTU
+*%RETURNS:
+* A descriptor for talking to the Ethernet card.  Exits on error.
+*%DESCRIPTION:
+* Opens an interface with the packet I/O backend its name selects
+* (default: AF_PACKET with recvmmsg/sendmmsg batching).
+***********************************************************************/
+int
+openInterface(char const *ifname, uint16_t type, unsigned char *hwaddr, uint16_t *mtu)
+{
+    char const *spec;
+    PacketIO const *io = findBackend(ifname, &spec);
+    void *state = NULL;
+    int fd;
+
+    fd = io->open(spec, type, hwaddr, mtu, &state);
+    if (fd >= NumSlots) {
+	int n = fd + 64;
+	IOSlot *t = realloc(Slots, n * sizeof(IOSlot));
+	if (!t) {
+	    rp_fatal("Out of memory");
+	}
+	memset(t + NumSlots, 0, (n - NumSlots) * sizeof(IOSlot));
+	Slots = t;
+	NumSlots = n;
+    }
+    Slots[fd].io = io;
+    Slots[fd].state = state;
+    return fd;
+}
+
+/**********************************************************************
+*%FUNCTION: closeInterface
+*%ARGUMENTS:
+* sock -- descriptor returned by openInterface
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Closes the descriptor and frees its backend state
+***********************************************************************/
+void
+closeInterface(int sock)
+{
+    IOSlot slot = slotFor(sock);
+
+    if (slot.io->close) {
+	slot.io->close(sock, slot.state);
+    } else {
+	free(slot.state);
+	close(sock);
+    }
+    if (sock >= 0 && sock < NumSlots) {
+	Slots[sock].io = NULL;
+	Slots[sock].state = NULL;
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: interfaceIsRawSocket
+*%ARGUMENTS:
+* sock -- descriptor returned by openInterface
+*%RETURNS:
+* Non-zero if "sock" is an ordinary AF_PACKET socket, which may be used
+* directly with recvmsg/sendmsg and socket options
+***********************************************************************/
+int
+interfaceIsRawSocket(int sock)
+{
+    return slotFor(sock).io->rawSocket;
+}
+
+/***********************************************************************
+*%FUNCTION: interfaceDevice
+*%ARGUMENTS:
+* ifname -- name of interface, optionally prefixed by "backend:"
+*%RETURNS:
+* The name of the network device behind "ifname" with any backend prefix
+* removed, or NULL if its backend has no network device (pcap, loop).
+*%DESCRIPTION:
+* Used where the name is handed to code outside this process, such as
+* the kernel-mode PPPoE plugin, which knows nothing of backends.
+***********************************************************************/
+char const *
+interfaceDevice(char const *ifname)
+{
+    PacketIO const *io = findBackend(ifname, &ifname);
+
+    if (!io->rawSocket && strcmp(io->name, "tpacket")) return NULL;
+    return ifname;
+}
+
+/***********************************************************************
+*%FUNCTION: setPromiscuous
+*%ARGUMENTS:
+* sock -- socket returned by openInterface
+* ifname -- name of interface
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Puts the interface into promiscuous mode for as long as "sock" is open,
+* so that frames addressed to MAC addresses other than our own reach it.
+* Backends that are not AF_PACKET sockets see every frame anyway.  The
+* name may carry a backend prefix, as for openInterface.
+***********************************************************************/
+void
+setPromiscuous(int sock, char const *ifname)
+{
+#ifdef HAVE_STRUCT_SOCKADDR_LL
+    struct packet_mreq mreq;
+    struct ifreq ifr;
+    PacketIO const *io = findBackend(ifname, &ifname);
+
+    /* Only backends built on AF_PACKET sockets filter by address */
+    if (!io->rawSocket && strcmp(io->name, "tpacket")) return;
+    rp_strlcpy(ifr.ifr_name, ifname, IFNAMSIZ);
+    if (ioctl(sock, SIOCGIFINDEX, &ifr) < 0) {
+	fatalSys("ioctl(SIOCGIFINDEX): Could not get interface index");
+    }
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifr.ifr_ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+		   &mreq, sizeof(mreq)) < 0) {
+	fatalSys("setsockopt(PACKET_ADD_MEMBERSHIP)");
+    }
+#else
+    (void) sock;
+    (void) ifname;
+#endif
+}
+
+/***********************************************************************
+*%FUNCTION: sendPacket
+*%ARGUMENTS:
+* conn -- PPPoE connection (unused; kept for callers)
+* sock -- socket to send to
+* pkt -- the packet to transmit
+* size -- size of packet (in bytes)
+*%RETURNS:
+* 0 on success; -1 on failure
+*%DESCRIPTION:
+* Transmits a packet
+***********************************************************************/
+int
+sendPacket(PPPoEConnection *conn, int sock, PPPoEPacket *pkt, int size)
+{
+    IOSlot slot = slotFor(sock);
+
+    (void) conn;
+    return slot.io->send(sock, slot.state, pkt, size);
+}
+
+/***********************************************************************
+*%FUNCTION: sendPackets
+*%ARGUMENTS:
+* conn -- PPPoE connection (unused; kept for callers)
+* sock -- socket to send to
+* pkts -- the packets to transmit
+* sizes -- size of each packet (in bytes)
+* n -- number of packets
+*%RETURNS:
+* 0 on success; -1 on failure
+*%DESCRIPTION:
+* Transmits a batch of packets.  With the default backend the whole
+* batch usually costs one system call.  As with sendPacket, a packet
+* the kernel has no buffer space for is dropped silently.
+***********************************************************************/
+int
+sendPackets(PPPoEConnection *conn, int sock, PPPoEPacket *pkts,
+	    int const *sizes, int n)
+{
+    IOSlot slot = slotFor(sock);
+
+    (void) conn;
+    return slot.io->sendBatch(sock, slot.state, pkts, sizes, n);
+}
+
+/***********************************************************************
+*%FUNCTION: receivePacket
+*%ARGUMENTS:
+* sock -- socket to read from
+* pkt -- place to store the received packet
+* size -- set to size of packet in bytes
+*%RETURNS:
+* >= 0 if all OK; < 0 if error
+*%DESCRIPTION:
+* Receives a packet
+***********************************************************************/
+int
+receivePacket(int sock, PPPoEPacket *pkt, int *size)
+{
+    IOSlot slot = slotFor(sock);
+    return slot.io->recv(sock, slot.state, pkt, size);
+}
+
+/***********************************************************************
+*%FUNCTION: receivePackets
+*%ARGUMENTS:
+* sock -- socket to read from
+* pkts -- array of places to store received packets
+* sizes -- set to size of each packet in bytes
+* max -- number of entries in "pkts" and "sizes"
+*%RETURNS:
+* Number of packets received (0 if none were waiting); < 0 on error
+*%DESCRIPTION:
+* Receives as many waiting packets as fit.  Call it only when "sock" is
+* readable; backends that cannot batch return one packet.
+***********************************************************************/
+int
+receivePackets(int sock, PPPoEPacket *pkts, int *sizes, int max)
+{
+    IOSlot slot = slotFor(sock);
+    return slot.io->recvBatch(sock, slot.state, pkts, sizes, max);
+}
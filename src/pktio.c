@@ -0,0 +1,676 @@
+/***********************************************************************
+*
+* pktio.c
+*
+* Implementation of user-space PPPoE redirector for Linux.
+*
+* Alternative packet I/O backends, selected by an interface-name
+* prefix (see openInterface in if.c):
+*
+*   tpacket:IFNAME      AF_PACKET with memory-mapped TPACKET_V2 rings
+*   pcap:IN[,OUT]       replay frames from pcap file IN; capture
+*                       transmitted frames to pcap file OUT
+*   loop:NAME:SIDE      in-process loopback pair; what side 0 of NAME
+*                       sends, side 1 receives and vice versa
+*
+* Copyright (C) 2000-2012 by Roaring Penguin Software Inc.
+* Copyright (C) 2018-2023 Dianne Skoll
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+* SPDX-License-Identifier: GPL-2.0-or-later
+*
+***********************************************************************/
+
+#define _GNU_SOURCE 1
+
+#include "config.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/time.h>
+
+#include "pktio.h"
+
+#ifdef HAVE_STRUCT_SOCKADDR_LL
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <linux/if_packet.h>
+
+/**********************************************************************
+*%FUNCTION: syntheticMac
+*%ARGUMENTS:
+* name -- backend-specific interface name
+* side -- distinguishes the ends of a loopback pair
+* mac -- set to a MAC address
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Makes up a stable, locally administered unicast address for an
+* interface that has no hardware behind it.
+***********************************************************************/
+static void
+syntheticMac(char const *name, int side, unsigned char *mac)
+{
+    uint32_t h = 2166136261U;	/* FNV-1a */
+
+    while (*name) {
+	h = (h ^ (unsigned char) *name++) * 16777619U;
+    }
+    mac[0] = 0x02;
+    mac[1] = (h >> 24) & 0xFF;
+    mac[2] = (h >> 16) & 0xFF;
+    mac[3] = (h >> 8) & 0xFF;
+    mac[4] = h & 0xFF;
+    mac[5] = side;
+}
+
+/**********************************************************************
+*%FUNCTION: frameMatches
+*%ARGUMENTS:
+* frame -- an Ethernet frame
+* size -- its length
+* type -- Ethernet type a descriptor was opened for
+*%RETURNS:
+* Non-zero if a socket opened for "type" would see the frame
+***********************************************************************/
+static int
+frameMatches(unsigned char const *frame, int size, uint16_t type)
+{
+    if (size < ETH_HLEN) return 0;
+    return type == ETH_P_ALL || ((frame[12] << 8) | frame[13]) == type;
+}
+
+/***********************************************************************
+* tpacket: AF_PACKET with TPACKET_V2 receive and transmit rings
+***********************************************************************/
+
+#define TP_FRAME_SIZE 2048
+#define TP_BLOCK_SIZE (TP_FRAME_SIZE * 32)
+#define TP_RX_BLOCKS  64	/* 2048 frames */
+#define TP_TX_BLOCKS  8		/* 256 frames */
+
+typedef struct TpacketStateStruct {
+    unsigned char *map;		/* Both rings */
+    size_t mapLen;
+    unsigned char *rx;		/* Receive ring */
+    unsigned char *tx;		/* Transmit ring */
+    unsigned int rxFrames, txFrames;
+    unsigned int rxNext, txNext; /* Next slot to look at */
+} TpacketState;
+
+static int
+tpacketOpen(char const *spec, uint16_t type, unsigned char *hwaddr,
+	    uint16_t *mtu, void **state)
+{
+    TpacketState *ts;
+    struct tpacket_req req;
+    int version = TPACKET_V2;
+    void *unused;
+    int fd;
+
+    fd = packetOpen(spec, type, hwaddr, mtu, &unused);
+    ts = calloc(1, sizeof(TpacketState));
+    if (!ts) {
+	rp_fatal("Out of memory");
+    }
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+	fatalSys("setsockopt(PACKET_VERSION)");
+    }
+
+    req.tp_block_size = TP_BLOCK_SIZE;
+    req.tp_frame_size = TP_FRAME_SIZE;
+    req.tp_block_nr = TP_RX_BLOCKS;
+    req.tp_frame_nr = TP_RX_BLOCKS * (TP_BLOCK_SIZE / TP_FRAME_SIZE);
+    ts->rxFrames = req.tp_frame_nr;
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+	fatalSys("setsockopt(PACKET_RX_RING)");
+    }
+    req.tp_block_nr = TP_TX_BLOCKS;
+    req.tp_frame_nr = TP_TX_BLOCKS * (TP_BLOCK_SIZE / TP_FRAME_SIZE);
+    ts->txFrames = req.tp_frame_nr;
+    if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+	fatalSys("setsockopt(PACKET_TX_RING)");
+    }
+
+    ts->mapLen = (size_t) (TP_RX_BLOCKS + TP_TX_BLOCKS) * TP_BLOCK_SIZE;
+    ts->map = mmap(NULL, ts->mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ts->map == MAP_FAILED) {
+	fatalSys("mmap (tpacket ring)");
+    }
+    ts->rx = ts->map;
+    ts->tx = ts->map + (size_t) TP_RX_BLOCKS * TP_BLOCK_SIZE;
+    *state = ts;
+    return fd;
+}
+
+/* Takes the next frame off the receive ring; returns 0 if it is empty */
+static int
+tpacketNext(TpacketState *ts, PPPoEPacket *pkt, int *size)
+{
+    struct tpacket2_hdr *hdr =
+	(struct tpacket2_hdr *) (ts->rx + ts->rxNext * TP_FRAME_SIZE);
+    unsigned int len;
+
+    if (!(__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+	return 0;
+    }
+    len = hdr->tp_snaplen;
+    if (len > sizeof(PPPoEPacket)) len = sizeof(PPPoEPacket);
+    memcpy(pkt, (unsigned char *) hdr + hdr->tp_mac, len);
+    *size = (int) len;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    ts->rxNext = (ts->rxNext + 1) % ts->rxFrames;
+    return 1;
+}
+
+static int
+tpacketRecv(int sock, void *state, PPPoEPacket *pkt, int *size)
+{
+    struct pollfd pfd;
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    while (!tpacketNext((TpacketState *) state, pkt, size)) {
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+	    sysErr("poll (receivePacket)");
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+static int
+tpacketRecvBatch(int sock, void *state, PPPoEPacket *pkts, int *sizes, int max)
+{
+    int n = 0;
+
+    (void) sock;
+    while (n < max && tpacketNext((TpacketState *) state, &pkts[n], &sizes[n])) {
+	n++;
+    }
+    return n;
+}
+
+static int
+tpacketSendBatch(int sock, void *state, PPPoEPacket *pkts,
+		 int const *sizes, int n)
+{
+    TpacketState *ts = (TpacketState *) state;
+    struct tpacket2_hdr *hdr;
+    unsigned int status;
+    int i;
+
+    for (i=0; i<n; i++) {
+	if (sizes[i] > TP_FRAME_SIZE - (int) TPACKET2_HDRLEN) continue;
+	hdr = (struct tpacket2_hdr *) (ts->tx + ts->txNext * TP_FRAME_SIZE);
+	status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+	if (status != TP_STATUS_AVAILABLE && !(status & TP_STATUS_WRONG_FORMAT)) {
+	    /* Ring full: push out what is queued, then look again */
+	    send(sock, NULL, 0, 0);
+	    status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+	    if (status != TP_STATUS_AVAILABLE && !(status & TP_STATUS_WRONG_FORMAT)) {
+		/* Still no room: drop, as for ENOBUFS */
+		continue;
+	    }
+	}
+	memcpy((unsigned char *) hdr + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll),
+	       &pkts[i], sizes[i]);
+	hdr->tp_len = sizes[i];
+	__atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+	ts->txNext = (ts->txNext + 1) % ts->txFrames;
+    }
+    if (send(sock, NULL, 0, 0) < 0 && errno != ENOBUFS) {
+	sysErr("send (tpacket)");
+	return -1;
+    }
+    return 0;
+}
+
+static int
+tpacketSend(int sock, void *state, PPPoEPacket *pkt, int size)
+{
+    return tpacketSendBatch(sock, state, pkt, &size, 1);
+}
+
+static void
+tpacketClose(int sock, void *state)
+{
+    TpacketState *ts = (TpacketState *) state;
+
+    munmap(ts->map, ts->mapLen);
+    free(ts);
+    close(sock);
+}
+
+PacketIO const TpacketIO = {
+    "tpacket", 0, tpacketOpen, tpacketSend, tpacketRecv,
+    tpacketRecvBatch, tpacketSendBatch, tpacketClose
+};
+
+/***********************************************************************
+* pcap: replay from and capture to pcap files
+***********************************************************************/
+
+#define PCAP_MAGIC      0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+
+/* A capture file, shared by every descriptor writing to it */
+typedef struct PcapOutStruct {
+    struct PcapOutStruct *next;
+    char *path;
+    FILE *fp;
+    int refs;
+} PcapOut;
+
+typedef struct PcapStateStruct {
+    FILE *in;			/* File being replayed, or NULL */
+    int swapped;		/* Replay file has opposite byte order */
+    uint16_t type;		/* Ethernet type wanted */
+    int wake;			/* Write end of readiness pipe */
+    PPPoEPacket pending;	/* Next frame to hand out */
+    int pendingSize;		/* Its size; 0 when replay is done */
+    PcapOut *out;		/* Capture file, or NULL */
+} PcapState;
+
+static PcapOut *PcapOuts = NULL;
+
+static uint32_t
+pcapWord(uint32_t w, int swapped)
+{
+    return swapped ? __builtin_bswap32(w) : w;
+}
+
+/**********************************************************************
+*%FUNCTION: pcapReadFrame
+*%ARGUMENTS:
+* fp -- pcap file positioned at a record
+* swapped -- non-zero if file has opposite byte order
+* pkt -- place to store the frame
+*%RETURNS:
+* Frame length, or 0 at end of file
+***********************************************************************/
+static int
+pcapReadFrame(FILE *fp, int swapped, PPPoEPacket *pkt)
+{
+    uint32_t rec[4];		/* ts_sec, ts_frac, incl_len, orig_len */
+    uint32_t len, keep;
+
+    if (fread(rec, sizeof(rec), 1, fp) != 1) return 0;
+    len = pcapWord(rec[2], swapped);
+    keep = (len > sizeof(PPPoEPacket)) ? sizeof(PPPoEPacket) : len;
+    if (fread(pkt, 1, keep, fp) != keep) return 0;
+    if (len > keep && fseek(fp, len - keep, SEEK_CUR) < 0) return 0;
+    return keep ? (int) keep : pcapReadFrame(fp, swapped, pkt);
+}
+
+/* Loads the next frame of the wanted type and updates readiness */
+static void
+pcapAdvance(PcapState *ps, int rfd)
+{
+    unsigned char c = 0;
+
+    do {
+	ps->pendingSize = ps->in ? pcapReadFrame(ps->in, ps->swapped, &ps->pending) : 0;
+    } while (ps->pendingSize &&
+	     !frameMatches((unsigned char *) &ps->pending, ps->pendingSize, ps->type));
+    if (!ps->pendingSize && rfd >= 0) {
+	/* Replay done: make the descriptor unreadable */
+	if (read(rfd, &c, 1) < 0) {
+	    sysErr("read (pcap)");
+	}
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: pcapOpenOut
+*%ARGUMENTS:
+* path -- capture file name
+*%RETURNS:
+* The shared capture file.  The first open in a process truncates it.
+***********************************************************************/
+static PcapOut *
+pcapOpenOut(char const *path)
+{
+    PcapOut *po;
+    uint32_t hdr[6] = { PCAP_MAGIC, 0x00040002, 0, 0, 65535,
+			PCAP_LINKTYPE_ETHERNET };
+
+    for (po = PcapOuts; po; po = po->next) {
+	if (!strcmp(po->path, path)) {
+	    po->refs++;
+	    return po;
+	}
+    }
+    po = calloc(1, sizeof(PcapOut));
+    if (!po || !(po->path = strdup(path))) {
+	rp_fatal("Out of memory");
+    }
+    if (!(po->fp = fopen(path, "wb"))) {
+	fatalSys("fopen (pcap capture file)");
+    }
+    if (fwrite(hdr, sizeof(hdr), 1, po->fp) != 1 || fflush(po->fp)) {
+	fatalSys("fwrite (pcap capture file)");
+    }
+    po->refs = 1;
+    po->next = PcapOuts;
+    PcapOuts = po;
+    return po;
+}
+
+/**********************************************************************
+*%FUNCTION: pcapFindMac
+*%ARGUMENTS:
+* fp -- pcap file positioned at the first record
+* swapped -- non-zero if file has opposite byte order
+* mac -- set to our MAC address if one is found
+*%RETURNS:
+* Non-zero if a MAC address was found
+*%DESCRIPTION:
+* Replayed frames were addressed to the host that captured them, so the
+* destination of the first unicast frame is taken as our own address.
+***********************************************************************/
+static int
+pcapFindMac(FILE *fp, int swapped, unsigned char *mac)
+{
+    static unsigned char const zero[ETH_ALEN];
+    PPPoEPacket pkt;
+    long pos = ftell(fp);
+    int found = 0;
+
+    while (pcapReadFrame(fp, swapped, &pkt)) {
+	if (!NOT_UNICAST(pkt.ethHdr.h_dest) &&
+	    memcmp(pkt.ethHdr.h_dest, zero, ETH_ALEN)) {
+	    memcpy(mac, pkt.ethHdr.h_dest, ETH_ALEN);
+	    found = 1;
+	    break;
+	}
+    }
+    fseek(fp, pos, SEEK_SET);
+    return found;
+}
+
+static int
+pcapOpen(char const *spec, uint16_t type, unsigned char *hwaddr,
+	 uint16_t *mtu, void **state)
+{
+    PcapState *ps;
+    char *in, *out;
+    uint32_t hdr[6];
+    int pfd[2];
+    unsigned char c = 0;
+
+    ps = calloc(1, sizeof(PcapState));
+    in = strdup(spec);
+    if (!ps || !in) {
+	rp_fatal("Out of memory");
+    }
+    out = strchr(in, ',');
+    if (out) *out++ = 0;
+    ps->type = type;
+
+    if (*in) {
+	if (!(ps->in = fopen(in, "rb"))) {
+	    fatalSys("fopen (pcap replay file)");
+	}
+	if (fread(hdr, sizeof(hdr), 1, ps->in) != 1) {
+	    rp_fatal("pcap replay file is too short");
+	}
+	if (hdr[0] == PCAP_MAGIC || hdr[0] == PCAP_MAGIC_NSEC) {
+	    ps->swapped = 0;
+	} else if (hdr[0] == __builtin_bswap32(PCAP_MAGIC) ||
+		   hdr[0] == __builtin_bswap32(PCAP_MAGIC_NSEC)) {
+	    ps->swapped = 1;
+	} else {
+	    rp_fatal("pcap replay file has a bad magic number");
+	}
+	if (pcapWord(hdr[5], ps->swapped) != PCAP_LINKTYPE_ETHERNET) {
+	    rp_fatal("pcap replay file is not an Ethernet capture");
+	}
+    }
+    if (out && *out) {
+	ps->out = pcapOpenOut(out);
+    }
+
+    if (hwaddr && !(ps->in && pcapFindMac(ps->in, ps->swapped, hwaddr))) {
+	syntheticMac(spec, 0, hwaddr);
+    }
+    if (mtu) *mtu = ETH_DATA_LEN;
+
+    /* The descriptor handed out is a pipe holding one byte while there
+       are frames left to replay */
+    if (pipe(pfd) < 0) {
+	fatalSys("pipe (pcap)");
+    }
+    ps->wake = pfd[1];
+    pcapAdvance(ps, -1);
+    if (ps->pendingSize && write(ps->wake, &c, 1) < 0) {
+	fatalSys("write (pcap)");
+    }
+    free(in);
+    *state = ps;
+    return pfd[0];
+}
+
+static int
+pcapRecv(int sock, void *state, PPPoEPacket *pkt, int *size)
+{
+    PcapState *ps = (PcapState *) state;
+
+    if (!ps->pendingSize) {
+	errno = EAGAIN;
+	return -1;
+    }
+    memcpy(pkt, &ps->pending, ps->pendingSize);
+    *size = ps->pendingSize;
+    pcapAdvance(ps, sock);
+    return 0;
+}
+
+static int
+pcapRecvBatch(int sock, void *state, PPPoEPacket *pkts, int *sizes, int max)
+{
+    int n = 0;
+
+    while (n < max && ((PcapState *) state)->pendingSize) {
+	pcapRecv(sock, state, &pkts[n], &sizes[n]);
+	n++;
+    }
+    return n;
+}
+
+static int
+pcapSendBatch(int sock, void *state, PPPoEPacket *pkts,
+	      int const *sizes, int n)
+{
+    PcapState *ps = (PcapState *) state;
+    struct timeval tv;
+    uint32_t rec[4];
+    int i;
+
+    (void) sock;
+    if (!ps->out) return 0;
+    gettimeofday(&tv, NULL);
+    for (i=0; i<n; i++) {
+	rec[0] = (uint32_t) tv.tv_sec;
+	rec[1] = (uint32_t) tv.tv_usec;
+	rec[2] = rec[3] = (uint32_t) sizes[i];
+	if (fwrite(rec, sizeof(rec), 1, ps->out->fp) != 1 ||
+	    fwrite(&pkts[i], sizes[i], 1, ps->out->fp) != 1) {
+	    sysErr("fwrite (pcap capture file)");
+	    return -1;
+	}
+    }
+    fflush(ps->out->fp);
+    return 0;
+}
+
+static int
+pcapSend(int sock, void *state, PPPoEPacket *pkt, int size)
+{
+    return pcapSendBatch(sock, state, pkt, &size, 1);
+}
+
+static void
+pcapClose(int sock, void *state)
+{
+    PcapState *ps = (PcapState *) state;
+    PcapOut **pp;
+
+    if (ps->in) fclose(ps->in);
+    if (ps->out && --ps->out->refs == 0) {
+	for (pp = &PcapOuts; *pp != ps->out; pp = &(*pp)->next);
+	*pp = ps->out->next;
+	fclose(ps->out->fp);
+	free(ps->out->path);
+	free(ps->out);
+    }
+    close(ps->wake);
+    close(sock);
+    free(ps);
+}
+
+PacketIO const PcapIO = {
+    "pcap", 0, pcapOpen, pcapSend, pcapRecv,
+    pcapRecvBatch, pcapSendBatch, pcapClose
+};
+
+/***********************************************************************
+* loop: in-process loopback pairs
+***********************************************************************/
+
+/* Frames a loopback endpoint can hold before it drops */
+#define LOOP_QUEUE_LEN 512
+
+typedef struct LoopEndStruct {
+    struct LoopEndStruct *next;	/* All open endpoints */
+    char *name;			/* Pair name */
+    int side;			/* 0 or 1 */
+    uint16_t type;		/* Ethernet type wanted */
+    int fd;			/* eventfd; readable while queue is non-empty */
+    unsigned int head, tail;	/* Queue indexes; tail - head frames queued */
+    int sizes[LOOP_QUEUE_LEN];
+    PPPoEPacket queue[LOOP_QUEUE_LEN];
+} LoopEnd;
+
+static LoopEnd *LoopEnds = NULL;
+
+static int
+loopOpen(char const *spec, uint16_t type, unsigned char *hwaddr,
+	 uint16_t *mtu, void **state)
+{
+    LoopEnd *le;
+    char const *colon = strrchr(spec, ':');
+
+    if (!colon || colon == spec || (strcmp(colon, ":0") && strcmp(colon, ":1"))) {
+	rp_fatal("Loopback interfaces are named loop:NAME:0 and loop:NAME:1");
+    }
+    le = calloc(1, sizeof(LoopEnd));
+    if (!le || !(le->name = strndup(spec, colon - spec))) {
+	rp_fatal("Out of memory");
+    }
+    le->side = colon[1] - '0';
+    le->type = type;
+    le->fd = eventfd(0, EFD_NONBLOCK);
+    if (le->fd < 0) {
+	fatalSys("eventfd (loop)");
+    }
+    if (hwaddr) syntheticMac(le->name, le->side + 1, hwaddr);
+    if (mtu) *mtu = ETH_DATA_LEN;
+
+    le->next = LoopEnds;
+    LoopEnds = le;
+    *state = le;
+    return le->fd;
+}
+
+static int
+loopRecvBatch(int sock, void *state, PPPoEPacket *pkts, int *sizes, int max)
+{
+    LoopEnd *le = (LoopEnd *) state;
+    uint64_t count;
+    int n = 0;
+
+    while (n < max && le->head != le->tail) {
+	unsigned int slot = le->head % LOOP_QUEUE_LEN;
+	memcpy(&pkts[n], &le->queue[slot], le->sizes[slot]);
+	sizes[n++] = le->sizes[slot];
+	le->head++;
+    }
+    if (le->head == le->tail && read(sock, &count, sizeof(count)) < 0 &&
+	errno != EAGAIN) {
+	sysErr("read (loop)");
+    }
+    return n;
+}
+
+static int
+loopRecv(int sock, void *state, PPPoEPacket *pkt, int *size)
+{
+    if (loopRecvBatch(sock, state, pkt, size, 1) != 1) {
+	errno = EAGAIN;
+	return -1;
+    }
+    return 0;
+}
+
+static int
+loopSendBatch(int sock, void *state, PPPoEPacket *pkts,
+	      int const *sizes, int n)
+{
+    LoopEnd *from = (LoopEnd *) state;
+    LoopEnd *le;
+    uint64_t one = 1;
+    int i;
+
+    (void) sock;
+    for (le = LoopEnds; le; le = le->next) {
+	if (le->side == from->side || strcmp(le->name, from->name)) continue;
+	for (i=0; i<n; i++) {
+	    unsigned int slot;
+	    if (!frameMatches((unsigned char *) &pkts[i], sizes[i], le->type)) continue;
+	    if (le->tail - le->head >= LOOP_QUEUE_LEN) continue; /* Full: drop */
+	    slot = le->tail % LOOP_QUEUE_LEN;
+	    memcpy(&le->queue[slot], &pkts[i], sizes[i]);
+	    le->sizes[slot] = sizes[i];
+	    if (le->tail++ == le->head && write(le->fd, &one, sizeof(one)) < 0) {
+		sysErr("write (loop)");
+	    }
+	}
+    }
+    return 0;
+}
+
+static int
+loopSend(int sock, void *state, PPPoEPacket *pkt, int size)
+{
+    return loopSendBatch(sock, state, pkt, &size, 1);
+}
+
+static void
+loopClose(int sock, void *state)
+{
+    LoopEnd *le = (LoopEnd *) state;
+    LoopEnd **pp;
+
+    for (pp = &LoopEnds; *pp != le; pp = &(*pp)->next);
+    *pp = le->next;
+    free(le->name);
+    free(le);
+    close(sock);
+}
+
+PacketIO const LoopIO = {
+    "loop", 0, loopOpen, loopSend, loopRecv,
+    loopRecvBatch, loopSendBatch, loopClose
+};
+
+#endif /* HAVE_STRUCT_SOCKADDR_LL */
@@ -0,0 +1,46 @@
+/**********************************************************************
+*
+* pktio.h
+*
+* Packet I/O backends used by if.c
+*
+* Copyright (C) 2000-2012 by Roaring Penguin Software Inc.
+* Copyright (C) 2018-2023 Dianne Skoll
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+* SPDX-License-Identifier: GPL-2.0-or-later
+*
+***********************************************************************/
+
+#include "pppoe.h"
+
+/* A packet I/O backend.  openInterface selects one by a "name:" prefix
+   on the interface name and remembers it, together with the backend's
+   private state, against the descriptor it returns.  Every descriptor
+   must be usable with select()/poll(): readable means a frame is
+   waiting.  Return conventions follow sendPacket, receivePacket,
+   receivePackets and sendPackets. */
+typedef struct PacketIOStruct {
+    char const *name;		/* Prefix selecting this backend */
+    int rawSocket;		/* Descriptor is an ordinary AF_PACKET socket */
+    int (*open)(char const *spec, uint16_t type, unsigned char *hwaddr,
+		uint16_t *mtu, void **state);
+    int (*send)(int sock, void *state, PPPoEPacket *pkt, int size);
+    int (*recv)(int sock, void *state, PPPoEPacket *pkt, int *size);
+    int (*recvBatch)(int sock, void *state, PPPoEPacket *pkts, int *sizes,
+		     int max);
+    int (*sendBatch)(int sock, void *state, PPPoEPacket *pkts,
+		     int const *sizes, int n);
+    void (*close)(int sock, void *state);
+} PacketIO;
+
+/* Opens an AF_PACKET socket; shared by the socket-based backends */
+int packetOpen(char const *ifname, uint16_t type, unsigned char *hwaddr,
+	       uint16_t *mtu, void **state);
+
+/* Backends in pktio.c */
+extern PacketIO const TpacketIO;
+extern PacketIO const PcapIO;
+extern PacketIO const LoopIO;
@@ -90,6 +90,9 @@ char *pppd_pppoe_service = NULL;
 static char *acName = NULL;
 static char *existingSession = NULL;
 static int printACNames = 0;
+static char *retrySchedule = NULL;
+static char *resumeFile = NULL;
+static char *padoWindow = NULL;
 
 static int PPPoEDevnameHook(char *cmd, char **argv, int doit);
 static option_t Options[] = {
@@ -107,6 +110,12 @@ static option_t Options[] = {
       "Be verbose about discovered access concentrators"},
     { "rp_pppoe_mac", o_string, &pppoe_reqd_mac,
       "Only connect to specified MAC address" },
+    { "rp_pppoe_retry", o_string, &retrySchedule,
+      "Discovery retries: first,max[,jitter[,attempts]] (ms, percent)" },
+    { "rp_pppoe_cache", o_string, &resumeFile,
+      "Remember the session in this file and resume it on restart" },
+    { "rp_pppoe_pado_window", o_string, &padoWindow,
+      "Collect PADOs for this long: ms[:vendor]; pick the best AC" },
     { NULL }
 };
 
@@ -149,7 +158,16 @@ PPPOEInitDevice(void)
     }
     snprintf(conn->hostUniq, 17, "%lx", (unsigned long) getpid());
     conn->printACNames = printACNames;
-    conn->discoveryTimeout = PADI_TIMEOUT;
+    retryDefaults(&conn->retry);
+    if (retrySchedule && parseRetrySchedule(&conn->retry, retrySchedule) < 0) {
+	fatal("Invalid rp_pppoe_retry schedule '%s'", retrySchedule);
+    }
+    if (resumeFile) {
+	SET_STRING(conn->resumeFile, resumeFile);
+    }
+    if (padoWindow && parsePadoWindow(conn, padoWindow) < 0) {
+	fatal("Invalid rp_pppoe_pado_window '%s'", padoWindow);
+    }
     return 1;
 }
 
@@ -239,7 +257,7 @@ PPPOEConnectDevice(void)
         discovery(conn);
 	if (conn->discoveryState != STATE_SESSION) {
 	    error("Unable to complete PPPoE Discovery");
-	    close(conn->discoverySocket);
+	    closeInterface(conn->discoverySocket);
 	    conn->discoverySocket = -1;
 	    return -1;
 	}
@@ -358,7 +376,7 @@ PPPOEDisconnectDevice(void)
     close(conn->sessionSocket);
     if (conn->discoverySocket >= 0) {
 	sendPADT(conn, "RP-PPPoE: pppd invoked disconnect");
-	close(conn->discoverySocket);
+	closeInterface(conn->discoverySocket);
     }
 
     /* Do NOT free conn; if pppd persist is on, we'll need it again */
@@ -37,45 +37,25 @@
 
 #include "pppoe.h"
 
-static int PPPState;
-static int PPPPacketSize;
-static unsigned char PPPXorValue;
-
-static uint16_t const fcstab[256] = {
-    0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
-    0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
-    0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
-    0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
-    0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
-    0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
-    0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
-    0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
-    0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
-    0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
-    0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
-    0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
-    0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
-    0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
-    0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
-    0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
-    0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
-    0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
-    0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
-    0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
-    0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
-    0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
-    0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
-    0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
-    0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
-    0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
-    0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
-    0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
-    0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
-    0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
-    0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
-    0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_SIMD_ESCAPE 1
+#endif
+
+/* Bytes which must be escaped in async frames sent to pppd: all control
+   characters, plus FRAME_FLAG, FRAME_ESC and FRAME_ADDR */
+static unsigned char const escapeTab[256] = {
+    [0x00 ... 0x1F] = 1,
+    [FRAME_ESC] = 1,
+    [FRAME_FLAG] = 1,
+    [FRAME_ADDR] = 1
 };
 
+/* Scratch for decodeFromPPP: frames waiting to go out in one batch.
+   Nothing is left here between calls. */
+static PPPoEPacket TxBatch[MAX_SEND_BATCH];
+static int TxLens[MAX_SEND_BATCH];
+
 /**********************************************************************
 *%FUNCTION: syncReadFromPPP
 *%ARGUMENTS:
@@ -97,14 +77,14 @@ syncReadFromPPP(PPPoEConnection *conn, PPPoEPacket *packet)
     vec[0].iov_base = (void *) dummy;
     vec[0].iov_len = 2;
     vec[1].iov_base = (void *) packet->payload;
-    vec[1].iov_len = ETH_JUMBO_LEN - PPPOE_OVERHEAD;
+    vec[1].iov_len = conn->maxPayload;
 
     /* Use scatter-read to throw away the PPP frame address bytes */
     r = readv(0, vec, 2);
 #else
     /* Bloody hell... readv doesn't work with N_HDLC line discipline... GRR! */
-    unsigned char buf[ETH_JUMBO_LEN - PPPOE_OVERHEAD + 2];
-    r = read(0, buf, ETH_JUMBO_LEN - PPPOE_OVERHEAD + 2);
+    unsigned char buf[MAX_PPPOE_PAYLOAD + 2];
+    r = read(0, buf, conn->maxPayload + 2);
     if (r >= 2) {
 	memcpy(packet->payload, buf+2, r-2);
     }
@@ -129,40 +109,202 @@ syncReadFromPPP(PPPoEConnection *conn, PPPoEPacket *packet)
     sendSessionPacket(conn, packet, r-2);
 }
 
+#ifdef HAVE_SIMD_ESCAPE
+/**********************************************************************
+*%FUNCTION: escapeRun
+*%ARGUMENTS:
+* out -- where to write escaped bytes
+* src -- block of unescaped bytes
+* n -- length of block
+* mask -- bit i set if src[i] needs escaping
+*%RETURNS:
+* Pointer just past the escaped output
+*%DESCRIPTION:
+* Escapes one block whose escape positions are already known: clean runs
+* between them are copied with memcpy.
+***********************************************************************/
+static inline unsigned char *
+escapeRun(unsigned char *out, unsigned char const *src, int n, uint32_t mask)
+{
+    int pos = 0, b;
+
+    while (mask) {
+	b = __builtin_ctz(mask);
+	memcpy(out, src + pos, b - pos);
+	out += b - pos;
+	*out++ = FRAME_ESC;
+	*out++ = src[b] ^ FRAME_ENC;
+	pos = b + 1;
+	mask &= mask - 1;
+    }
+    memcpy(out, src + pos, n - pos);
+    return out + n - pos;
+}
+
+/**********************************************************************
+*%FUNCTION: escapeMask16
+*%ARGUMENTS:
+* src -- 16 bytes of data
+*%RETURNS:
+* A bit mask with bit i set if src[i] needs escaping
+***********************************************************************/
+static inline uint32_t
+escapeMask16(unsigned char const *src)
+{
+    __m128i v = _mm_loadu_si128((__m128i const *) src);
+    __m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1F)), v);
+    __m128i spc = _mm_or_si128(
+	_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8((char) FRAME_ESC)),
+		     _mm_cmpeq_epi8(v, _mm_set1_epi8((char) FRAME_FLAG))),
+	_mm_cmpeq_epi8(v, _mm_set1_epi8((char) FRAME_ADDR)));
+    return (uint32_t) _mm_movemask_epi8(_mm_or_si128(ctl, spc));
+}
+
+/**********************************************************************
+*%FUNCTION: escapeBlocksAVX2
+*%ARGUMENTS:
+* out -- pointer to output pointer; advanced past escaped output
+* src -- data to escape
+* len -- length of data
+*%RETURNS:
+* Number of bytes of "src" consumed (a multiple of 32)
+*%DESCRIPTION:
+* Escapes 32-byte blocks using AVX2 compares.
+***********************************************************************/
+__attribute__((target("avx2")))
+static int
+escapeBlocksAVX2(unsigned char **out, unsigned char const *src, int len)
+{
+    __m256i lim = _mm256_set1_epi8(0x1F);
+    __m256i esc = _mm256_set1_epi8((char) FRAME_ESC);
+    __m256i flag = _mm256_set1_epi8((char) FRAME_FLAG);
+    __m256i addr = _mm256_set1_epi8((char) FRAME_ADDR);
+    unsigned char *o = *out;
+    int done = 0;
+    uint32_t mask;
+    __m256i v, m;
+
+    while (len - done >= 32) {
+	v = _mm256_loadu_si256((__m256i const *) (src + done));
+	m = _mm256_or_si256(
+	    _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, lim), v),
+			    _mm256_cmpeq_epi8(v, esc)),
+	    _mm256_or_si256(_mm256_cmpeq_epi8(v, flag),
+			    _mm256_cmpeq_epi8(v, addr)));
+	mask = (uint32_t) _mm256_movemask_epi8(m);
+	if (!mask) {
+	    memcpy(o, src + done, 32);
+	    o += 32;
+	} else {
+	    o = escapeRun(o, src + done, 32, mask);
+	}
+	done += 32;
+    }
+    *out = o;
+    return done;
+}
+
+/**********************************************************************
+*%FUNCTION: findSpecialAVX2
+*%ARGUMENTS:
+* src -- async PPP data
+* len -- length of data
+*%RETURNS:
+* Index of the first FRAME_FLAG or FRAME_ESC byte in the 32-byte blocks
+* of "src", or the number of bytes scanned if there is none
+***********************************************************************/
+__attribute__((target("avx2")))
+static int
+findSpecialAVX2(unsigned char const *src, int len)
+{
+    __m256i esc = _mm256_set1_epi8((char) FRAME_ESC);
+    __m256i flag = _mm256_set1_epi8((char) FRAME_FLAG);
+    int done = 0;
+    uint32_t mask;
+    __m256i v;
+
+    while (len - done >= 32) {
+	v = _mm256_loadu_si256((__m256i const *) (src + done));
+	mask = (uint32_t) _mm256_movemask_epi8(
+	    _mm256_or_si256(_mm256_cmpeq_epi8(v, esc),
+			    _mm256_cmpeq_epi8(v, flag)));
+	if (mask) return done + __builtin_ctz(mask);
+	done += 32;
+    }
+    return done;
+}
+#endif
+
+/**********************************************************************
+*%FUNCTION: findSpecial
+*%ARGUMENTS:
+* src -- async PPP data
+* len -- length of data
+*%RETURNS:
+* Index of the first FRAME_FLAG or FRAME_ESC byte in "src", or "len"
+* if there is none
+***********************************************************************/
+static int
+findSpecial(unsigned char const *src, int len)
+{
+    int i = 0;
+
+#ifdef HAVE_SIMD_ESCAPE
+    __m128i v;
+    uint32_t mask;
+
+    if (len >= 32 && cpuHasAVX2()) {
+	i = findSpecialAVX2(src, len);
+	if (i < len && (src[i] == FRAME_ESC || src[i] == FRAME_FLAG)) return i;
+    }
+    for (; len - i >= 16; i += 16) {
+	v = _mm_loadu_si128((__m128i const *) (src + i));
+	mask = (uint32_t) _mm_movemask_epi8(
+	    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8((char) FRAME_ESC)),
+			 _mm_cmpeq_epi8(v, _mm_set1_epi8((char) FRAME_FLAG))));
+	if (mask) return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < len; i++) {
+	if (src[i] == FRAME_ESC || src[i] == FRAME_FLAG) break;
+    }
+    return i;
+}
+
+
 /**********************************************************************
 *%FUNCTION: initPPP
 *%ARGUMENTS:
-* None
+* conn -- PPPoEConnection structure
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* Initializes the PPP state machine
+* Initializes the connection's async PPP decoder
 ***********************************************************************/
 void
-initPPP(void)
+initPPP(PPPoEConnection *conn)
 {
-    PPPState = STATE_WAITFOR_FRAME_ADDR;
-    PPPPacketSize = 0;
-    PPPXorValue = 0;
-
+    conn->decoder.state = STATE_WAITFOR_FRAME_ADDR;
+    conn->decoder.packetSize = 0;
+    conn->decoder.xorValue = 0;
 }
+
 /**********************************************************************
 *%FUNCTION: asyncReadFromPPP
 *%ARGUMENTS:
 * conn -- PPPoEConnection structure
-* packet -- buffer in which to place PPPoE packet
+* packet -- packet whose Ethernet and PPPoE headers are used for each
+*           frame sent
 *%RETURNS:
-* Nothing
+* The number of bytes read
 *%DESCRIPTION:
-* Reads from an async PPP device and builds a PPPoE packet to transmit
+* Reads from an async PPP device and transmits the PPPoE packets it
+* contains
 ***********************************************************************/
-void
+int
 asyncReadFromPPP(PPPoEConnection *conn, PPPoEPacket *packet)
 {
     unsigned char buf[READ_CHUNK];
-    unsigned char *ptr = buf;
-    unsigned char c;
-
     int r;
 
     r = read(0, buf, READ_CHUNK);
@@ -176,149 +318,186 @@ asyncReadFromPPP(PPPoEConnection *conn, PPPoEPacket *packet)
 	exit(EXIT_SUCCESS);
     }
 
-    while(r) {
-	if (PPPState == STATE_WAITFOR_FRAME_ADDR) {
-	    while(r) {
-		--r;
-		if (*ptr++ == FRAME_ADDR) {
-		    PPPState = STATE_DROP_PROTO;
-		    break;
-		}
-	    }
-	}
-
-	/* Still waiting... */
-	if (PPPState == STATE_WAITFOR_FRAME_ADDR) return;
-
-	while(r && PPPState == STATE_DROP_PROTO) {
-	    --r;
-	    if (*ptr++ == (FRAME_CTRL ^ FRAME_ENC)) {
-		PPPState = STATE_BUILDING_PACKET;
-	    }
-	}
-
-	if (PPPState == STATE_DROP_PROTO) return;
-
-	/* Start building frame */
-	while(r && PPPState == STATE_BUILDING_PACKET) {
-	    --r;
-	    c = *ptr++;
-	    switch(c) {
-	    case FRAME_ESC:
-		PPPXorValue = FRAME_ENC;
-		break;
-	    case FRAME_FLAG:
-		if (PPPPacketSize < 2) {
-		    rp_fatal("Packet too short from PPP (asyncReadFromPPP)");
-		}
-		sendSessionPacket(conn, packet, PPPPacketSize-2);
-		PPPPacketSize = 0;
-		PPPXorValue = 0;
-		PPPState = STATE_WAITFOR_FRAME_ADDR;
-		break;
-	    default:
-		if (PPPPacketSize >= ETH_JUMBO_LEN - 4) {
-		    syslog(LOG_ERR, "Packet too big!  Check MTU on PPP interface");
-		    PPPPacketSize = 0;
-		    PPPXorValue = 0;
-		    PPPState = STATE_WAITFOR_FRAME_ADDR;
-		} else {
-		    packet->payload[PPPPacketSize++] = c ^ PPPXorValue;
-		    PPPXorValue = 0;
-		}
-	    }
-	}
-    }
+    decodeFromPPP(conn, packet, buf, r);
+    return r;
 }
 
 /**********************************************************************
 *%FUNCTION: decodeFromPPP
 *%ARGUMENTS:
 * conn -- PPPoEConnection structure
-* packet -- buffer in which to place PPPoE packet
+* packet -- packet whose Ethernet and PPPoE headers are used for each
+*           frame sent
+* buf -- async PPP data
+* r -- number of bytes in "buf"
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* Reads from an async PPP device and builds a PPPoE packet to transmit
+* Decodes async PPP data and transmits the PPPoE packets it contains.
+* Completed frames are queued in TxBatch and sent with a single
+* sendSessionPackets call when the batch fills or the data runs out.
+* A partial frame is carried over to the next call in conn->decoder.
+* Within a frame, runs of bytes free of FRAME_FLAG and
+* FRAME_ESC are located with findSpecial and copied in bulk.
 ***********************************************************************/
 void
 decodeFromPPP(PPPoEConnection *conn, PPPoEPacket *packet, unsigned char *buf, int r)
 {
+    PPPDecoder *dec = &conn->decoder;
+    PPPoEPacket *cur = &TxBatch[0];
     unsigned char *ptr = buf;
+    unsigned char *p;
     unsigned char c;
+    int n, room;
+    int count = 0;
+    int limit = conn->maxPayload + 2; /* Payload plus FCS */
+
+    /* Pick up where the last call left off */
+    if (dec->state == STATE_BUILDING_PACKET && dec->packetSize) {
+	memcpy(cur->payload, dec->frame, dec->packetSize);
+    }
 
     while(r) {
-	if (PPPState == STATE_WAITFOR_FRAME_ADDR) {
-	    while(r) {
-		--r;
-		if (*ptr++ == FRAME_ADDR) {
-		    PPPState = STATE_DROP_PROTO;
-		    break;
-		}
-	    }
+	if (dec->state == STATE_WAITFOR_FRAME_ADDR) {
+	    p = memchr(ptr, FRAME_ADDR, r);
+	    if (!p) break;
+	    r -= p + 1 - ptr;
+	    ptr = p + 1;
+	    dec->state = STATE_DROP_PROTO;
 	}
 
-	/* Still waiting... */
-	if (PPPState == STATE_WAITFOR_FRAME_ADDR) return;
-
-	while(r && PPPState == STATE_DROP_PROTO) {
-	    --r;
-	    if (*ptr++ == (FRAME_CTRL ^ FRAME_ENC)) {
-		PPPState = STATE_BUILDING_PACKET;
-	    }
+	if (dec->state == STATE_DROP_PROTO) {
+	    p = memchr(ptr, FRAME_CTRL ^ FRAME_ENC, r);
+	    if (!p) break;
+	    r -= p + 1 - ptr;
+	    ptr = p + 1;
+	    dec->state = STATE_BUILDING_PACKET;
 	}
 
-	if (PPPState == STATE_DROP_PROTO) return;
-
 	/* Start building frame */
-	while(r && PPPState == STATE_BUILDING_PACKET) {
+	while(r && dec->state == STATE_BUILDING_PACKET) {
+	    if (!dec->xorValue) {
+		/* Copy the run up to the next flag or escape */
+		n = findSpecial(ptr, r);
+		if (n) {
+		    room = limit - dec->packetSize;
+		    if (n > room) {
+			syslog(LOG_ERR, "Packet too big!  Check MTU on PPP interface");
+			dec->packetSize = 0;
+			dec->state = STATE_WAITFOR_FRAME_ADDR;
+			r -= room + 1;
+			ptr += room + 1;
+			break;
+		    }
+		    memcpy(cur->payload + dec->packetSize, ptr, n);
+		    dec->packetSize += n;
+		    ptr += n;
+		    r -= n;
+		    if (!r) break;
+		}
+	    }
 	    --r;
 	    c = *ptr++;
 	    switch(c) {
 	    case FRAME_ESC:
-		PPPXorValue = FRAME_ENC;
+		dec->xorValue = FRAME_ENC;
 		break;
 	    case FRAME_FLAG:
-		if (PPPPacketSize < 2) {
+		if (dec->packetSize < 2) {
 		    rp_fatal("Packet too short from PPP (asyncReadFromPPP)");
 		}
-		sendSessionPacket(conn, packet, PPPPacketSize-2);
-		PPPPacketSize = 0;
-		PPPXorValue = 0;
-		PPPState = STATE_WAITFOR_FRAME_ADDR;
+		memcpy(cur, packet, HDR_SIZE);
+		TxLens[count++] = dec->packetSize - 2;
+		if (count == MAX_SEND_BATCH) {
+		    sendSessionPackets(conn, TxBatch, TxLens, count);
+		    count = 0;
+		}
+		cur = &TxBatch[count];
+		dec->packetSize = 0;
+		dec->xorValue = 0;
+		dec->state = STATE_WAITFOR_FRAME_ADDR;
 		break;
 	    default:
-		if (PPPPacketSize >= ETH_JUMBO_LEN - 4) {
+		if (dec->packetSize >= limit) {
 		    syslog(LOG_ERR, "Packet too big!  Check MTU on PPP interface");
-		    PPPPacketSize = 0;
-		    PPPXorValue = 0;
-		    PPPState = STATE_WAITFOR_FRAME_ADDR;
+		    dec->packetSize = 0;
+		    dec->xorValue = 0;
+		    dec->state = STATE_WAITFOR_FRAME_ADDR;
 		} else {
-		    packet->payload[PPPPacketSize++] = c ^ PPPXorValue;
-		    PPPXorValue = 0;
+		    cur->payload[dec->packetSize++] = c ^ dec->xorValue;
+		    dec->xorValue = 0;
 		}
 	    }
 	}
     }
+
+    if (count) {
+	sendSessionPackets(conn, TxBatch, TxLens, count);
+    }
+
+    /* Keep any partial frame for the next call */
+    if (dec->state == STATE_BUILDING_PACKET && dec->packetSize) {
+	memcpy(dec->frame, cur->payload, dec->packetSize);
+    }
 }
+
+
 /**********************************************************************
-*%FUNCTION: pppFCS16
+*%FUNCTION: pppAsyncEncode
 *%ARGUMENTS:
-* fcs -- current fcs
-* cp -- a buffer's worth of data
-* len -- length of buffer "cp"
+* dst -- output buffer; must hold 2*len bytes
+* src -- unescaped data
+* len -- length of "src"
+* fcs -- pointer to running FCS; updated with the bytes of "src"
 *%RETURNS:
-* A new FCS
+* The number of bytes written to "dst"
 *%DESCRIPTION:
-* Updates the PPP FCS.
+* HDLC-escapes "src" for an async PPP link and updates the FCS.  The FCS
+* is computed over the whole buffer first with pppFCS16Fast, which is
+* quicker than folding it into the escape loop.  On x86-64, SSE2 (or
+* AVX2, if the CPU has it) compares locate the bytes needing escape a
+* block at a time, and clean runs are copied with memcpy; a table lookup
+* handles the rest.
 ***********************************************************************/
-uint16_t
-pppFCS16(uint16_t fcs,
-	 unsigned char * cp,
-	 int len)
+int
+pppAsyncEncode(unsigned char *dst, unsigned char const *src, int len,
+	       uint16_t *fcs)
 {
-    while (len--)
-	fcs = (fcs >> 8) ^ fcstab[(fcs ^ *cp++) & 0xff];
+    unsigned char *out = dst;
+    unsigned char c;
+
+    *fcs = pppFCS16Fast(*fcs, src, len);
+
+#ifdef HAVE_SIMD_ESCAPE
+    uint32_t mask;
+    int done;
 
-    return (fcs);
+    if (len >= 32 && cpuHasAVX2()) {
+	done = escapeBlocksAVX2(&out, src, len);
+	src += done;
+	len -= done;
+    }
+    while (len >= 16) {
+	mask = escapeMask16(src);
+	if (!mask) {
+	    memcpy(out, src, 16);
+	    out += 16;
+	} else {
+	    out = escapeRun(out, src, 16, mask);
+	}
+	src += 16;
+	len -= 16;
+    }
+#endif
+
+    while (len--) {
+	c = *src++;
+	if (escapeTab[c]) {
+	    *out++ = FRAME_ESC;
+	    *out++ = c ^ FRAME_ENC;
+	} else {
+	    *out++ = c;
+	}
+    }
+    return (int) (out - dst);
 }
@@ -0,0 +1,468 @@
+/***********************************************************************
+*
+* pppoe-relay-bench.c
+*
+* Offline session-forwarding benchmark for pppoe-relay.
+*
+* The relay's own code (relay.c built with main renamed to relay_main)
+* is given two interfaces on the in-process "loop" packet backend, one
+* facing clients and one facing access concentrators.  The session table
+* is filled through initRelay and createSession with MAC addresses drawn
+* the way a real access network looks -- a few CPE vendors' OUIs, random
+* NIC bytes, a handful of ACs -- and then synthetic session frames are
+* pushed through relayGotSessionPacket in both directions.
+*
+* Frames are sent to sessions in creation order, in random order and
+* with a skewed (mostly hot sessions) distribution, which shows how much
+* of the per-frame cost is cache misses on the session table.  Hash
+* chain statistics are printed as well.  See the "bench" target in
+* Makefile.in.
+*
+* Copyright (C) 2001-2018 Roaring Penguin Software Inc.
+* Copyright (C) 2018-2023 Dianne Skoll
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+* SPDX-License-Identifier: GPL-2.0-or-later
+*
+***********************************************************************/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "relay.h"
+
+/* Frames pushed at the relay before it is run; keeps the loop
+   backend's queues from overflowing */
+#define BATCH 256
+
+/* Interfaces[] slots used by the benchmark */
+#define CLI_IF 0
+#define AC_IF  1
+
+/* A session as the outside world sees it */
+typedef struct {
+    unsigned char cliMac[ETH_ALEN];
+    unsigned char acMac[ETH_ALEN];
+    uint16_t cliSes;		/* Number the client uses (relay-assigned) */
+    uint16_t acSes;		/* Number the AC uses */
+} BenchSession;
+
+/* Client MAC prefixes, with the share of the population using each.
+   Real access networks are dominated by a few CPE vendors. */
+static struct {
+    unsigned char oui[3];
+    int weight;
+} const ClientOUIs[] = {
+    { { 0x00, 0x1e, 0x58 }, 35 },
+    { { 0x00, 0x24, 0x01 }, 25 },
+    { { 0xc8, 0x3a, 0x35 }, 15 },
+    { { 0x14, 0xcc, 0x20 }, 10 },
+    { { 0x00, 0x1f, 0x33 },  8 },
+    { { 0x00, 0x26, 0x5a },  7 },
+};
+#define NUM_OUIS (sizeof(ClientOUIs) / sizeof(ClientOUIs[0]))
+
+/* PPP payload sizes, roughly simple IMIX: mostly small packets */
+static int const PayloadSizes[] = { 40, 40, 40, 40, 40, 40, 40, 576, 576, 576, 1492, 1492 };
+#define NUM_PAYLOAD_SIZES (sizeof(PayloadSizes) / sizeof(PayloadSizes[0]))
+
+/* Orders in which frames are sent to sessions */
+#define ORDER_SEQUENTIAL 0
+#define ORDER_RANDOM     1
+#define ORDER_SKEWED     2
+static char const *OrderNames[] = { "sequential", "random", "skewed" };
+#define NUM_ORDERS 3
+
+static BenchSession *Sessions;
+static int NumBench = 10000;
+static int NumAcs = 4;
+static long NumFrames = 2000000;
+static uint32_t Seed = 1;
+
+static int CliSock = -1;	/* Our end of the client-side pair */
+static int AcSock = -1;		/* Our end of the AC-side pair */
+static unsigned long Forwarded;	/* Frames that came out the other side */
+
+/* Relay state, defined in relay.c */
+extern PPPoEInterface Interfaces[];
+extern int NumInterfaces;
+extern int NumSessions;
+extern int MaxSessions;
+extern SessionHash **Buckets;
+extern unsigned int HashSize;
+
+/**********************************************************************
+*%FUNCTION: rnd
+*%RETURNS:
+* The next value from a small xorshift generator.  Runs are repeatable
+* for a given -s seed.
+***********************************************************************/
+static uint32_t
+rnd(void)
+{
+    Seed ^= Seed << 13;
+    Seed ^= Seed >> 17;
+    Seed ^= Seed << 5;
+    return Seed;
+}
+
+/**********************************************************************
+*%FUNCTION: nowNs
+*%RETURNS:
+* A monotonic timestamp in nanoseconds
+***********************************************************************/
+static double
+nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**********************************************************************
+*%FUNCTION: clientMac
+*%ARGUMENTS:
+* mac -- set to a random client MAC address
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Picks a vendor OUI by weight and random NIC-specific bytes.
+***********************************************************************/
+static void
+clientMac(unsigned char *mac)
+{
+    int total = 0, pick;
+    size_t i;
+    uint32_t r;
+
+    for (i=0; i<NUM_OUIS; i++) total += ClientOUIs[i].weight;
+    pick = rnd() % total;
+    for (i=0; i<NUM_OUIS-1; i++) {
+	if (pick < ClientOUIs[i].weight) break;
+	pick -= ClientOUIs[i].weight;
+    }
+    memcpy(mac, ClientOUIs[i].oui, 3);
+    r = rnd();
+    mac[3] = (r >> 16) & 0xFF;
+    mac[4] = (r >> 8) & 0xFF;
+    mac[5] = r & 0xFF;
+}
+
+/**********************************************************************
+*%FUNCTION: openSide
+*%ARGUMENTS:
+* iface -- relay interface to set up
+* name -- loop pair name
+*%RETURNS:
+* Our end of the pair
+*%DESCRIPTION:
+* Gives the relay side 0 of a loop pair, much as addInterface would for
+* a real interface, and opens side 1 for the benchmark.
+***********************************************************************/
+static int
+openSide(PPPoEInterface *iface, char const *name)
+{
+    char spec[64];
+
+    memset(iface, 0, sizeof(*iface));
+    snprintf(iface->name, sizeof(iface->name), "loop:%s:0", name);
+    iface->sessionSock = openInterface(iface->name, Eth_PPPOE_Session,
+				       iface->mac, NULL);
+    iface->discoverySock = -1;
+    snprintf(spec, sizeof(spec), "loop:%s:1", name);
+    return openInterface(spec, Eth_PPPOE_Session, NULL, NULL);
+}
+
+/**********************************************************************
+*%FUNCTION: populate
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Creates NumBench sessions through createSession, spread round-robin
+* over NumAcs access concentrators.  Each AC hands out its own session
+* numbers sequentially, as real ones do.
+***********************************************************************/
+static void
+populate(void)
+{
+    PPPoEInterface *cli = &Interfaces[CLI_IF];
+    PPPoEInterface *ac = &Interfaces[AC_IF];
+    VlanTags noVlan;
+    PPPoESession *ses;
+    int i;
+
+    memset(&noVlan, 0, sizeof(noVlan));
+    for (i=0; i<NumBench; i++) {
+	BenchSession *b = &Sessions[i];
+	int acIdx = i % NumAcs;
+
+	clientMac(b->cliMac);
+	b->acMac[0] = 0x00;
+	b->acMac[1] = 0x0c;
+	b->acMac[2] = 0x86;
+	b->acMac[3] = 0x10;
+	b->acMac[4] = 0x00;
+	b->acMac[5] = acIdx + 1;
+	b->acSes = htons(i / NumAcs + 1);
+
+	ses = createSession(ac, cli, b->acMac, b->cliMac, &noVlan, b->acSes);
+	if (!ses) {
+	    rp_fatal("createSession failed while populating the table");
+	}
+	b->cliSes = ses->sesNum;
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: chainStats
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Prints how the session hashes are spread over the buckets: chain
+* lengths, and how many entries a successful lookup has to visit on
+* average (each one a likely cache miss).
+***********************************************************************/
+static void
+chainStats(void)
+{
+    unsigned long entries = 0, used = 0, probes = 0;
+    unsigned int maxChain = 0;
+    unsigned int b, len;
+    SessionHash *sh;
+    double kib;
+
+    for (b=0; b<HashSize; b++) {
+	len = 0;
+	for (sh = Buckets[b]; sh; sh = sh->next) {
+	    len++;
+	    probes += len;
+	}
+	if (len) used++;
+	if (len > maxChain) maxChain = len;
+	entries += len;
+    }
+    kib = (MaxSessions * sizeof(PPPoESession) +
+	   2.0 * MaxSessions * sizeof(SessionHash) +
+	   HashSize * sizeof(SessionHash *)) / 1024.0;
+
+    printf("sessions %d on %d ACs; %lu hash entries in %u buckets (load %.2f)\n",
+	   NumSessions, NumAcs, entries, HashSize, (double) entries / HashSize);
+    printf("buckets used %lu (%.1f%%); chain length avg %.2f, max %u\n",
+	   used, 100.0 * used / HashSize,
+	   used ? (double) entries / used : 0.0, maxChain);
+    printf("entries visited per lookup %.2f; table footprint %.0f KiB\n",
+	   entries ? (double) probes / entries : 0.0, kib);
+}
+
+/**********************************************************************
+*%FUNCTION: pickSession
+*%ARGUMENTS:
+* order -- one of the ORDER_* values
+* n -- frame number
+*%RETURNS:
+* Index of the session frame "n" belongs to
+***********************************************************************/
+static int
+pickSession(int order, long n)
+{
+    switch(order) {
+    case ORDER_SEQUENTIAL:
+	return n % NumBench;
+    case ORDER_RANDOM:
+	return rnd() % NumBench;
+    default:
+	/* 90% of frames go to the first 10% of sessions */
+	if (NumBench >= 10 && rnd() % 10) {
+	    return rnd() % (NumBench / 10);
+	}
+	return rnd() % NumBench;
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: drain
+*%ARGUMENTS:
+* sock -- our end of a loop pair
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Reads and counts whatever the relay forwarded to "sock".
+***********************************************************************/
+static void
+drain(int sock)
+{
+    static PPPoEPacket pkts[MAX_RECV_BATCH];
+    int sizes[MAX_RECV_BATCH];
+    int n;
+
+    while ((n = receivePackets(sock, pkts, sizes, MAX_RECV_BATCH)) > 0) {
+	Forwarded += n;
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: runOrder
+*%ARGUMENTS:
+* order -- one of the ORDER_* values
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Pushes NumFrames session frames through the relay, half from clients
+* and half from ACs, and prints the forwarding rate.  Only the relay's
+* receive-lookup-rewrite-send path is timed.
+***********************************************************************/
+static void
+runOrder(int order)
+{
+    static PPPoEPacket cliPkts[BATCH], acPkts[BATCH];
+    int cliSizes[BATCH], acSizes[BATCH];
+    PPPoEInterface *cli = &Interfaces[CLI_IF];
+    PPPoEInterface *ac = &Interfaces[AC_IF];
+    unsigned long long unknown0 = cli->sessUnknown + ac->sessUnknown;
+    unsigned long bytes = 0;
+    long done = 0;
+    double ns = 0.0, t0;
+    int nc, na, i;
+
+    Forwarded = 0;
+    while (done < NumFrames) {
+	nc = na = 0;
+	for (i=0; i<BATCH && done < NumFrames; i++, done++) {
+	    BenchSession *b = &Sessions[pickSession(order, done)];
+	    int len = PayloadSizes[rnd() % NUM_PAYLOAD_SIZES] + 2;
+	    PPPoEPacket *pkt;
+
+	    if (rnd() & 1) {
+		pkt = &cliPkts[nc];
+		cliSizes[nc++] = len + HDR_SIZE;
+		memcpy(pkt->ethHdr.h_dest, cli->mac, ETH_ALEN);
+		memcpy(pkt->ethHdr.h_source, b->cliMac, ETH_ALEN);
+		pkt->session = b->cliSes;
+	    } else {
+		pkt = &acPkts[na];
+		acSizes[na++] = len + HDR_SIZE;
+		memcpy(pkt->ethHdr.h_dest, ac->mac, ETH_ALEN);
+		memcpy(pkt->ethHdr.h_source, b->acMac, ETH_ALEN);
+		pkt->session = b->acSes;
+	    }
+	    pkt->ethHdr.h_proto = htons(Eth_PPPOE_Session);
+	    pkt->vertype = PPPOE_VER_TYPE(1, 1);
+	    pkt->code = CODE_SESS;
+	    pkt->length = htons(len);
+	    pkt->payload[0] = 0x00;
+	    pkt->payload[1] = 0x21;	/* IPv4 */
+	    bytes += len + HDR_SIZE;
+	}
+	if (nc) sendPackets(NULL, CliSock, cliPkts, cliSizes, nc);
+	if (na) sendPackets(NULL, AcSock, acPkts, acSizes, na);
+
+	t0 = nowNs();
+	for (i=0; i<nc; i++) relayGotSessionPacket(cli);
+	for (i=0; i<na; i++) relayGotSessionPacket(ac);
+	ns += nowNs() - t0;
+
+	drain(CliSock);
+	drain(AcSock);
+    }
+
+    printf("%-10s %10ld %8.2f %9.1f %9.2f %10lu %8llu\n",
+	   OrderNames[order], NumFrames,
+	   ns ? NumFrames * 1e3 / ns : 0.0, ns / NumFrames,
+	   ns ? bytes * 8.0 / ns : 0.0, Forwarded,
+	   cli->sessUnknown + ac->sessUnknown - unknown0);
+}
+
+static void
+benchUsage(char const *argv0)
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv0);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "   -n sessions    -- Sessions to create (default 10000)\n");
+    fprintf(stderr, "   -a acs         -- Access concentrators they are spread over (default 4)\n");
+    fprintf(stderr, "   -p frames      -- Frames to forward per access order (default 2000000)\n");
+    fprintf(stderr, "   -s seed        -- Seed for MAC addresses and traffic (default 1)\n");
+    fprintf(stderr, "   -h             -- Print usage information\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    int opt, order;
+
+    while ((opt = getopt(argc, argv, "n:a:p:s:h")) != -1) {
+	switch(opt) {
+	case 'n':
+	    NumBench = atoi(optarg);
+	    if (NumBench <= 0) {
+		fprintf(stderr, "-n: Value must be positive\n");
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'a':
+	    NumAcs = atoi(optarg);
+	    if (NumAcs <= 0 || NumAcs > 255) {
+		fprintf(stderr, "-a: Value must be between 1 and 255\n");
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'p':
+	    NumFrames = atol(optarg);
+	    if (NumFrames <= 0) {
+		fprintf(stderr, "-p: Value must be positive\n");
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 's':
+	    Seed = strtoul(optarg, NULL, 0);
+	    if (!Seed) Seed = 1;
+	    break;
+	case 'h':
+	    benchUsage(argv[0]);
+	    exit(EXIT_SUCCESS);
+	default:
+	    benchUsage(argv[0]);
+	    exit(EXIT_FAILURE);
+	}
+    }
+    if (NumBench / NumAcs >= 65535) {
+	fprintf(stderr, "-n: At most 65534 sessions per AC; use more ACs (-a)\n");
+	exit(EXIT_FAILURE);
+    }
+
+    /* Session setup is logged at LOG_INFO; keep it out of the results */
+    setlogmask(LOG_UPTO(LOG_ERR));
+
+    Sessions = calloc(NumBench, sizeof(BenchSession));
+    if (!Sessions) {
+	rp_fatal("Out of memory");
+    }
+    CliSock = openSide(&Interfaces[CLI_IF], "rbench-cli");
+    AcSock = openSide(&Interfaces[AC_IF], "rbench-ac");
+    Interfaces[CLI_IF].clientOK = 1;
+    Interfaces[AC_IF].acOK = 1;
+    NumInterfaces = 2;
+
+    initRelay(NumBench);
+    populate();
+    chainStats();
+
+    printf("%-10s %10s %8s %9s %9s %10s %8s\n",
+	   "order", "frames", "Mpps", "ns/frame", "Gbit/s", "forwarded", "unknown");
+    for (order=0; order<NUM_ORDERS; order++) {
+	runOrder(order);
+    }
+    return 0;
+}
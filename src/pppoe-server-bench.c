@@ -0,0 +1,590 @@
+/***********************************************************************
+*
+* pppoe-server-bench.c
+*
+* Offline discovery-throughput benchmark for pppoe-server.
+*
+* The server's own code (pppoe-server.c built with main renamed to
+* pppoe_server_main) is set up exactly as the real server would be, on
+* the in-process "loop" packet backend.  When it enters its event loop,
+* we take over: discovery frames are pushed at it as fast as it will
+* take them and each serverProcessPacket call is timed.
+*
+* fork, kill and waitpid are replaced at link time (ld --wrap), so a
+* PADR "starts" a session without running pppd, and a PADT's kill is
+* turned into an immediate, fake child exit which the server reaps
+* through its normal SIGCHLD path.  malloc, calloc, realloc and strdup
+* are counted.  See the "bench" target in Makefile.in.
+*
+* Copyright (C) 2000-2012 Roaring Penguin Software Inc.
+* Copyright (C) 2018-2023 Dianne Skoll
+*
+* This program may be distributed according to the terms of the GNU
+* General Public License, version 2 or (at your option) any later version.
+*
+* SPDX-License-Identifier: GPL-2.0-or-later
+*
+***********************************************************************/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "pppoe-server.h"
+
+/* Frames pushed at the server before it is run; keeps the loop
+   backend's queues from overflowing */
+#define BATCH 256
+
+/* Fake child PIDs start here; well above any real pid_max */
+#define FAKE_PID_BASE 0x40000000
+
+/* Discovery codes we keep statistics for */
+static struct {
+    unsigned char code;
+    char const *name;
+    unsigned long packets;
+    unsigned long allocs;
+    double ns;
+} Stats[] = {
+    { CODE_PADI, "PADI", 0, 0, 0.0 },
+    { CODE_PADR, "PADR", 0, 0, 0.0 },
+    { CODE_PADT, "PADT", 0, 0, 0.0 },
+    { 0,         "other", 0, 0, 0.0 },
+};
+#define NUM_STATS (sizeof(Stats) / sizeof(Stats[0]))
+
+/* A simulated client */
+typedef struct {
+    unsigned char cookie[ETH_JUMBO_LEN];
+    uint16_t cookieLen;		/* Zero until a PADO arrives */
+    uint16_t sess;		/* Session number, network order; 0 if none */
+} BenchClient;
+
+static BenchClient *Clients;
+static int NumClients = 1000;
+static int Rounds = 20;
+static char const *RecordFile = NULL;
+
+static int ClientSock = -1;	/* Our end of the loop pair */
+static Interface *Server;	/* The server's end */
+static EventSelector *ServerES;
+
+static unsigned long Allocs;	/* Counted allocations */
+static unsigned long Replies[256]; /* Frames the server sent, by code */
+static unsigned long Forks;
+
+static pid_t NextPid = FAKE_PID_BASE;
+static pid_t *Exited;		/* Fake children waiting to be reaped */
+static int NumExited, MaxExited;
+
+extern int pppoe_server_main(int argc, char **argv);
+
+/* Link-time wrappers; see BENCH_WRAP in Makefile.in */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(char const *s);
+pid_t __real_waitpid(pid_t pid, int *status, int options);
+int __real_kill(pid_t pid, int sig);
+int __real_Event_HandleEvent(EventSelector *es);
+
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t nmemb, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+char *__wrap_strdup(char const *s);
+pid_t __wrap_fork(void);
+int __wrap_kill(pid_t pid, int sig);
+pid_t __wrap_waitpid(pid_t pid, int *status, int options);
+int __wrap_Event_HandleEvent(EventSelector *es);
+
+void *__wrap_malloc(size_t size)
+{
+    Allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    Allocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    Allocs++;
+    return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(char const *s)
+{
+    Allocs++;
+    return __real_strdup(s);
+}
+
+/* A PADR's child "starts" without running anything */
+pid_t __wrap_fork(void)
+{
+    Forks++;
+    return NextPid++;
+}
+
+/* Killing a fake child makes it exit at once */
+int __wrap_kill(pid_t pid, int sig)
+{
+    if (pid < FAKE_PID_BASE) {
+	return __real_kill(pid, sig);
+    }
+    if (NumExited == MaxExited) {
+	MaxExited = MaxExited ? MaxExited * 2 : BATCH;
+	Exited = __real_realloc(Exited, MaxExited * sizeof(pid_t));
+	if (!Exited) {
+	    rp_fatal("Out of memory");
+	}
+    }
+    Exited[NumExited++] = pid;
+    return 0;
+}
+
+/* Fake children are reaped ahead of real ones */
+pid_t __wrap_waitpid(pid_t pid, int *status, int options)
+{
+    if (NumExited && (pid == -1 || pid == Exited[NumExited-1])) {
+	if (status) *status = 0;
+	return Exited[--NumExited];
+    }
+    return __real_waitpid(pid, status, options);
+}
+
+/**********************************************************************
+*%FUNCTION: nowNs
+*%RETURNS:
+* A monotonic timestamp in nanoseconds
+***********************************************************************/
+static double
+nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**********************************************************************
+*%FUNCTION: statFor
+*%ARGUMENTS:
+* code -- discovery code
+*%RETURNS:
+* Index of the statistics slot for "code"
+***********************************************************************/
+static size_t
+statFor(unsigned char code)
+{
+    size_t i;
+
+    for (i=0; i<NUM_STATS-1; i++) {
+	if (Stats[i].code == code) break;
+    }
+    return i;
+}
+
+/**********************************************************************
+*%FUNCTION: clientMac
+*%ARGUMENTS:
+* idx -- client index
+* mac -- set to the client's MAC address
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+clientMac(int idx, unsigned char *mac)
+{
+    mac[0] = 0x02;
+    mac[1] = 0xbe;
+    mac[2] = 0x0c;
+    mac[3] = (idx >> 16) & 0xFF;
+    mac[4] = (idx >> 8) & 0xFF;
+    mac[5] = idx & 0xFF;
+}
+
+/**********************************************************************
+*%FUNCTION: clientIndex
+*%ARGUMENTS:
+* mac -- a MAC address
+*%RETURNS:
+* The index of the client with that address, or -1
+***********************************************************************/
+static int
+clientIndex(unsigned char const *mac)
+{
+    int idx;
+
+    if (mac[0] != 0x02 || mac[1] != 0xbe || mac[2] != 0x0c) return -1;
+    idx = (mac[3] << 16) | (mac[4] << 8) | mac[5];
+    return (idx < NumClients) ? idx : -1;
+}
+
+/**********************************************************************
+*%FUNCTION: drainReplies
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Reads what the server sent and remembers the cookie from each PADO.
+***********************************************************************/
+static void
+drainReplies(void)
+{
+    static PPPoEPacket pkts[MAX_RECV_BATCH];
+    int sizes[MAX_RECV_BATCH];
+    PPPoETag cookie;
+    int i, n, idx;
+
+    while ((n = receivePackets(ClientSock, pkts, sizes, MAX_RECV_BATCH)) > 0) {
+	for (i=0; i<n; i++) {
+	    Replies[pkts[i].code]++;
+	    if (pkts[i].code != CODE_PADO) continue;
+	    idx = clientIndex(pkts[i].ethHdr.h_dest);
+	    if (idx < 0 || !findTag(&pkts[i], TAG_AC_COOKIE, &cookie)) continue;
+	    Clients[idx].cookieLen = ntohs(cookie.length);
+	    memcpy(Clients[idx].cookie, cookie.payload, Clients[idx].cookieLen);
+	}
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: runFrames
+*%ARGUMENTS:
+* pkts -- frames to feed to the server
+* sizes -- their lengths
+* n -- how many (at most BATCH)
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Queues the frames for the server, then times serverProcessPacket over
+* each run of frames with the same code.  Sessions killed by PADTs are
+* reaped as part of the PADT time.
+***********************************************************************/
+static void
+runFrames(PPPoEPacket *pkts, int const *sizes, int n)
+{
+    int i, j, k;
+    size_t s;
+    unsigned long a0;
+    double t0;
+
+    sendPackets(NULL, ClientSock, pkts, sizes, n);
+    for (i=0; i<n; i=j) {
+	for (j=i+1; j<n && pkts[j].code == pkts[i].code; j++);
+	s = statFor(pkts[i].code);
+	a0 = Allocs;
+	t0 = nowNs();
+	for (k=i; k<j; k++) {
+	    serverProcessPacket(Server);
+	}
+	if (NumExited) {
+	    raise(SIGCHLD);
+	    __real_Event_HandleEvent(ServerES);
+	}
+	Stats[s].ns += nowNs() - t0;
+	Stats[s].allocs += Allocs - a0;
+	Stats[s].packets += j - i;
+    }
+    drainReplies();
+}
+
+/**********************************************************************
+*%FUNCTION: buildFrame
+*%ARGUMENTS:
+* pkt -- frame to fill in
+* idx -- client sending it
+* code -- discovery code
+*%RETURNS:
+* Length of the frame
+*%DESCRIPTION:
+* Builds what client "idx" would send at this point in discovery.
+***********************************************************************/
+static int
+buildFrame(PPPoEPacket *pkt, int idx, unsigned char code)
+{
+    unsigned char *cursor = pkt->payload;
+    BenchClient *c = &Clients[idx];
+
+    if (code == CODE_PADI) {
+	memset(pkt->ethHdr.h_dest, 0xFF, ETH_ALEN);
+    } else {
+	memcpy(pkt->ethHdr.h_dest, Server->mac, ETH_ALEN);
+    }
+    clientMac(idx, pkt->ethHdr.h_source);
+    pkt->ethHdr.h_proto = htons(Eth_PPPOE_Discovery);
+    pkt->vertype = PPPOE_VER_TYPE(1, 1);
+    pkt->code = code;
+    pkt->session = (code == CODE_PADT) ? c->sess : 0;
+
+    if (code != CODE_PADT) {
+	/* Empty Service-Name */
+	cursor[0] = TAG_SERVICE_NAME >> 8;
+	cursor[1] = TAG_SERVICE_NAME & 0xFF;
+	cursor[2] = cursor[3] = 0;
+	cursor += TAG_HDR_SIZE;
+    }
+    /* Host-Uniq: the client index */
+    cursor[0] = TAG_HOST_UNIQ >> 8;
+    cursor[1] = TAG_HOST_UNIQ & 0xFF;
+    cursor[2] = 0;
+    cursor[3] = sizeof(uint32_t);
+    cursor[4] = (idx >> 24) & 0xFF;
+    cursor[5] = (idx >> 16) & 0xFF;
+    cursor[6] = (idx >> 8) & 0xFF;
+    cursor[7] = idx & 0xFF;
+    cursor += TAG_HDR_SIZE + sizeof(uint32_t);
+    if (code == CODE_PADR) {
+	cursor[0] = TAG_AC_COOKIE >> 8;
+	cursor[1] = TAG_AC_COOKIE & 0xFF;
+	cursor[2] = c->cookieLen >> 8;
+	cursor[3] = c->cookieLen & 0xFF;
+	memcpy(cursor + TAG_HDR_SIZE, c->cookie, c->cookieLen);
+	cursor += TAG_HDR_SIZE + c->cookieLen;
+    }
+    pkt->length = htons(cursor - pkt->payload);
+    return (int) (cursor - pkt->payload) + HDR_SIZE;
+}
+
+/**********************************************************************
+*%FUNCTION: learnSessions
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* PADS is sent by the (stubbed-out) child, so clients learn their
+* session numbers from the server's busy list instead.
+***********************************************************************/
+static void
+learnSessions(void)
+{
+    ClientSession *ses;
+    int idx;
+
+    for (ses = BusySessions; ses; ses = ses->next) {
+	idx = clientIndex(ses->eth);
+	if (idx >= 0) Clients[idx].sess = ses->sess;
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: runSynthetic
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Each round, every client sends a PADI, a PADR with the cookie from
+* its PADO, and finally a PADT for the session it got.
+***********************************************************************/
+static void
+runSynthetic(void)
+{
+    static unsigned char const codes[] = { CODE_PADI, CODE_PADR, CODE_PADT };
+    static PPPoEPacket pkts[BATCH];
+    int sizes[BATCH];
+    int r, p, i, n;
+
+    for (r=0; r<Rounds; r++) {
+	for (p=0; p<3; p++) {
+	    if (codes[p] == CODE_PADT) learnSessions();
+	    n = 0;
+	    for (i=0; i<NumClients; i++) {
+		if (codes[p] == CODE_PADR && !Clients[i].cookieLen) continue;
+		if (codes[p] == CODE_PADT && !Clients[i].sess) continue;
+		sizes[n] = buildFrame(&pkts[n], i, codes[p]);
+		if (++n == BATCH) {
+		    runFrames(pkts, sizes, n);
+		    n = 0;
+		}
+	    }
+	    if (n) runFrames(pkts, sizes, n);
+	}
+	for (i=0; i<NumClients; i++) {
+	    Clients[i].cookieLen = 0;
+	    Clients[i].sess = 0;
+	}
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: runRecorded
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Replays the discovery frames in RecordFile, Rounds times.  Unicast
+* frames are readdressed to the server.  The cookies and session
+* numbers in a recording belong to some other server, so PADRs and
+* PADTs exercise the rejection paths.
+***********************************************************************/
+static void
+runRecorded(void)
+{
+    char spec[IFNAME_MAX+1];
+    PPPoEPacket *frames = NULL;
+    int *sizes = NULL;
+    int n = 0, max = 0, got, r, i, fd;
+
+    snprintf(spec, sizeof(spec), "pcap:%s", RecordFile);
+    fd = openInterface(spec, Eth_PPPOE_Discovery, NULL, NULL);
+    for (;;) {
+	if (n + MAX_RECV_BATCH > max) {
+	    max = max ? max * 2 : 1024;
+	    frames = __real_realloc(frames, max * sizeof(PPPoEPacket));
+	    sizes = __real_realloc(sizes, max * sizeof(int));
+	    if (!frames || !sizes) {
+		rp_fatal("Out of memory");
+	    }
+	}
+	got = receivePackets(fd, frames + n, sizes + n, MAX_RECV_BATCH);
+	if (got <= 0) break;
+	n += got;
+    }
+    closeInterface(fd);
+    if (!n) {
+	rp_fatal("No PPPoE discovery frames in recording");
+    }
+    for (i=0; i<n; i++) {
+	if (!NOT_UNICAST(frames[i].ethHdr.h_dest)) {
+	    memcpy(frames[i].ethHdr.h_dest, Server->mac, ETH_ALEN);
+	}
+    }
+    for (r=0; r<Rounds; r++) {
+	for (i=0; i<n; i+=BATCH) {
+	    runFrames(frames + i, sizes + i, (n - i < BATCH) ? n - i : BATCH);
+	}
+    }
+    free(frames);
+    free(sizes);
+}
+
+/**********************************************************************
+*%FUNCTION: report
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Prints throughput, latency and allocations per discovery code.
+***********************************************************************/
+static void
+report(void)
+{
+    size_t i;
+
+    printf("%-6s %10s %12s %10s %11s\n",
+	   "code", "packets", "packets/s", "ns/packet", "allocs/pkt");
+    for (i=0; i<NUM_STATS; i++) {
+	if (!Stats[i].packets) continue;
+	printf("%-6s %10lu %12.0f %10.1f %11.2f\n",
+	       Stats[i].name, Stats[i].packets,
+	       Stats[i].ns ? Stats[i].packets * 1e9 / Stats[i].ns : 0.0,
+	       Stats[i].ns / Stats[i].packets,
+	       (double) Stats[i].allocs / Stats[i].packets);
+    }
+    printf("sent: %lu PADO, %lu PADS, %lu PADT; %lu sessions started\n",
+	   Replies[CODE_PADO], Replies[CODE_PADS], Replies[CODE_PADT], Forks);
+}
+
+/* The server is set up; run the benchmark instead of its event loop */
+int __wrap_Event_HandleEvent(EventSelector *es)
+{
+    ServerES = es;
+    Server = &interfaces[0];
+    if (RecordFile) {
+	runRecorded();
+    } else {
+	runSynthetic();
+    }
+    report();
+    exit(EXIT_SUCCESS);
+}
+
+static void
+benchUsage(char const *argv0)
+{
+    fprintf(stderr, "Usage: %s [options] [-- pppoe-server options]\n", argv0);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "   -n clients     -- Simulated clients (default 1000)\n");
+    fprintf(stderr, "   -r rounds      -- PADI/PADR/PADT rounds per client (default 20)\n");
+    fprintf(stderr, "   -f file.pcap   -- Replay recorded discovery frames instead\n");
+    fprintf(stderr, "   -h             -- Print usage information\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    char nbuf[16];
+    char *sargv[64];
+    int sargc = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:f:h")) != -1) {
+	switch(opt) {
+	case 'n':
+	    NumClients = atoi(optarg);
+	    if (NumClients <= 0 || NumClients > 65534) {
+		fprintf(stderr, "-n: Value must be between 1 and 65534\n");
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'r':
+	    Rounds = atoi(optarg);
+	    if (Rounds <= 0) {
+		fprintf(stderr, "-r: Value must be positive\n");
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'f':
+	    RecordFile = optarg;
+	    break;
+	case 'h':
+	    benchUsage(argv[0]);
+	    exit(EXIT_SUCCESS);
+	default:
+	    benchUsage(argv[0]);
+	    exit(EXIT_FAILURE);
+	}
+    }
+
+    Clients = calloc(NumClients, sizeof(BenchClient));
+    if (!Clients) {
+	rp_fatal("Out of memory");
+    }
+    ClientSock = openInterface("loop:bench:1", Eth_PPPOE_Discovery, NULL, NULL);
+
+    /* Set up the server as if it had been run by hand */
+    snprintf(nbuf, sizeof(nbuf), "%d", NumClients);
+    sargv[sargc++] = "pppoe-server";
+    sargv[sargc++] = "-F";
+    sargv[sargc++] = "-I";
+    sargv[sargc++] = "loop:bench:0";
+    sargv[sargc++] = "-C";
+    sargv[sargc++] = "bench";
+    sargv[sargc++] = "-L";
+    sargv[sargc++] = "10.0.0.1";
+    sargv[sargc++] = "-R";
+    sargv[sargc++] = "10.64.0.1";
+    sargv[sargc++] = "-N";
+    sargv[sargc++] = nbuf;
+    while (optind < argc && sargc < 63) {
+	sargv[sargc++] = argv[optind++];
+    }
+    sargv[sargc] = NULL;
+    optind = 1;
+    return pppoe_server_main(sargc, sargv);
+}
@@ -424,97 +424,29 @@ parseAddressPool(char const *fname, int install)
 }
 
 /**********************************************************************
-*%FUNCTION: parsePADITags
+*%FUNCTION: getRequestTags
 *%ARGUMENTS:
-* type -- tag type
-* len -- tag length
-* data -- tag data
-* extra -- extra user data.
+* ti -- an indexed PADI or PADR packet
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* Picks interesting tags out of a PADI packet
+* Picks the tags common to PADI and PADR packets out of the index.
 ***********************************************************************/
-void
-parsePADITags(uint16_t type, uint16_t len, unsigned char *data,
-	      void *extra)
+static void
+getRequestTags(TagIndex const *ti)
 {
-    switch(type) {
-    case TAG_PPP_MAX_PAYLOAD:
-	if (len == sizeof(max_ppp_payload)) {
-	    memcpy(&max_ppp_payload, data, sizeof(max_ppp_payload));
-	    max_ppp_payload = ntohs(max_ppp_payload);
-	    if (max_ppp_payload <= ETH_PPPOE_MTU) {
-		max_ppp_payload = 0;
-	    }
-	}
-	break;
-    case TAG_SERVICE_NAME:
-	/* Copy requested service name */
-	requestedService.type = htons(type);
-	requestedService.length = htons(len);
-	memcpy(requestedService.payload, data, len);
-	break;
-    case TAG_RELAY_SESSION_ID:
-	relayId.type = htons(type);
-	relayId.length = htons(len);
-	memcpy(relayId.payload, data, len);
-	break;
-    case TAG_HOST_UNIQ:
-	hostUniq.type = htons(type);
-	hostUniq.length = htons(len);
-	memcpy(hostUniq.payload, data, len);
-	break;
-    }
-}
+    unsigned char *tag;
 
-/**********************************************************************
-*%FUNCTION: parsePADRTags
-*%ARGUMENTS:
-* type -- tag type
-* len -- tag length
-* data -- tag data
-* extra -- extra user data.
-*%RETURNS:
-* Nothing
-*%DESCRIPTION:
-* Picks interesting tags out of a PADR packet
-***********************************************************************/
-void
-parsePADRTags(uint16_t type, uint16_t len, unsigned char *data,
-	      void *extra)
-{
-    switch(type) {
-    case TAG_PPP_MAX_PAYLOAD:
-	if (len == sizeof(max_ppp_payload)) {
-	    memcpy(&max_ppp_payload, data, sizeof(max_ppp_payload));
-	    max_ppp_payload = ntohs(max_ppp_payload);
-	    if (max_ppp_payload <= ETH_PPPOE_MTU) {
-		max_ppp_payload = 0;
-	    }
+    tag = indexTag(ti, TAG_PPP_MAX_PAYLOAD, NULL);
+    if (tag && ((tag[2] << 8) + tag[3]) == sizeof(max_ppp_payload)) {
+	max_ppp_payload = (tag[4] << 8) + tag[5];
+	if (max_ppp_payload <= ETH_PPPOE_MTU) {
+	    max_ppp_payload = 0;
 	}
-	break;
-    case TAG_RELAY_SESSION_ID:
-	relayId.type = htons(type);
-	relayId.length = htons(len);
-	memcpy(relayId.payload, data, len);
-	break;
-    case TAG_HOST_UNIQ:
-	hostUniq.type = htons(type);
-	hostUniq.length = htons(len);
-	memcpy(hostUniq.payload, data, len);
-	break;
-    case TAG_AC_COOKIE:
-	receivedCookie.type = htons(type);
-	receivedCookie.length = htons(len);
-	memcpy(receivedCookie.payload, data, len);
-	break;
-    case TAG_SERVICE_NAME:
-	requestedService.type = htons(type);
-	requestedService.length = htons(len);
-	memcpy(requestedService.payload, data, len);
-	break;
     }
+    indexTag(ti, TAG_SERVICE_NAME, &requestedService);
+    indexTag(ti, TAG_RELAY_SESSION_ID, &relayId);
+    indexTag(ti, TAG_HOST_UNIQ, &hostUniq);
 }
 
 /**********************************************************************
@@ -610,6 +542,7 @@ void
 processPADI(Interface *ethif, PPPoEPacket *packet, int len)
 {
     PPPoEPacket pado;
+    TagIndex ti;
     PPPoETag acname;
     PPPoETag servname;
     PPPoETag cookie;
@@ -666,7 +599,8 @@ processPADI(Interface *ethif, PPPoEPacket *packet, int len)
     requestedService.type = 0;
     max_ppp_payload = 0;
 
-    parsePacket(packet, parsePADITags, NULL);
+    if (indexPacket(packet, &ti) < 0) return;
+    getRequestTags(&ti);
 
     /* If PADI specified non-default service name, and we do not offer
        that service, DO NOT send PADO */
@@ -862,6 +796,7 @@ void
 processPADR(Interface *ethif, PPPoEPacket *packet, int len)
 {
     unsigned char cookieBuffer[COOKIE_LEN];
+    TagIndex ti;
     ClientSession *cliSession;
     pid_t child;
     PPPoEPacket pads;
@@ -908,7 +843,9 @@ processPADR(Interface *ethif, PPPoEPacket *packet, int len)
     }
 
     max_ppp_payload = 0;
-    parsePacket(packet, parsePADRTags, NULL);
+    if (indexPacket(packet, &ti) < 0) return;
+    getRequestTags(&ti);
+    indexTag(&ti, TAG_AC_COOKIE, &receivedCookie);
 
     /* Check that everything's cool */
     if (!receivedCookie.type) {
@@ -1088,7 +1025,7 @@ processPADR(Interface *ethif, PPPoEPacket *packet, int len)
 	    sendHURLorMOTM(&conn, motd_string, TAG_MOTM);
     }
     /* Close sock; don't need it any more */
-    close(sock);
+    closeInterface(sock);
 
     startPPPD(cliSession);
 }
@@ -1157,6 +1094,7 @@ usage(char const *argv0)
     fprintf(stderr, "   -o offset      -- Assign session numbers starting at offset+1.\n");
     fprintf(stderr, "   -f disc:sess   -- Set Ethernet frame types (hex).\n");
     fprintf(stderr, "   -s             -- Use synchronous PPP mode.\n");
+    fprintf(stderr, "   -E             -- Have pppoe answer LCP Echo-Requests itself.\n");
     fprintf(stderr, "   -X pidfile     -- Write PID and lock pidfile.\n");
     fprintf(stderr, "   -q /path/pppd  -- Specify full path to pppd.\n");
     fprintf(stderr, "   -Q /path/pppoe -- Specify full path to pppoe.\n");
@@ -1209,7 +1147,7 @@ main(int argc, char **argv)
     char const *s;
     int cookie_ok = 0;
 
-    char const *options = "X:ix:hI:C:L:R:T:m:FN:f:O:o:skp:lrudPS:q:Q:H:M:U:g:";
+    char const *options = "X:ix:hI:C:L:R:T:m:FN:f:O:o:skp:lrudPS:q:Q:H:M:U:g:E";
 
     if (getuid() != geteuid() ||
 	getgid() != getegid()) {
@@ -1344,6 +1282,13 @@ main(int argc, char **argv)
 	case 'X':
 	    SET_STRING(pidfile, optarg);
 	    break;
+	case 'E':
+	    /* Pass the local LCP echo option on to pppoe */
+	    snprintf(PppoeOptions + strlen(PppoeOptions),
+		     SMALLBUF-strlen(PppoeOptions),
+		     " -E");
+	    break;
+
 	case 's':
 	    Synchronous = 1;
 	    /* Pass the Synchronous option on to pppoe */
@@ -1409,14 +1354,14 @@ main(int argc, char **argv)
 	    }
 	    found = 0;
 	    for (i=0; i<NumInterfaces; i++) {
-		if (!strncmp(interfaces[i].name, optarg, IFNAMSIZ)) {
+		if (!strncmp(interfaces[i].name, optarg, IFNAME_MAX)) {
 		    found = 1;
 		    break;
 		}
 	    }
 	    if (!found) {
 		memset(&interfaces[NumInterfaces], 0, sizeof(*interfaces));
-		strncpy(interfaces[NumInterfaces].name, optarg, IFNAMSIZ);
+		strncpy(interfaces[NumInterfaces].name, optarg, IFNAME_MAX);
 		NumInterfaces++;
 	    }
 	    break;
@@ -1472,6 +1417,17 @@ main(int argc, char **argv)
 	NumInterfaces = 1;
     }
 
+    /* The kernel needs a real device to run sessions on */
+    if (UseLinuxKernelModePPPoE) {
+	for (i=0; i<NumInterfaces; i++) {
+	    if (!interfaceDevice(interfaces[i].name)) {
+		fprintf(stderr, "-k cannot be used with interface %s\n",
+			interfaces[i].name);
+		exit(EXIT_FAILURE);
+	    }
+	}
+    }
+
     if (!ACName) {
 	ACName = malloc(HOSTNAMELEN);
 	if (gethostname(ACName, HOSTNAMELEN) < 0) {
@@ -1932,8 +1888,9 @@ startPPPD(ClientSession *session)
 	argv[c++] = "plugin";
 	argv[c++] = plugin_path;
 
-	/* Add "nic-" to interface name */
-	snprintf(buffer, SMALLBUF, "nic-%s", session->ethif->name);
+	/* Add "nic-" to the device name; the plugin has no backends */
+	snprintf(buffer, SMALLBUF, "nic-%s",
+		 interfaceDevice(session->ethif->name));
 	argv[c++] = strdup(buffer);
 	if (!argv[c-1]) {
 	    exit(EXIT_FAILURE);
@@ -29,7 +29,7 @@
 #define MAX_USERNAME_LEN 31
 /* An Ethernet interface */
 typedef struct {
-    char name[IFNAMSIZ+1];	/* Interface name */
+    char name[IFNAME_MAX+1];	/* Interface name */
     int sock;			/* Socket for discovery frames */
     unsigned char mac[ETH_ALEN]; /* MAC address */
     EventHandler *eh;		/* Event handler for this interface */
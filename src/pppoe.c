@@ -26,6 +26,7 @@
 
 #include <sys/time.h>
 #include <sys/uio.h>
+#include <poll.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
@@ -51,10 +52,40 @@ int optSkipSession       = 0;	/* Perform discovery, print session info
 int optFloodDiscovery    = 0;   /* Flood server with discovery requests.
 				   USED FOR STRESS-TESTING ONLY.  DO NOT
 				   USE THE -F OPTION AGAINST A REAL ISP */
+int optFloodRate         = 0;	/* Flood clients started per second */
+int optFloodHold         = 0;	/* Seconds each flood client holds session */
+int optLocalEcho         = 0;	/* Answer LCP Echo-Requests without pppd */
 
 PPPoEConnection *Connection = NULL; /* Must be global -- used
 				       in signal handler */
 
+/* Maximum number of PPP reads handled per wakeup */
+#define PPP_READ_BATCH 8
+
+/* LCP codes and options needed by the local echo responder */
+#define PPP_LCP            0xC021
+#define LCP_CONF_REQ       1
+#define LCP_CONF_ACK       2
+#define LCP_TERM_REQ       5
+#define LCP_TERM_ACK       6
+#define LCP_ECHO_REQ       9
+#define LCP_ECHO_REPLY     10
+#define LCP_OPT_MAGIC      5
+
+/* Bits in conn->lcpAcks; LCP is open once both are set */
+#define LCP_ACK_SENT       1
+#define LCP_ACK_RCVD       2
+#define LCP_OPENED         (LCP_ACK_SENT | LCP_ACK_RCVD)
+
+static int fdReadable(int fd);
+static void openLinks(PPPoEConnection *conn, int withSession);
+static void lcpSnoop(PPPoEConnection *conn, unsigned char const *payload,
+		     int len, int outgoing);
+
+/* Session frames received in one batch */
+static PPPoEPacket EthBatch[MAX_RECV_BATCH];
+static int EthBatchSizes[MAX_RECV_BATCH];
+
 /***********************************************************************
 *%FUNCTION: sendSessionPacket
 *%ARGUMENTS:
@@ -70,6 +101,9 @@ void
 sendSessionPacket(PPPoEConnection *conn, PPPoEPacket *packet, int len)
 {
     packet->length = htons(len);
+    if (optLocalEcho) {
+	lcpSnoop(conn, packet->payload, len, 1);
+    }
     if (optClampMSS) {
 	clampMSS(packet, "outgoing", optClampMSS);
     }
@@ -90,6 +124,52 @@ sendSessionPacket(PPPoEConnection *conn, PPPoEPacket *packet, int len)
 
 }
 
+/***********************************************************************
+*%FUNCTION: sendSessionPackets
+*%ARGUMENTS:
+* conn -- PPPoE connection
+* pkts -- the packets to send, with Ethernet and PPPoE headers filled in
+* lens -- length of data in each packet
+* n -- number of packets
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Transmits a batch of session packets to the peer with sendPackets.
+***********************************************************************/
+void
+sendSessionPackets(PPPoEConnection *conn, PPPoEPacket *pkts,
+		   int const *lens, int n)
+{
+    int sizes[MAX_SEND_BATCH];
+    int i;
+
+    if (n > MAX_SEND_BATCH) {
+	rp_fatal("sendSessionPackets: batch too large");
+    }
+    for (i=0; i<n; i++) {
+	pkts[i].length = htons(lens[i]);
+	if (optLocalEcho) {
+	    lcpSnoop(conn, pkts[i].payload, lens[i], 1);
+	}
+	if (optClampMSS) {
+	    clampMSS(&pkts[i], "outgoing", optClampMSS);
+	}
+	sizes[i] = lens[i] + HDR_SIZE;
+    }
+    if (sendPackets(conn, conn->sessionSocket, pkts, sizes, n) < 0) {
+	exit(EXIT_FAILURE);
+    }
+#ifdef DEBUGGING_ENABLED
+    if (conn->debugFile) {
+	for (i=0; i<n; i++) {
+	    dumpPacket(conn->debugFile, &pkts[i], "SENT");
+	    fprintf(conn->debugFile, "\n");
+	}
+	fflush(conn->debugFile);
+    }
+#endif
+}
+
 /**********************************************************************
 *%FUNCTION: sessionDiscoveryPacket
 *%ARGUMENTS:
@@ -104,6 +184,7 @@ static void
 sessionDiscoveryPacket(PPPoEConnection *conn)
 {
     PPPoEPacket packet;
+    TagIndex ti;
     int len;
 
     if (receivePacket(conn->discoverySocket, &packet, &len) < 0) {
@@ -150,7 +231,9 @@ sessionDiscoveryPacket(PPPoEConnection *conn)
     syslog(LOG_INFO,
 	   "Session %d terminated -- received PADT from peer",
 	   (int) ntohs(packet.session));
-    parsePacket(&packet, parseLogErrs, NULL);
+    if (indexPacket(&packet, &ti) == 0) {
+	walkTags(&ti, parseLogErrs, NULL);
+    }
     sendPADT(conn, "Received PADT from peer");
     exit(EXIT_SUCCESS);
 }
@@ -167,20 +250,29 @@ sessionDiscoveryPacket(PPPoEConnection *conn)
 void
 session(PPPoEConnection *conn)
 {
-    fd_set readable;
+    struct pollfd fds[3];
+    int nfds;
     PPPoEPacket packet;
-    struct timeval tv;
-    struct timeval *tvp = NULL;
-    int maxFD = 0;
-    int r;
+    int timeout = -1;
+    int r, i;
 
     /* Drop privileges */
     dropPrivs();
 
-    /* Prepare for select() */
-    if (conn->sessionSocket > maxFD)   maxFD = conn->sessionSocket;
-    if (conn->discoverySocket > maxFD) maxFD = conn->discoverySocket;
-    maxFD++;
+    /* Register descriptors once: PPP, session socket, discovery socket */
+    fds[0].fd = 0;		/* ppp packets come from stdin */
+    fds[0].events = POLLIN;
+    fds[1].fd = conn->sessionSocket;
+    fds[1].events = POLLIN;
+    nfds = 2;
+    if (conn->discoverySocket >= 0) {
+	fds[2].fd = conn->discoverySocket;
+	fds[2].events = POLLIN;
+	nfds = 3;
+    }
+    if (optInactivityTimeout > 0) {
+	timeout = optInactivityTimeout * 1000;
+    }
 
     /* Fill in the constant fields of the packet to save time */
     memcpy(packet.ethHdr.h_dest, conn->peerEth, ETH_ALEN);
@@ -190,26 +282,25 @@ session(PPPoEConnection *conn)
     packet.code = CODE_SESS;
     packet.session = conn->session;
 
-    initPPP();
+    initPPP(conn);
 
-    for (;;) {
-	if (optInactivityTimeout > 0) {
-	    tv.tv_sec = optInactivityTimeout;
-	    tv.tv_usec = 0;
-	    tvp = &tv;
-	}
-	FD_ZERO(&readable);
-	FD_SET(0, &readable);     /* ppp packets come from stdin */
-	if (conn->discoverySocket >= 0) {
-	    FD_SET(conn->discoverySocket, &readable);
+    /* The async framing buffer holds a full batch of the largest frames
+       the session can carry.  It is allocated once, here. */
+    if (!conn->synchronous) {
+	conn->frameBufSize = MAX_RECV_BATCH * ASYNC_FRAME_LEN(conn->maxPayload);
+	conn->frameBuf = malloc(conn->frameBufSize);
+	if (!conn->frameBuf) {
+	    rp_fatal("Out of memory allocating PPP frame buffer");
 	}
-	FD_SET(conn->sessionSocket, &readable);
+    }
+
+    for (;;) {
 	while(1) {
-	    r = select(maxFD, &readable, NULL, NULL, tvp);
+	    r = poll(fds, nfds, timeout);
 	    if (r >= 0 || errno != EINTR) break;
 	}
 	if (r < 0) {
-	    fatalSys("select (session)");
+	    fatalSys("poll (session)");
 	}
 	if (r == 0) { /* Inactivity timeout */
 	    syslog(LOG_ERR, "Inactivity timeout... something wicked happened on session %d",
@@ -218,30 +309,55 @@ session(PPPoEConnection *conn)
 	    exit(EXIT_FAILURE);
 	}
 
-	/* Handle ready sockets */
-	if (FD_ISSET(0, &readable)) {
+	/* Handle ready descriptors.  Each is drained in a bounded batch so
+	   a busy session costs a few system calls per wakeup, not per
+	   frame.  In synchronous mode only one frame is read per wakeup:
+	   N_HDLC can report descriptor 0 readable after a poll timeout
+	   when it is not (see main), so polling again would be unsafe. */
+	if (fds[0].revents) {
 	    if (conn->synchronous) {
 		syncReadFromPPP(conn, &packet);
 	    } else {
-		asyncReadFromPPP(conn, &packet);
+		for (i=0; i<PPP_READ_BATCH; i++) {
+		    if (asyncReadFromPPP(conn, &packet) < READ_CHUNK) {
+			/* Short read: pppd has nothing more for us yet */
+			break;
+		    }
+		    if (!fdReadable(0)) break;
+		}
 	    }
 	}
 
-	if (FD_ISSET(conn->sessionSocket, &readable)) {
+	if (fds[1].revents) {
             if (conn->synchronous) {
                 syncReadFromEth(conn, conn->sessionSocket, optClampMSS);
             } else {
                 asyncReadFromEth(conn, conn->sessionSocket, optClampMSS);
             }
         }
-        if (conn->discoverySocket >= 0) {
-            if (FD_ISSET(conn->discoverySocket, &readable)) {
-                sessionDiscoveryPacket(conn);
-            }
-        }
+	if (nfds > 2 && fds[2].revents) {
+	    sessionDiscoveryPacket(conn);
+	}
     }
 }
 
+/***********************************************************************
+*%FUNCTION: fdReadable
+*%ARGUMENTS:
+* fd -- a descriptor
+*%RETURNS:
+* Non-zero if "fd" can be read without blocking
+***********************************************************************/
+static int
+fdReadable(int fd)
+{
+    struct pollfd p;
+
+    p.fd = fd;
+    p.events = POLLIN;
+    p.revents = 0;
+    return poll(&p, 1, 0) > 0 && p.revents;
+}
 
 /***********************************************************************
 *%FUNCTION: sigPADT
@@ -276,7 +392,8 @@ usage(char const *argv0)
 {
     fprintf(stderr, "Usage: %s [options]\n", argv0);
     fprintf(stderr, "Options:\n");
-    fprintf(stderr, "   -I if_name     -- Specify interface (default %s.)\n",
+    fprintf(stderr, "   -I if_name     -- Specify interface (default %s.)  Give more than once\n"
+	    "                     to discover on several uplinks at once.\n",
 	    DEFAULT_IF);
 #ifdef DEBUGGING_ENABLED
     fprintf(stderr, "   -D filename    -- Log debugging information in filename.\n");
@@ -284,6 +401,8 @@ usage(char const *argv0)
     fprintf(stderr,
 	    "   -T timeout     -- Specify inactivity timeout in seconds.\n"
 	    "   -t timeout     -- Initial timeout for discovery packets in seconds\n"
+	    "   -R f,m,j,n     -- Discovery retries: first and max wait (ms), jitter (%%),\n"
+	    "                     attempts.  Default %d,%d,%d,%d.\n"
 	    "   -V             -- Print version and exit.\n"
 	    "   -A             -- Print access concentrator names and exit.\n"
 	    "   -S name        -- Set desired service name.\n"
@@ -292,7 +411,10 @@ usage(char const *argv0)
 	    "   -W value       -- Use Host-Unique set to 'value' specifically.\n"
 	    "   -s             -- Use synchronous PPP encapsulation.\n"
 	    "   -m MSS         -- Clamp incoming and outgoing MSS options.\n"
+	    "   -E             -- Answer LCP Echo-Requests without waking pppd.\n"
 	    "   -p pidfile     -- Write process-ID to pidfile.\n"
+	    "   -c cachefile   -- Remember the session in cachefile; resume it on restart.\n"
+	    "   -w ms[:vendor] -- Collect PADOs for ms; pick the least-loaded, quickest AC.\n"
 	    "   -e sess:mac    -- Skip discovery phase; use existing session.\n"
 	    "   -n             -- Do not open discovery socket.\n"
 	    "   -k             -- Kill a session with PADT (requires -e)\n"
@@ -304,7 +426,8 @@ usage(char const *argv0)
 	    "RP-PPPoE comes with ABSOLUTELY NO WARRANTY.\n"
 	    "This is free software, and you are welcome to redistribute it under the terms\n"
 	    "of the GNU General Public License, version 2 or any later version.\n"
-	    "https://dianne.skoll.ca/projects/rp-pppoe/\n", RP_VERSION, (int) strlen(RP_VERSION), "");
+	    "https://dianne.skoll.ca/projects/rp-pppoe/\n",
+	    RETRY_FIRST_MS, RETRY_MAX_MS, RETRY_JITTER_PCT, RETRY_ATTEMPTS, RP_VERSION, (int) strlen(RP_VERSION), "");
     exit(EXIT_SUCCESS);
 }
 
@@ -326,6 +449,7 @@ main(int argc, char *argv[])
     unsigned int s;		/* Temporary to hold session */
     FILE *pidfile;
     unsigned int discoveryType, sessionType;
+    uint16_t mtu = 0;
     char const *options;
 
     PPPoEConnection conn;
@@ -344,7 +468,8 @@ main(int argc, char *argv[])
     memset(&conn, 0, sizeof(conn));
     conn.discoverySocket = -1;
     conn.sessionSocket = -1;
-    conn.discoveryTimeout = PADI_TIMEOUT;
+    conn.maxPayload = MAX_PPPOE_PAYLOAD;
+    retryDefaults(&conn.retry);
 
     /* For signal handler */
     Connection = &conn;
@@ -353,24 +478,36 @@ main(int argc, char *argv[])
     openlog("pppoe", LOG_PID, LOG_DAEMON);
 
 #ifdef DEBUGGING_ENABLED
-    options = "I:VAT:D:hS:C:UW:sm:np:e:kdf:F:t:";
+    options = "I:VAT:D:hS:C:UW:sm:np:e:kdf:F:t:R:c:w:E";
 #else
-    options = "I:VAT:hS:C:UW:sm:np:e:kdf:F:t:";
+    options = "I:VAT:hS:C:UW:sm:np:e:kdf:F:t:R:c:w:E";
 #endif
     while((opt = getopt(argc, argv, options)) != -1) {
 	switch(opt) {
 	case 't':
-	    if (sscanf(optarg, "%d", &conn.discoveryTimeout) != 1) {
+	    if (sscanf(optarg, "%d", &n) != 1) {
 		fprintf(stderr, "Illegal argument to -t: Should be -t timeout\n");
 		exit(EXIT_FAILURE);
 	    }
-	    if (conn.discoveryTimeout < 1) {
-		conn.discoveryTimeout = 1;
+	    retryLegacy(&conn.retry, n);
+	    break;
+	case 'R':
+	    if (parseRetrySchedule(&conn.retry, optarg) < 0) {
+		fprintf(stderr, "Illegal argument to -R: Should be -R first[,max[,jitter[,attempts]]]\n");
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'w':
+	    if (parsePadoWindow(&conn, optarg) < 0) {
+		fprintf(stderr, "Illegal argument to -w: Should be -w ms[:vendor]\n");
+		exit(EXIT_FAILURE);
 	    }
 	    break;
 	case 'F':
-	    if (sscanf(optarg, "%d", &optFloodDiscovery) != 1) {
-		fprintf(stderr, "Illegal argument to -F: Should be -F numFloods\n");
+	    n = sscanf(optarg, "%d:%d:%d", &optFloodDiscovery,
+		       &optFloodRate, &optFloodHold);
+	    if (n < 1 || optFloodRate < 0 || optFloodHold < 0) {
+		fprintf(stderr, "Illegal argument to -F: Should be -F clients[:rate[:hold]]\n");
 		exit(EXIT_FAILURE);
 	    }
 	    if (optFloodDiscovery < 1) optFloodDiscovery = 1;
@@ -433,6 +570,9 @@ main(int argc, char *argv[])
 	    }
 	    switchToEffectiveID();
 	    break;
+	case 'c':
+	    SET_STRING(conn.resumeFile, optarg);
+	    break;
 	case 'S':
 	    SET_STRING(conn.serviceName, optarg);
 	    break;
@@ -478,6 +618,8 @@ main(int argc, char *argv[])
 	    }
 	    fprintf(conn.debugFile, "rp-pppoe-%s\n", RP_VERSION);
 	    fflush(conn.debugFile);
+	    /* Be strict about TCP checksums when debugging */
+	    ClampMSSVerify = 1;
 	    break;
 #endif
 	case 'T':
@@ -497,8 +639,19 @@ main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	    }
 	    break;
+	case 'E':
+	    optLocalEcho = 1;
+	    break;
 	case 'I':
-	    SET_STRING(conn.ifName, optarg);
+	    if (conn.numLinks >= MAX_LINKS) {
+		fprintf(stderr, "-I: At most %d interfaces may be given\n", MAX_LINKS);
+		exit(EXIT_FAILURE);
+	    }
+	    SET_STRING(conn.links[conn.numLinks].ifName, optarg);
+	    conn.numLinks++;
+	    if (conn.numLinks == 1) {
+		SET_STRING(conn.ifName, optarg);
+	    }
 	    break;
 	case 'V':
 	    printf("RP-PPPoE Version %s\n", RP_VERSION);
@@ -518,6 +671,10 @@ main(int argc, char *argv[])
     if (!conn.ifName) {
 	SET_STRING(conn.ifName, DEFAULT_IF);
     }
+    if (conn.numLinks > 1 && (conn.skipDiscovery || optFloodDiscovery)) {
+	fprintf(stderr, "-e and -F work on a single interface; give -I only once\n");
+	exit(EXIT_FAILURE);
+    }
 
     if (!conn.printACNames) {
 
@@ -546,35 +703,35 @@ main(int argc, char *argv[])
     }
 
     if (optFloodDiscovery) {
-	for (n=0; n < optFloodDiscovery; n++) {
-	    if (conn.printACNames) {
-		fprintf(stderr, "Sending discovery flood %d\n", n+1);
-	    }
-            conn.discoverySocket =
-	        openInterface(conn.ifName, Eth_PPPOE_Discovery, conn.myEth, NULL);
-	    discovery(&conn);
-	    conn.discoveryState = STATE_SENT_PADI;
-	    close(conn.discoverySocket);
-	}
-	exit(EXIT_SUCCESS);
-    }
-
-    /* Open session socket before discovery phase, to avoid losing session */
-    /* packets sent by peer just after PADS packet (noted on some Cisco    */
-    /* server equipment).                                                  */
-    /* Opening this socket just before waitForPADS in the discovery()      */
-    /* function would be more appropriate, but it would mess-up the code   */
-    if (!optSkipSession) {
-        conn.sessionSocket = openInterface(conn.ifName, Eth_PPPOE_Session, conn.myEth, NULL);
+	floodDiscovery(&conn, optFloodDiscovery, optFloodRate, optFloodHold);
     }
 
-    /* Skip discovery and don't open discovery socket? */
-    if (conn.skipDiscovery && conn.noDiscoverySocket) {
-	conn.discoveryState = STATE_SESSION;
+    if (conn.numLinks > 1) {
+	/* Several uplinks: open them all and let discovery pick one */
+	openLinks(&conn, !optSkipSession);
+	discovery(&conn);
     } else {
-        conn.discoverySocket =
-	    openInterface(conn.ifName, Eth_PPPOE_Discovery, conn.myEth, NULL);
-        discovery(&conn);
+	/* Open session socket before discovery phase, to avoid losing session */
+	/* packets sent by peer just after PADS packet (noted on some Cisco    */
+	/* server equipment).                                                  */
+	/* Opening this socket just before waitForPADS in the discovery()      */
+	/* function would be more appropriate, but it would mess-up the code   */
+	if (!optSkipSession) {
+	    conn.sessionSocket = openInterface(conn.ifName, Eth_PPPOE_Session, conn.myEth, &mtu);
+	    /* Baby-giant (RFC 4638) sessions are limited by the Ethernet MTU */
+	    if (mtu > PPPOE_OVERHEAD && mtu - PPPOE_OVERHEAD < conn.maxPayload) {
+		conn.maxPayload = mtu - PPPOE_OVERHEAD;
+	    }
+	}
+
+	/* Skip discovery and don't open discovery socket? */
+	if (conn.skipDiscovery && conn.noDiscoverySocket) {
+	    conn.discoveryState = STATE_SESSION;
+	} else {
+	    conn.discoverySocket =
+		openInterface(conn.ifName, Eth_PPPOE_Discovery, conn.myEth, NULL);
+	    discovery(&conn);
+	}
     }
     if (optSkipSession) {
 	printf("%u:%02x:%02x:%02x:%02x:%02x:%02x\n",
@@ -596,6 +753,42 @@ main(int argc, char *argv[])
     return 0;
 }
 
+/**********************************************************************
+*%FUNCTION: openLinks
+*%ARGUMENTS:
+* conn -- PPPoE connection with conn->numLinks interfaces named
+* withSession -- if true, open session sockets too
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Opens sockets on every uplink, before discovery for the same reason as
+* the single-interface case, and makes the first one current.  The
+* maximum payload is limited by the smallest MTU among them.
+***********************************************************************/
+static void
+openLinks(PPPoEConnection *conn, int withSession)
+{
+    uint16_t mtu;
+    int i;
+
+    for (i=0; i<conn->numLinks; i++) {
+	DiscoveryLink *dl = &conn->links[i];
+	dl->sessionSocket = -1;
+	if (withSession) {
+	    mtu = 0;
+	    dl->sessionSocket = openInterface(dl->ifName, Eth_PPPOE_Session,
+					      dl->myEth, &mtu);
+	    if (mtu > PPPOE_OVERHEAD && mtu - PPPOE_OVERHEAD < conn->maxPayload) {
+		conn->maxPayload = mtu - PPPOE_OVERHEAD;
+	    }
+	}
+	dl->discoverySocket = openInterface(dl->ifName, Eth_PPPOE_Discovery,
+					    dl->myEth, NULL);
+    }
+    free(conn->ifName);
+    useLink(conn, 0);
+}
+
 /**********************************************************************
 *%FUNCTION: fatalSys
 *%ARGUMENTS:
@@ -649,122 +842,217 @@ rp_fatal(char const *str)
 }
 
 /**********************************************************************
-*%FUNCTION: asyncReadFromEth
+*%FUNCTION: lcpSnoop
 *%ARGUMENTS:
 * conn -- PPPoE connection info
-* sock -- Ethernet socket
-* clampMss -- if non-zero, do MSS-clamping
+* payload -- PPP frame (protocol field onwards)
+* len -- length of frame
+* outgoing -- non-zero if pppd sent the frame, zero if the peer did
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* Reads a packet from the Ethernet interface and sends it to async PPP
-* device.
+* Follows LCP negotiation for the local echo responder.  LCP is taken to
+* be open once each side has sent a Configure-Ack, and the magic number
+* is taken from the Configure-Ack the peer sends for pppd's request.  Any
+* Configure-Request or Terminate-Request/Ack means LCP is (re)starting,
+* and echo requests go to pppd until it is open again.
 ***********************************************************************/
-void
-asyncReadFromEth(PPPoEConnection *conn, int sock, int clampMss)
+static void
+lcpSnoop(PPPoEConnection *conn, unsigned char const *payload, int len,
+	 int outgoing)
 {
-    PPPoEPacket packet;
-    int len;
-    int plen;
-    int i;
-    unsigned char pppBuf[4096];
-    unsigned char *ptr = pppBuf;
-    unsigned char c;
-    uint16_t fcs;
-    unsigned char header[2] = {FRAME_ADDR, FRAME_CTRL};
-    unsigned char tail[2];
+    unsigned char const *opt;
+    int lcpLen;
+
+    if (len < 6 || ((payload[0] << 8) | payload[1]) != PPP_LCP) return;
+    lcpLen = (payload[4] << 8) | payload[5];
+    if (lcpLen < 4 || lcpLen > len - 2) return;
+
+    switch(payload[2]) {
+    case LCP_CONF_REQ:
+    case LCP_TERM_REQ:
+    case LCP_TERM_ACK:
+	conn->lcpAcks = 0;
+	break;
+    case LCP_CONF_ACK:
+	if (outgoing) {
+	    conn->lcpAcks |= LCP_ACK_SENT;
+	    break;
+	}
+	conn->lcpAcks |= LCP_ACK_RCVD;
+	conn->lcpMagic = 0;
+	for (opt = payload + 6; opt + 2 <= payload + 2 + lcpLen; opt += opt[1]) {
+	    if (opt[1] < 2 || opt + opt[1] > payload + 2 + lcpLen) break;
+	    if (opt[0] == LCP_OPT_MAGIC && opt[1] == 6) {
+		memcpy(&conn->lcpMagic, opt + 2, 4);
+	    }
+	}
+	break;
+    }
+}
 
-    if (receivePacket(sock, &packet, &len) < 0) {
-	return;
+/**********************************************************************
+*%FUNCTION: lcpLocalEcho
+*%ARGUMENTS:
+* conn -- PPPoE connection info
+* packet -- a session frame received from the peer
+* plen -- PPP payload length
+*%RETURNS:
+* 1 if the frame was an LCP Echo-Request and has been answered; 0 if it
+* should be passed to pppd
+*%DESCRIPTION:
+* Implements the -E option.  Answers the peer's LCP Echo-Requests
+* directly, so that keepalives do not wake pppd.  The reply is built in
+* place in "packet".  Requests carrying our own magic number (a looped-
+* back link) and anything seen while LCP is not open go to pppd.
+***********************************************************************/
+static int
+lcpLocalEcho(PPPoEConnection *conn, PPPoEPacket *packet, int plen)
+{
+    unsigned char *lcp = packet->payload;
+    int lcpLen;
+
+    lcpSnoop(conn, lcp, plen, 0);
+    if (plen < 10 || ((lcp[0] << 8) | lcp[1]) != PPP_LCP ||
+	lcp[2] != LCP_ECHO_REQ || conn->lcpAcks != LCP_OPENED) {
+	return 0;
     }
+    lcpLen = (lcp[4] << 8) | lcp[5];
+    if (lcpLen < 8 || lcpLen > plen - 2) return 0;
+    if (conn->lcpMagic && !memcmp(lcp + 6, &conn->lcpMagic, 4)) return 0;
+
+    lcp[2] = LCP_ECHO_REPLY;
+    memcpy(lcp + 6, &conn->lcpMagic, 4);
+    memcpy(packet->ethHdr.h_dest, conn->peerEth, ETH_ALEN);
+    memcpy(packet->ethHdr.h_source, conn->myEth, ETH_ALEN);
+    sendSessionPacket(conn, packet, lcpLen + 2);
+    return 1;
+}
+
+/**********************************************************************
+*%FUNCTION: checkSessionFrame
+*%ARGUMENTS:
+* conn -- PPPoE connection info
+* packet -- a received session frame
+* len -- length of frame
+*%RETURNS:
+* The PPP payload length, or -1 if the frame should be dropped
+*%DESCRIPTION:
+* Validates a frame from the session socket and checks that it belongs
+* to our session.
+***********************************************************************/
+static int
+checkSessionFrame(PPPoEConnection *conn, PPPoEPacket *packet, int len)
+{
+    int plen;
 
     /* Check length */
-    if (ntohs(packet.length) + HDR_SIZE > len) {
+    if (ntohs(packet->length) + HDR_SIZE > len) {
 	syslog(LOG_ERR, "Bogus PPPoE length field (%u)",
-	       (unsigned int) ntohs(packet.length));
-	return;
+	       (unsigned int) ntohs(packet->length));
+	return -1;
     }
 #ifdef DEBUGGING_ENABLED
     if (conn->debugFile) {
-	dumpPacket(conn->debugFile, &packet, "RCVD");
+	dumpPacket(conn->debugFile, packet, "RCVD");
 	fprintf(conn->debugFile, "\n");
 	fflush(conn->debugFile);
     }
 #endif
 
     /* Sanity check */
-    if (packet.code != CODE_SESS) {
-	syslog(LOG_ERR, "Unexpected packet code %d", (int) packet.code);
-	return;
+    if (packet->code != CODE_SESS) {
+	syslog(LOG_ERR, "Unexpected packet code %d", (int) packet->code);
+	return -1;
     }
-    if (PPPOE_VER(packet.vertype) != 1) {
-	syslog(LOG_ERR, "Unexpected packet version %d", PPPOE_VER(packet.vertype));
-	return;
+    if (PPPOE_VER(packet->vertype) != 1) {
+	syslog(LOG_ERR, "Unexpected packet version %d", PPPOE_VER(packet->vertype));
+	return -1;
     }
-    if (PPPOE_TYPE(packet.vertype) != 1) {
-	syslog(LOG_ERR, "Unexpected packet type %d", PPPOE_TYPE(packet.vertype));
-	return;
+    if (PPPOE_TYPE(packet->vertype) != 1) {
+	syslog(LOG_ERR, "Unexpected packet type %d", PPPOE_TYPE(packet->vertype));
+	return -1;
     }
-    if (memcmp(packet.ethHdr.h_dest, conn->myEth, ETH_ALEN)) {
-	return;
+    if (memcmp(packet->ethHdr.h_dest, conn->myEth, ETH_ALEN)) {
+	return -1;
     }
-    if (memcmp(packet.ethHdr.h_source, conn->peerEth, ETH_ALEN)) {
+    if (memcmp(packet->ethHdr.h_source, conn->peerEth, ETH_ALEN)) {
 	/* Not for us -- must be another session.  This is not an error,
 	   so don't log anything.  */
-	return;
+	return -1;
     }
 
-    if (packet.session != conn->session) {
+    if (packet->session != conn->session) {
 	/* Not for us -- must be another session.  This is not an error,
 	   so don't log anything.  */
-	return;
+	return -1;
     }
-    plen = ntohs(packet.length);
+    plen = ntohs(packet->length);
     if (plen + HDR_SIZE > len) {
 	syslog(LOG_ERR, "Bogus length field in session packet %d (%d)",
 	       (int) plen, (int) len);
-	return;
-    }
-
-    /* Clamp MSS */
-    if (clampMss) {
-	clampMSS(&packet, "incoming", clampMss);
+	return -1;
     }
+    return plen;
+}
 
-    /* Compute FCS */
-    fcs = pppFCS16(PPPINITFCS16, header, 2);
-    fcs = pppFCS16(fcs, packet.payload, plen) ^ 0xffff;
-    tail[0] = fcs & 0x00ff;
-    tail[1] = (fcs >> 8) & 0x00ff;
-
-    /* Build a buffer to send to PPP */
-    *ptr++ = FRAME_FLAG;
-    *ptr++ = FRAME_ADDR;
-    *ptr++ = FRAME_ESC;
-    *ptr++ = FRAME_CTRL ^ FRAME_ENC;
+/**********************************************************************
+*%FUNCTION: asyncReadFromEth
+*%ARGUMENTS:
+* conn -- PPPoE connection info
+* sock -- Ethernet socket
+* clampMss -- if non-zero, do MSS-clamping
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Reads a batch of packets from the Ethernet interface and sends them to
+* the async PPP device with a single write.
+***********************************************************************/
+void
+asyncReadFromEth(PPPoEConnection *conn, int sock, int clampMss)
+{
+    PPPoEPacket *packet;
+    unsigned char *ptr = conn->frameBuf;
+    int n, i, plen;
+    uint16_t fcs;
+    unsigned char header[2] = {FRAME_ADDR, FRAME_CTRL};
+    unsigned char tail[2];
 
-    for (i=0; i<plen; i++) {
-	c = packet.payload[i];
-	if (c == FRAME_FLAG || c == FRAME_ADDR || c == FRAME_ESC || c < 0x20) {
-	    *ptr++ = FRAME_ESC;
-	    *ptr++ = c ^ FRAME_ENC;
-	} else {
-	    *ptr++ = c;
+    n = receivePackets(sock, EthBatch, EthBatchSizes, MAX_RECV_BATCH);
+    for (i=0; i<n; i++) {
+	packet = &EthBatch[i];
+	plen = checkSessionFrame(conn, packet, EthBatchSizes[i]);
+	if (plen < 0) continue;
+	if (plen > conn->maxPayload) {
+	    syslog(LOG_ERR, "Session packet too big (%d > %d bytes)",
+		   plen, conn->maxPayload);
+	    continue;
 	}
-    }
-    for (i=0; i<2; i++) {
-	c = tail[i];
-	if (c == FRAME_FLAG || c == FRAME_ADDR || c == FRAME_ESC || c < 0x20) {
-	    *ptr++ = FRAME_ESC;
-	    *ptr++ = c ^ FRAME_ENC;
-	} else {
-	    *ptr++ = c;
+	if (optLocalEcho && lcpLocalEcho(conn, packet, plen)) continue;
+
+	/* Clamp MSS */
+	if (clampMss) {
+	    clampMSS(packet, "incoming", clampMss);
 	}
+
+	/* Append the frame to the buffer for PPP */
+	fcs = pppFCS16(PPPINITFCS16, header, 2);
+	*ptr++ = FRAME_FLAG;
+	*ptr++ = FRAME_ADDR;
+	*ptr++ = FRAME_ESC;
+	*ptr++ = FRAME_CTRL ^ FRAME_ENC;
+	ptr += pppAsyncEncode(ptr, packet->payload, plen, &fcs);
+
+	fcs ^= 0xffff;
+	tail[0] = fcs & 0x00ff;
+	tail[1] = (fcs >> 8) & 0x00ff;
+	ptr += pppAsyncEncode(ptr, tail, 2, &fcs);
+	*ptr++ = FRAME_FLAG;
     }
-    *ptr++ = FRAME_FLAG;
 
     /* Ship it out */
-    if (write(1, pppBuf, (ptr-pppBuf)) < 0) {
+    if (ptr > conn->frameBuf &&
+	write(1, conn->frameBuf, (ptr - conn->frameBuf)) < 0) {
 	fatalSys("asyncReadFromEth: write");
     }
 }
@@ -778,85 +1066,40 @@ asyncReadFromEth(PPPoEConnection *conn, int sock, int clampMss)
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* Reads a packet from the Ethernet interface and sends it to sync PPP
-* device.
+* Reads a batch of packets from the Ethernet interface and sends them to
+* the sync PPP device, one write per frame.
 ***********************************************************************/
 void
 syncReadFromEth(PPPoEConnection *conn, int sock, int clampMss)
 {
-    PPPoEPacket packet;
-    int len;
-    int plen;
+    PPPoEPacket *packet;
+    int n, i, plen;
     struct iovec vec[2];
     unsigned char dummy[2];
 
-    if (receivePacket(sock, &packet, &len) < 0) {
-	return;
-    }
-
-    /* Check length */
-    if (ntohs(packet.length) + HDR_SIZE > len) {
-	syslog(LOG_ERR, "Bogus PPPoE length field (%u)",
-	       (unsigned int) ntohs(packet.length));
-	return;
-    }
-#ifdef DEBUGGING_ENABLED
-    if (conn->debugFile) {
-	dumpPacket(conn->debugFile, &packet, "RCVD");
-	fprintf(conn->debugFile, "\n");
-	fflush(conn->debugFile);
-    }
-#endif
-
-    /* Sanity check */
-    if (packet.code != CODE_SESS) {
-	syslog(LOG_ERR, "Unexpected packet code %d", (int) packet.code);
-	return;
-    }
-    if (PPPOE_VER(packet.vertype) != 1) {
-	syslog(LOG_ERR, "Unexpected packet version %d", PPPOE_VER(packet.vertype));
-	return;
-    }
-    if (PPPOE_TYPE(packet.vertype) != 1) {
-	syslog(LOG_ERR, "Unexpected packet type %d", PPPOE_TYPE(packet.vertype));
-	return;
-    }
-    if (memcmp(packet.ethHdr.h_dest, conn->myEth, ETH_ALEN)) {
-	/* Not for us -- must be another session.  This is not an error,
-	   so don't log anything.  */
-	return;
-    }
-    if (memcmp(packet.ethHdr.h_source, conn->peerEth, ETH_ALEN)) {
-	/* Not for us -- must be another session.  This is not an error,
-	   so don't log anything.  */
-	return;
-    }
-    if (packet.session != conn->session) {
-	/* Not for us -- must be another session.  This is not an error,
-	   so don't log anything.  */
-	return;
-    }
-    plen = ntohs(packet.length);
-    if (plen + HDR_SIZE > len) {
-	syslog(LOG_ERR, "Bogus length field in session packet %d (%d)",
-	       (int) plen, (int) len);
-	return;
-    }
-
-    /* Clamp MSS */
-    if (clampMss) {
-	clampMSS(&packet, "incoming", clampMss);
-    }
-
-    /* Ship it out */
-    vec[0].iov_base = (void *) dummy;
     dummy[0] = FRAME_ADDR;
     dummy[1] = FRAME_CTRL;
+    vec[0].iov_base = (void *) dummy;
     vec[0].iov_len = 2;
-    vec[1].iov_base = (void *) packet.payload;
-    vec[1].iov_len = plen;
 
-    if (writev(1, vec, 2) < 0) {
-	fatalSys("syncReadFromEth: write");
+    n = receivePackets(sock, EthBatch, EthBatchSizes, MAX_RECV_BATCH);
+    for (i=0; i<n; i++) {
+	packet = &EthBatch[i];
+	plen = checkSessionFrame(conn, packet, EthBatchSizes[i]);
+	if (plen < 0) continue;
+	if (optLocalEcho && lcpLocalEcho(conn, packet, plen)) continue;
+
+	/* Clamp MSS */
+	if (clampMss) {
+	    clampMSS(packet, "incoming", clampMss);
+	}
+
+	/* Ship it out */
+	vec[1].iov_base = (void *) packet->payload;
+	vec[1].iov_len = plen;
+
+	if (writev(1, vec, 2) < 0) {
+	    fatalSys("syncReadFromEth: write");
+	}
     }
 }
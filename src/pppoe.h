@@ -19,6 +19,7 @@
 #include "config.h"
 
 extern int IsSetID;
+extern int ClampMSSVerify;
 
 #define _POSIX_SOURCE 1 /* For sigaction defines */
 
@@ -82,11 +83,15 @@ extern void dropPrivs(void);
 #define STATE_SESSION       3
 #define STATE_TERMINATED    4
 
-/* How many PADI/PADS attempts? */
+/* How many PADI/PADS attempts with the legacy -t schedule? */
 #define MAX_PADI_ATTEMPTS 3
 
-/* Initial timeout for PADO/PADS */
-#define PADI_TIMEOUT 5
+/* Default discovery retry schedule: a fast first retry, then doubling
+   waits up to a cap, for about the same total as the old 5/10/20s */
+#define RETRY_FIRST_MS   1000
+#define RETRY_MAX_MS     8000
+#define RETRY_JITTER_PCT 20
+#define RETRY_ATTEMPTS   6
 
 /* States for scanning PPP frames */
 #define STATE_WAITFOR_FRAME_ADDR 0
@@ -143,7 +148,22 @@ typedef struct PPPoETagStruct {
 #define TAG_HDR_SIZE 4
 
 /* Chunk to read from stdin */
-#define READ_CHUNK 4096
+#define READ_CHUNK 16384
+
+/* Most frames fetched from a socket with one receivePackets call */
+#define MAX_RECV_BATCH 32
+
+/* Longest async PPP frame holding "plen" payload bytes: every payload
+   and FCS byte escaped, the escaped address/control header and two
+   flags */
+#define ASYNC_FRAME_LEN(plen) (2 * ((plen) + 2) + 5)
+
+/* Most frames handed to one sendPackets call */
+#define MAX_SEND_BATCH 16
+
+/* Longest interface name we keep, allowing for a backend prefix such
+   as "pcap:in.pcap,out.pcap" */
+#define IFNAME_MAX 127
 
 /* Function passed to parsePacket */
 typedef void ParseFunc(uint16_t type,
@@ -151,11 +171,68 @@ typedef void ParseFunc(uint16_t type,
 		       unsigned char *data,
 		       void *extra);
 
+/* Most tags listed in a TagIndex.  Packets with more are still
+   validated and walked; lookups of known types stay O(1) */
+#define MAX_INDEXED_TAGS 32
+
+/* Slots in TagIndex.first: 0x0100-0x012F, then 0x0200-0x020F */
+#define TAG_INDEX_SLOTS 0x40
+
+/* One tag of an indexed discovery packet */
+typedef struct TagIndexEntryStruct {
+    uint16_t type;		/* Tag type */
+    uint16_t offset;		/* Offset of the tag header in the payload */
+    uint16_t length;		/* Length of the tag data */
+} TagIndexEntry;
+
+/* A discovery packet validated once by indexPacket */
+typedef struct TagIndexStruct {
+    PPPoEPacket *packet;	/* Packet the offsets refer to */
+    int numTags;		/* Entries used in tags */
+    uint16_t rest;		/* Offset of the first tag not in tags */
+    uint16_t end;		/* Offset just past the last tag */
+    TagIndexEntry tags[MAX_INDEXED_TAGS];
+    uint16_t first[TAG_INDEX_SLOTS]; /* 1 + offset of the first tag of
+					each known type; 0 if absent */
+} TagIndex;
+
 #define PPPINITFCS16    0xffff  /* Initial FCS value */
+#define PPPGOODFCS16    0xf0b8  /* Good final FCS value */
 
 /* Keep track of the state of a connection -- collect everything in
    one spot */
 
+/* Async PPP decoder state, carried between reads */
+typedef struct PPPDecoderStruct {
+    int state;			/* STATE_WAITFOR_FRAME_ADDR etc. */
+    int packetSize;		/* Payload bytes decoded so far */
+    unsigned char xorValue;	/* FRAME_ENC if last byte was FRAME_ESC */
+    unsigned char frame[ETH_JUMBO_LEN]; /* Partial frame, packetSize bytes */
+} PPPDecoder;
+
+/* Discovery retry schedule.  The wait after the first PADI or PADR is
+   firstMs and doubles with each retry up to maxMs.  Every wait is spread
+   by up to +/- jitterPct percent, so CPEs that lost their sessions at the
+   same moment do not retry in lockstep. */
+typedef struct RetryScheduleStruct {
+    int firstMs;		/* Wait after the first attempt */
+    int maxMs;			/* Longest wait */
+    int jitterPct;		/* Randomization of each wait, in percent */
+    int attempts;		/* Attempts before giving up (or restarting) */
+    unsigned int seed;		/* Jitter random-number state */
+} RetrySchedule;
+
+/* An uplink that discovery runs on in parallel with others (pppoe given
+   -I more than once).  The first link to produce an acceptable PADO is
+   used for the session; the rest are closed. */
+#define MAX_LINKS 8
+typedef struct DiscoveryLinkStruct {
+    char *ifName;		/* Interface name */
+    int discoverySocket;	/* Socket for discovery frames */
+    int sessionSocket;		/* Socket for session frames */
+    unsigned char myEth[ETH_ALEN]; /* Interface's MAC address */
+} DiscoveryLink;
+
 typedef struct PPPoEConnectionStruct {
     int discoveryState;		/* Where we are in discovery */
     int discoverySocket;	/* Raw socket for discovery frames */
@@ -180,10 +257,23 @@ typedef struct PPPoEConnectionStruct {
     PPPoETag cookie;		/* We have to send this if we get it */
     PPPoETag relayId;		/* Ditto */
     int PADSHadError;           /* If PADS had an error tag */
-    int discoveryTimeout;       /* Timeout for discovery packets */
+    RetrySchedule retry;	/* Discovery retry schedule */
+    char *resumeFile;		/* Session cache for fast restart, if any */
+    DiscoveryLink links[MAX_LINKS]; /* Uplinks, if more than one */
+    int numLinks;		/* Number of entries in links; 0 or 1 means
+				   just ifName */
+    int link;			/* Index of the link in use */
+    int padoWindowMs;		/* Collect PADOs this long, then pick the best */
+    uint32_t loadVendor;	/* Vendor ID of the AC load tag; 0 if none */
     int seenMaxPayload;
     int mtu;
     int mru;
+    int maxPayload;		/* Largest PPPoE payload the session carries */
+    PPPDecoder decoder;		/* Async PPP decoder state */
+    unsigned char *frameBuf;	/* Async frames bound for pppd */
+    size_t frameBufSize;	/* Size of frameBuf */
+    uint32_t lcpMagic;		/* pppd's LCP magic number (network order) */
+    int lcpAcks;		/* Configure-Acks seen, for local LCP echo */
 } PPPoEConnection;
 
 /* Structure used to determine acceptable PADO or PADS packet */
@@ -194,13 +284,31 @@ struct PacketCriteria {
     int seenACName;
     int seenServiceName;
     int gotError;
+    int load;			/* Load the AC advertised, or -1 */
+    int maxPayload;		/* PPP-Max-Payload the AC offered, or 0 */
 };
 
+/* PADOs kept for ranking when a collection window is in use */
+#define MAX_PADO_CANDIDATES 16
+
+/* ACs that don't advertise their load rank as if they were this loaded */
+#define LOAD_UNKNOWN 50
+
+/* Sub-option of the AC load Vendor-Specific tag carrying a percentage */
+#define LOAD_SUBOPT_PERCENT 0x01
+
 /* Function Prototypes */
 uint16_t etherType(PPPoEPacket *packet);
 int openInterface(char const *ifname, uint16_t type, unsigned char *hwaddr, uint16_t *mtu);
+void closeInterface(int sock);
+int interfaceIsRawSocket(int sock);
+void setPromiscuous(int sock, char const *ifname);
+char const *interfaceDevice(char const *ifname);
 int sendPacket(PPPoEConnection *conn, int sock, PPPoEPacket *pkt, int size);
 int receivePacket(int sock, PPPoEPacket *pkt, int *size);
+int receivePackets(int sock, PPPoEPacket *pkts, int *sizes, int max);
+int sendPackets(PPPoEConnection *conn, int sock, PPPoEPacket *pkts,
+		int const *sizes, int n);
 void fatalSys(char const *str);
 void rp_fatal(char const *str);
 __attribute__((format (printf, 1, 2))) void printErr(char const *fmt, ...);
@@ -210,10 +318,13 @@ void dumpPacket(FILE *fp, PPPoEPacket *packet, char const *dir);
 void dumpHex(FILE *fp, unsigned char const *buf, int len);
 #endif
 int parsePacket(PPPoEPacket *packet, ParseFunc *func, void *extra);
+int indexPacket(PPPoEPacket *packet, TagIndex *ti);
+unsigned char *indexTag(TagIndex const *ti, uint16_t type, PPPoETag *tag);
+void walkTags(TagIndex const *ti, ParseFunc *func, void *extra);
 void parseLogErrs(uint16_t typ, uint16_t len, unsigned char *data, void *xtra);
 void pktLogErrs(char const *pkt, uint16_t typ, uint16_t len, unsigned char *data, void *xtra);
 void syncReadFromPPP(PPPoEConnection *conn, PPPoEPacket *packet);
-void asyncReadFromPPP(PPPoEConnection *conn, PPPoEPacket *packet);
+int asyncReadFromPPP(PPPoEConnection *conn, PPPoEPacket *packet);
 void asyncReadFromEth(PPPoEConnection *conn, int sock, int clampMss);
 void syncReadFromEth(PPPoEConnection *conn, int sock, int clampMss);
 void sendPADT(PPPoEConnection *conn, char const *msg);
@@ -221,11 +332,33 @@ void sendPADTf(PPPoEConnection *conn, char const *fmt, ...);
 
 void sendSessionPacket(PPPoEConnection *conn,
 		       PPPoEPacket *packet, int len);
-void initPPP(void);
+void sendSessionPackets(PPPoEConnection *conn,
+			PPPoEPacket *pkts, int const *lens, int n);
+void initPPP(PPPoEConnection *conn);
+void floodDiscovery(PPPoEConnection *conn, int clients, int rate, int hold);
+void decodeFromPPP(PPPoEConnection *conn, PPPoEPacket *packet,
+		   unsigned char *buf, int r);
 void clampMSS(PPPoEPacket *packet, char const *dir, int clampMss);
+uint32_t inetChecksumAdd(uint32_t sum, void const *data, int count);
+uint16_t inetChecksumFinish(uint32_t sum);
 uint16_t computeTCPChecksum(unsigned char *ipHdr, unsigned char *tcpHdr);
+uint16_t computeTCP6Checksum(unsigned char *ip6Hdr, unsigned char *tcpHdr,
+			     int count);
 uint16_t pppFCS16(uint16_t fcs, unsigned char *cp, int len);
+uint16_t pppFCS16Sliced(uint16_t fcs, unsigned char const *cp, int len);
+uint16_t pppFCS16Clmul(uint16_t fcs, unsigned char const *cp, int len);
+uint16_t pppFCS16Fast(uint16_t fcs, unsigned char const *cp, int len);
+int pppFCS16HaveClmul(void);
+int cpuHasAVX2(void);
+int pppAsyncEncode(unsigned char *dst, unsigned char const *src, int len,
+		   uint16_t *fcs);
 void discovery(PPPoEConnection *conn);
+void useLink(PPPoEConnection *conn, int link);
+void retryDefaults(RetrySchedule *rs);
+void retryLegacy(RetrySchedule *rs, int seconds);
+int parseRetrySchedule(RetrySchedule *rs, char const *spec);
+int retryWait(RetrySchedule *rs, int attempt);
+int parsePadoWindow(PPPoEConnection *conn, char const *spec);
 unsigned char *findTag(PPPoEPacket *packet, uint16_t tagType,
 		       PPPoETag *tag);
 
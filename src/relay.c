@@ -21,13 +21,19 @@
 #include <sys/socket.h>
 #include <signal.h>
 #include "relay.h"
+#include "control_socket.h"
 
 #include <syslog.h>
 #include <getopt.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <endian.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 
 #ifdef HAVE_SYS_UIO_H
 #include <sys/uio.h>
@@ -39,6 +45,14 @@
 #include <linux/if.h>
 #endif
 
+#ifdef HAVE_LINUX_IF_PACKET_H
+#include <linux/if_packet.h>
+#endif
+#include <linux/filter.h>
+
+/* Length of an 802.1Q tag */
+#define VLAN_TAG_LEN 4
+
 /* Interfaces (max MAX_INTERFACES) */
 PPPoEInterface Interfaces[MAX_INTERFACES];
 int NumInterfaces;
@@ -52,10 +66,17 @@ PPPoESession *ActiveSessions;
 
 SessionHash *AllHashes;
 SessionHash *FreeHashes;
-SessionHash *Buckets[HASHTAB_SIZE];
+SessionHash **Buckets;
+unsigned int HashSize;
+
+/* Access concentrators we have relayed sessions for */
+AcPeer *AcPeers = NULL;
+int NumAcPeers = 0;
 
-volatile unsigned int Epoch = 0;
-volatile unsigned int CleanCounter = 0;
+/* Seconds since startup on the monotonic clock, refreshed by the tick */
+unsigned int Epoch = 0;
+unsigned int CleanCounter = 0;
+static struct timespec StartTime;
 
 /* How often to clean up stale sessions? */
 #define MIN_CLEAN_PERIOD 30  /* Minimum period to run cleaner */
@@ -65,11 +86,59 @@ unsigned int CleanPeriod = MIN_CLEAN_PERIOD;
 /* How long a session can be idle before it is cleaned up? */
 unsigned int IdleTimeout = MIN_CLEAN_PERIOD * TIMEOUT_DIVISOR;
 
-/* Pipe for breaking select() to initiate periodic cleaning */
-int CleanPipe[2];
+/* timerfd delivering the once-a-second tick */
+int TickFd = -1;
+static void tickInit(void);
+
+/* Event selector driving the relay loop and control socket */
+EventSelector *event_selector;
+
+/* Global statistics */
+unsigned long long SessionsOpened = 0;
+unsigned long long SessionsClosed = 0;
+unsigned long long SessionsRefused = 0;
+
+/* Accounting export */
+#define ACCT_BATCH 256		/* Records buffered between writes */
+#define DEFAULT_ACCT_INTERVAL 300
+#define DEFAULT_ACCT_ROTATE (64 * 1024 * 1024)
+char const *AcctPath = NULL;
+int AcctFd = -1;
+unsigned int AcctInterval = DEFAULT_ACCT_INTERVAL;
+off_t AcctRotateSize = DEFAULT_ACCT_ROTATE;
+off_t AcctFileSize = 0;
+AcctRecord AcctBuffer[ACCT_BATCH];
+int AcctCount = 0;
 
-/* Our relay: if_index followed by peer_mac */
-#define MY_RELAY_TAG_LEN (sizeof(int) + ETH_ALEN)
+/**********************************************************************
+*Structures describing the CLI interface, and forward declarations.
+***********************************************************************/
+static int handle_status(ClientConnection *client, const char* const* argv, int argi, void* pvt, void* clientpvt);
+static int handle_interfaces(ClientConnection *client, const char* const* argv, int argi, void* pvt, void* clientpvt);
+static int handle_sessions(ClientConnection *client, const char* const* argv, int argi, void* pvt, void* clientpvt);
+static int handle_hash(ClientConnection *client, const char* const* argv, int argi, void* pvt, void* clientpvt);
+
+ControlCommand cmd_show[] = {
+    { .command = "status", .handler = handle_status, },
+    { .command = "interfaces", .handler = handle_interfaces, },
+    { .command = "sessions", .handler = handle_sessions, },
+    { .command = "hash", .handler = handle_hash, },
+    { .command = NULL, }
+};
+
+ControlCommand cmd_root[] = {
+    {
+	.command = "show",
+	.handler = control_socket_handle_command,
+	.pvt = &cmd_show,
+    },
+    { .command = NULL, }
+};
+
+/* Our relay: if_index followed by peer_mac and peer's VLAN tags */
+#define MY_RELAY_TAG_LEN (sizeof(int) + ETH_ALEN + sizeof(VlanTags))
+#define RELAY_TAG_MAC(p) ((p) + sizeof(int))
+#define RELAY_TAG_VLAN(p) ((p) + sizeof(int) + ETH_ALEN)
 
 /* Hack for daemonizing */
 #define CLOSEFD 64
@@ -85,7 +154,6 @@ static int
 keepDescriptor(int fd)
 {
     int i;
-    if (fd == CleanPipe[0] || fd == CleanPipe[1]) return 1;
     for (i=0; i<NumInterfaces; i++) {
 	if (fd == Interfaces[i].discoverySock ||
 	    fd == Interfaces[i].sessionSock) return 1;
@@ -194,8 +262,13 @@ usage(char const *argv0)
     fprintf(stderr, "   -S if_name     -- Specify interface for PPPoE Server\n");
     fprintf(stderr, "   -C if_name     -- Specify interface for PPPoE Client\n");
     fprintf(stderr, "   -B if_name     -- Specify interface for both clients and server\n");
+    fprintf(stderr, "   -V if_name     -- Specify VLAN trunk interface for PPPoE Clients\n");
     fprintf(stderr, "   -n nsess       -- Maxmimum number of sessions to relay\n");
     fprintf(stderr, "   -i timeout     -- Idle timeout in seconds (0 = no timeout)\n");
+    fprintf(stderr, "   -U socket      -- Use control socket\n");
+    fprintf(stderr, "   -a file        -- Append session accounting records to file\n");
+    fprintf(stderr, "   -t interval    -- Accounting interval in seconds (default %d)\n", DEFAULT_ACCT_INTERVAL);
+    fprintf(stderr, "   -r kbytes      -- Rotate accounting file at this size (0 = never)\n");
     fprintf(stderr, "   -F             -- Do not fork into background\n");
     fprintf(stderr, "   -h             -- Print this help message\n");
 
@@ -219,15 +292,20 @@ usage(char const *argv0)
 * -C ifname           -- Use interface for PPPoE clients
 * -S ifname           -- Use interface for PPPoE servers
 * -B ifname           -- Use interface for both clients and servers
+* -V ifname           -- Use VLAN trunk interface for PPPoE clients
 * -n sessions         -- Maximum of "n" sessions
+* -U socket           -- Path of UNIX-domain control socket
+* -a file             -- Session accounting file
+* -t interval         -- Accounting export interval
+* -r kbytes           -- Accounting file rotation size
 ***********************************************************************/
 int
 main(int argc, char *argv[])
 {
     int opt;
     int nsess = DEFAULT_SESSIONS;
-    struct sigaction sa;
     int beDaemon = 1;
+    char *unix_control = NULL;
 
     if (getuid() != geteuid() ||
 	getgid() != getegid()) {
@@ -238,7 +316,7 @@ main(int argc, char *argv[])
 
     openlog("pppoe-relay", LOG_PID, LOG_DAEMON);
 
-    while((opt = getopt(argc, argv, "hC:S:B:n:i:F")) != -1) {
+    while((opt = getopt(argc, argv, "hC:S:B:V:n:i:FU:a:t:r:")) != -1) {
 	switch(opt) {
 	case 'h':
 	    usage(argv[0]);
@@ -246,14 +324,39 @@ main(int argc, char *argv[])
 	case 'F':
 	    beDaemon = 0;
 	    break;
+	case 'U':
+	    unix_control = optarg;
+	    break;
+	case 'a':
+	    AcctPath = optarg;
+	    break;
+	case 't':
+	    if (sscanf(optarg, "%u", &AcctInterval) != 1 || AcctInterval < 1) {
+		fprintf(stderr, "Illegal argument to -t: should be -t seconds\n");
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'r':
+	{
+	    unsigned long kb;
+	    if (sscanf(optarg, "%lu", &kb) != 1) {
+		fprintf(stderr, "Illegal argument to -r: should be -r kbytes\n");
+		exit(EXIT_FAILURE);
+	    }
+	    AcctRotateSize = (off_t) kb * 1024;
+	    break;
+	}
 	case 'C':
-	    addInterface(optarg, 1, 0);
+	    addInterface(optarg, 1, 0, 0);
 	    break;
 	case 'S':
-	    addInterface(optarg, 0, 1);
+	    addInterface(optarg, 0, 1, 0);
 	    break;
 	case 'B':
-	    addInterface(optarg, 1, 1);
+	    addInterface(optarg, 1, 1, 0);
+	    break;
+	case 'V':
+	    addInterface(optarg, 1, 0, 1);
 	    break;
 	case 'i':
 	    if (sscanf(optarg, "%u", &IdleTimeout) != 1) {
@@ -268,8 +371,9 @@ main(int argc, char *argv[])
 		fprintf(stderr, "Illegal argument to -n: should be -n #sessions\n");
 		exit(EXIT_FAILURE);
 	    }
-	    if (nsess < 1 || nsess > 65534) {
-		fprintf(stderr, "Illegal argument to -n: must range from 1 to 65534\n");
+	    if (nsess < 1 || nsess > MAX_SESSIONS) {
+		fprintf(stderr, "Illegal argument to -n: must range from 1 to %d\n",
+			MAX_SESSIONS);
 		exit(EXIT_FAILURE);
 	    }
 	    break;
@@ -285,19 +389,6 @@ main(int argc, char *argv[])
 	exit(EXIT_FAILURE);
     }
 
-    /* Make a pipe for the cleaner */
-    if (pipe(CleanPipe) < 0) {
-	fatalSys("pipe");
-    }
-
-    /* Set up alarm handler */
-    sa.sa_handler = alarmHandler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    if (sigaction(SIGALRM, &sa, NULL) < 0) {
-	fatalSys("sigaction");
-    }
-
     /* Allocate memory for sessions, etc. */
     initRelay(nsess);
 
@@ -333,8 +424,25 @@ main(int argc, char *argv[])
 	openlog("pppoe-relay", LOG_PID, LOG_DAEMON);
     }
 
-    /* Kick off SIGALRM if there is an idle timeout */
-    if (IdleTimeout) alarm(1);
+    /* Create event selector */
+    event_selector = Event_CreateSelector();
+    if (!event_selector) {
+	rp_fatal("Could not create EventSelector -- probably out of memory");
+    }
+
+    /* Ignore SIGPIPE; a control client may go away while we write to it */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (unix_control && control_socket_init(event_selector, unix_control, cmd_root) != 0) {
+	rp_fatal("control_socket_init failed");
+    }
+
+    if (AcctPath) {
+	acctInit(AcctPath);
+    }
+
+    /* Start the clock */
+    tickInit();
 
     /* Enter the relay loop */
     relayLoop();
@@ -343,12 +451,68 @@ main(int argc, char *argv[])
     return EXIT_FAILURE;
 }
 
+/**********************************************************************
+*%FUNCTION: openTrunk
+*%ARGUMENTS:
+* ifname -- name of interface
+* hwaddr -- set to the hardware address
+*%RETURNS:
+* A raw socket receiving PPPoE frames with any VLAN tags.  Exits on error.
+*%DESCRIPTION:
+* When a tagged frame has no matching VLAN device, the kernel strips the
+* outer tag and only reports it to ETH_P_ALL sockets; sockets bound to
+* the PPPoE Ethernet types see the frame with the tag discarded.  So a
+* trunk gets one ETH_P_ALL socket with PACKET_AUXDATA, and a filter that
+* passes only incoming PPPoE frames, untagged or carrying one in-band tag.
+***********************************************************************/
+static int
+openTrunk(char const *ifname, unsigned char *hwaddr)
+{
+#if defined(PACKET_AUXDATA) && defined(TP_STATUS_VLAN_VALID) && defined(SKF_AD_PKTTYPE)
+    int on = 1;
+    int fd = openInterface(ifname, ETH_P_ALL, hwaddr, NULL);
+    struct sock_filter code[] = {
+	/* Drop our own transmitted frames */
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 8, 0),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, Eth_PPPOE_Discovery, 7, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, Eth_PPPOE_Session, 6, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_8021Q, 1, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_8021AD, 0, 3),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 16),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, Eth_PPPOE_Discovery, 2, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, Eth_PPPOE_Session, 1, 0),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+	BPF_STMT(BPF_RET | BPF_K, 0xFFFF),
+    };
+    struct sock_fprog prog;
+
+    if (!interfaceIsRawSocket(fd)) {
+	rp_fatal("VLAN trunks need an AF_PACKET interface, not a packet I/O backend");
+    }
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+	fatalSys("setsockopt(SO_ATTACH_FILTER)");
+    }
+    if (setsockopt(fd, SOL_PACKET, PACKET_AUXDATA, &on, sizeof(on)) < 0) {
+	fatalSys("setsockopt(PACKET_AUXDATA)");
+    }
+    return fd;
+#else
+    rp_fatal("VLAN trunk interfaces are not supported on this system");
+    return -1;
+#endif
+}
+
 /**********************************************************************
 *%FUNCTION: addInterface
 *%ARGUMENTS:
 * ifname -- interface name
 * clientOK -- true if this interface should relay PADI, PADR packets.
 * acOK -- true if this interface should relay PADO, PADS packets.
+* trunk -- true if clients on this interface are behind VLAN tags.
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
@@ -357,12 +521,13 @@ main(int argc, char *argv[])
 void
 addInterface(char const *ifname,
 	     int clientOK,
-	     int acOK)
+	     int acOK,
+	     int trunk)
 {
     PPPoEInterface *i;
     int j;
     for (j=0; j<NumInterfaces; j++) {
-	if (!strncmp(Interfaces[j].name, ifname, IFNAMSIZ)) {
+	if (!strncmp(Interfaces[j].name, ifname, IFNAME_MAX)) {
 	    fprintf(stderr, "Interface %s specified more than once.\n", ifname);
 	    exit(EXIT_FAILURE);
 	}
@@ -374,13 +539,125 @@ addInterface(char const *ifname,
 	exit(EXIT_FAILURE);
     }
     i = &Interfaces[NumInterfaces++];
-    strncpy(i->name, ifname, IFNAMSIZ);
-    i->name[IFNAMSIZ] = 0;
+    strncpy(i->name, ifname, IFNAME_MAX);
+    i->name[IFNAME_MAX] = 0;
 
-    i->discoverySock = openInterface(ifname, Eth_PPPOE_Discovery, i->mac, NULL);
-    i->sessionSock   = openInterface(ifname, Eth_PPPOE_Session,   NULL, NULL);
     i->clientOK = clientOK;
     i->acOK = acOK;
+    i->trunk = trunk;
+
+    if (trunk) {
+	i->discoverySock = openTrunk(ifname, i->mac);
+	i->sessionSock = i->discoverySock;
+    } else {
+	i->discoverySock = openInterface(ifname, Eth_PPPOE_Discovery, i->mac, NULL);
+	i->sessionSock   = openInterface(ifname, Eth_PPPOE_Session,   NULL, NULL);
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: nextPrime
+*%ARGUMENTS:
+* n -- a number
+*%RETURNS:
+* The smallest prime >= n
+***********************************************************************/
+static unsigned int
+nextPrime(unsigned int n)
+{
+    unsigned int d;
+    if (n <= 2) return 2;
+    if (!(n & 1)) n++;
+    for (;; n += 2) {
+	for (d=3; d*d <= n; d += 2) {
+	    if (n % d == 0) break;
+	}
+	if (d*d > n) return n;
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: findAcPeer
+*%ARGUMENTS:
+* iface -- interface AC is behind
+* mac -- AC's MAC address
+*%RETURNS:
+* The AcPeer for this AC, created if necessary; NULL if out of memory.
+***********************************************************************/
+static AcPeer *
+findAcPeer(PPPoEInterface const *iface, unsigned char const *mac)
+{
+    AcPeer *peer;
+
+    for (peer = AcPeers; peer; peer = peer->next) {
+	if (peer->interface == iface && !memcmp(peer->mac, mac, ETH_ALEN)) {
+	    return peer;
+	}
+    }
+    peer = calloc(1, sizeof(AcPeer));
+    if (!peer) {
+	return NULL;
+    }
+    peer->interface = iface;
+    memcpy(peer->mac, mac, ETH_ALEN);
+    peer->hint = 1;
+    peer->next = AcPeers;
+    AcPeers = peer;
+    NumAcPeers++;
+    return peer;
+}
+
+/**********************************************************************
+*%FUNCTION: allocSesNum
+*%ARGUMENTS:
+* peer -- AC the session goes to
+* cliMac -- client's MAC address
+*%RETURNS:
+* A session number in network byte order, or 0 if none is free.
+*%DESCRIPTION:
+* Allocates a session number from "peer"'s number space.  Numbers from
+* different ACs can coincide, so a number that the client already uses
+* with another AC is skipped to keep the client-side hash key unique.
+***********************************************************************/
+static uint16_t
+allocSesNum(AcPeer *peer, unsigned char const *cliMac)
+{
+    unsigned int n, tries;
+
+    n = peer->hint;
+    for (tries = 0; tries < 65535; tries++, n++) {
+	if (n > 65534) n = 1;
+	if (peer->used[n / 32] == 0xFFFFFFFF) {
+	    /* Skip over a full word */
+	    n |= 31;
+	    continue;
+	}
+	if (peer->used[n / 32] & (1U << (n % 32))) continue;
+	if (findSession(cliMac, htons((uint16_t) n))) continue;
+	peer->used[n / 32] |= (1U << (n % 32));
+	peer->numSessions++;
+	peer->hint = n + 1;
+	return htons((uint16_t) n);
+    }
+    return 0;
+}
+
+/**********************************************************************
+*%FUNCTION: freeSesNum
+*%ARGUMENTS:
+* peer -- AC the session went to
+* sesNum -- session number in network byte order
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Returns a session number to "peer"'s number space.
+***********************************************************************/
+static void
+freeSesNum(AcPeer *peer, uint16_t sesNum)
+{
+    unsigned int n = ntohs(sesNum);
+    peer->used[n / 32] &= ~(1U << (n % 32));
+    peer->numSessions--;
 }
 
 /**********************************************************************
@@ -399,10 +676,11 @@ initRelay(int nsess)
     NumSessions = 0;
     MaxSessions = nsess;
 
-    AllSessions = calloc(MaxSessions, sizeof(PPPoESession));
-    if (!AllSessions) {
+    if (posix_memalign((void **) &AllSessions, __alignof__(PPPoESession),
+		       MaxSessions * sizeof(PPPoESession)) != 0) {
 	rp_fatal("Unable to allocate memory for PPPoE session table");
     }
+    memset(AllSessions, 0, MaxSessions * sizeof(PPPoESession));
     AllHashes = calloc(MaxSessions*2, sizeof(SessionHash));
     if (!AllHashes) {
 	rp_fatal("Unable to allocate memory for PPPoE hash table");
@@ -427,9 +705,14 @@ initRelay(int nsess)
     FreeSessions = AllSessions;
     ActiveSessions = NULL;
 
-    /* Initialize session numbers which we hand out */
-    for (i=0; i<MaxSessions; i++) {
-	AllSessions[i].sesNum = htons((uint16_t) i+1);
+    /* Size the hash table for the session limit */
+    HashSize = HASHTAB_SIZE;
+    if ((unsigned int) MaxSessions > HashSize) {
+	HashSize = nextPrime(MaxSessions);
+    }
+    Buckets = calloc(HashSize, sizeof(SessionHash *));
+    if (!Buckets) {
+	rp_fatal("Unable to allocate memory for PPPoE hash buckets");
     }
 
     /* Initialize hashes in a linked list */
@@ -452,6 +735,7 @@ initRelay(int nsess)
 * cli -- Ethernet interface on client side
 * acMac -- Access concentrator's MAC address
 * cliMac -- Client's MAC address
+* cliVlan -- Client's VLAN tags
 * acSess -- Access concentrator's session ID.
 *%RETURNS:
 * PPPoESession structure; NULL if one could not be allocated
@@ -459,17 +743,36 @@ initRelay(int nsess)
 * Initializes relay hash table and session tables.
 ***********************************************************************/
 PPPoESession *
-createSession(PPPoEInterface const *ac,
-	      PPPoEInterface const *cli,
+createSession(PPPoEInterface *ac,
+	      PPPoEInterface *cli,
 	      unsigned char const *acMac,
 	      unsigned char const *cliMac,
+	      VlanTags const *cliVlan,
 	      uint16_t acSes)
 {
     PPPoESession *sess;
     SessionHash *acHash, *cliHash;
+    AcPeer *peer;
+    uint16_t sesNum;
 
     if (NumSessions >= MaxSessions) {
 	printErr("Maximum number of sessions reached -- cannot create new session");
+	SessionsRefused++;
+	return NULL;
+    }
+
+    /* Get a session number from this AC's number space */
+    peer = findAcPeer(ac, acMac);
+    if (!peer) {
+	printErr("Out of memory -- cannot create new session");
+	SessionsRefused++;
+	return NULL;
+    }
+    sesNum = allocSesNum(peer, cliMac);
+    if (!sesNum) {
+	printErr("No free session numbers for server %02x:%02x:%02x:%02x:%02x:%02x -- cannot create new session",
+		 acMac[0], acMac[1], acMac[2], acMac[3], acMac[4], acMac[5]);
+	SessionsRefused++;
 	return NULL;
     }
 
@@ -486,7 +789,14 @@ createSession(PPPoEInterface const *ac,
     ActiveSessions = sess;
     sess->prev = NULL;
 
+    sess->sesNum = sesNum;
+    sess->acPeer = peer;
     sess->epoch = Epoch;
+    sess->startEpoch = Epoch;
+    sess->startTime = time(NULL);
+    memset(sess->packets, 0, sizeof(sess->packets));
+    memset(sess->bytes, 0, sizeof(sess->bytes));
+    SessionsOpened++;
 
     /* Get two hash entries */
     acHash = FreeHashes;
@@ -505,10 +815,12 @@ createSession(PPPoEInterface const *ac,
     memcpy(acHash->peerMac, acMac, ETH_ALEN);
     acHash->sesNum = acSes;
     acHash->ses = sess;
+    memset(&acHash->vlan, 0, sizeof(acHash->vlan));
 
     memcpy(cliHash->peerMac, cliMac, ETH_ALEN);
     cliHash->sesNum = sess->sesNum;
     cliHash->ses = sess;
+    cliHash->vlan = *cliVlan;
 
     addHash(acHash);
     addHash(cliHash);
@@ -557,6 +869,10 @@ freeSession(PPPoESession *ses, char const *msg)
 	   ses->clientHash->interface->name,
 	   ntohs(ses->clientHash->sesNum), msg);
 
+    if (AcctFd >= 0) {
+	acctSession(ses, ACCT_STOP);
+    }
+
     /* Unlink from active sessions */
     if (ses->prev) {
 	ses->prev->next = ses->next;
@@ -574,7 +890,9 @@ freeSession(PPPoESession *ses, char const *msg)
 
     unhash(ses->acHash);
     unhash(ses->clientHash);
+    freeSesNum(ses->acPeer, ses->sesNum);
     NumSessions--;
+    SessionsClosed++;
 }
 
 /**********************************************************************
@@ -590,7 +908,7 @@ freeSession(PPPoESession *ses, char const *msg)
 void
 unhash(SessionHash *sh)
 {
-    unsigned int b = hash(sh->peerMac, sh->sesNum) % HASHTAB_SIZE;
+    unsigned int b = hash(sh->peerMac, sh->sesNum) % HashSize;
     if (sh->prev) {
 	sh->prev->next = sh->next;
     } else {
@@ -618,7 +936,7 @@ unhash(SessionHash *sh)
 void
 addHash(SessionHash *sh)
 {
-    unsigned int b = hash(sh->peerMac, sh->sesNum) % HASHTAB_SIZE;
+    unsigned int b = hash(sh->peerMac, sh->sesNum) % HashSize;
     sh->next = Buckets[b];
     sh->prev = NULL;
     if (sh->next) {
@@ -663,7 +981,7 @@ hash(unsigned char const *mac, uint16_t sesNum)
 SessionHash *
 findSession(unsigned char const *mac, uint16_t sesNum)
 {
-    unsigned int b = hash(mac, sesNum) % HASHTAB_SIZE;
+    unsigned int b = hash(mac, sesNum) % HashSize;
     SessionHash *sh = Buckets[b];
     while(sh) {
 	if (!memcmp(mac, sh->peerMac, ETH_ALEN) && sesNum == sh->sesNum) {
@@ -721,6 +1039,113 @@ rp_fatal(char const *str)
     exit(EXIT_FAILURE);
 }
 
+/**********************************************************************
+*%FUNCTION: sessionSockHandler, discoverySockHandler, trunkSockHandler
+*%ARGUMENTS:
+* es -- event selector
+* fd -- socket which is readable
+* flags -- ignored
+* data -- the PPPoEInterface owning the socket
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Event callbacks for frames arriving on an interface.
+***********************************************************************/
+static void
+sessionSockHandler(EventSelector *es, int fd, unsigned int flags, void *data)
+{
+    relayGotSessionPacket((PPPoEInterface *) data);
+}
+
+static void
+discoverySockHandler(EventSelector *es, int fd, unsigned int flags, void *data)
+{
+    relayGotDiscoveryPacket((PPPoEInterface *) data);
+}
+
+static void
+trunkSockHandler(EventSelector *es, int fd, unsigned int flags, void *data)
+{
+    relayGotTrunkPacket((PPPoEInterface *) data);
+}
+
+/**********************************************************************
+*%FUNCTION: updateEpoch
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Sets Epoch to the number of seconds since startup, read from the
+* monotonic clock so that wall-clock steps do not age sessions.
+***********************************************************************/
+static void
+updateEpoch(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    Epoch = (unsigned int) (now.tv_sec - StartTime.tv_sec);
+}
+
+/**********************************************************************
+*%FUNCTION: tickHandler
+*%ARGUMENTS:
+* es -- event selector
+* fd -- the tick timerfd
+* flags -- ignored
+* data -- ignored
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Called once a second.  Refreshes Epoch and runs the stale-session
+* cleaner every CleanPeriod seconds.
+***********************************************************************/
+static void
+tickHandler(EventSelector *es, int fd, unsigned int flags, void *data)
+{
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+	return;
+    }
+    updateEpoch();
+    CleanCounter += (unsigned int) expirations;
+    if (CleanCounter >= CleanPeriod) {
+	CleanCounter = 0;
+	if (IdleTimeout) cleanSessions();
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: tickInit
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Starts the clock: a monotonic timerfd that fires once a second and is
+* handled by the event selector like any other descriptor.
+***********************************************************************/
+static void
+tickInit(void)
+{
+    struct itimerspec its;
+
+    clock_gettime(CLOCK_MONOTONIC, &StartTime);
+    Epoch = 0;
+
+    TickFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (TickFd < 0) {
+	fatalSys("timerfd_create");
+    }
+    its.it_interval.tv_sec = 1;
+    its.it_interval.tv_nsec = 0;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(TickFd, 0, &its, NULL) < 0) {
+	fatalSys("timerfd_settime");
+    }
+}
+
 /**********************************************************************
 *%FUNCTION: relayLoop
 *%ARGUMENTS:
@@ -733,60 +1158,233 @@ rp_fatal(char const *str)
 void
 relayLoop()
 {
-    fd_set readable, readableCopy;
-    int maxFD;
-    int i, r;
-    int sock;
+    int i;
 
-    /* Build the select set */
-    FD_ZERO(&readable);
-    maxFD = 0;
+    /* Handlers are called most-recently-added first, so add the session
+       sockets last to keep handling them ahead of discovery frames */
+    if (!Event_AddHandler(event_selector, TickFd, EVENT_FLAG_READABLE,
+			  tickHandler, NULL)) {
+	fatalSys("Event_AddHandler");
+    }
     for (i=0; i<NumInterfaces; i++) {
-	sock = Interfaces[i].discoverySock;
-	if (sock > maxFD) maxFD = sock;
-	FD_SET(sock, &readable);
-	sock = Interfaces[i].sessionSock;
-	if (sock > maxFD) maxFD = sock;
-	FD_SET(sock, &readable);
-	if (CleanPipe[0] > maxFD) maxFD = CleanPipe[0];
-	FD_SET(CleanPipe[0], &readable);
-    }
-    maxFD++;
-    for(;;) {
-	readableCopy = readable;
-	for(;;) {
-	    r = select(maxFD, &readableCopy, NULL, NULL, NULL);
-	    if (r >= 0 || errno != EINTR) break;
+	if (Interfaces[i].trunk) continue;
+	if (!Event_AddHandler(event_selector, Interfaces[i].discoverySock,
+			      EVENT_FLAG_READABLE, discoverySockHandler,
+			      &Interfaces[i])) {
+	    fatalSys("Event_AddHandler");
 	}
-	if (r < 0) {
-	    sysErr("select (relayLoop)");
+    }
+    for (i=0; i<NumInterfaces; i++) {
+	if (Interfaces[i].trunk) {
+	    if (!Event_AddHandler(event_selector, Interfaces[i].sessionSock,
+				  EVENT_FLAG_READABLE, trunkSockHandler,
+				  &Interfaces[i])) {
+		fatalSys("Event_AddHandler");
+	    }
 	    continue;
 	}
+	if (!Event_AddHandler(event_selector, Interfaces[i].sessionSock,
+			      EVENT_FLAG_READABLE, sessionSockHandler,
+			      &Interfaces[i])) {
+	    fatalSys("Event_AddHandler");
+	}
+    }
 
-	/* Handle session packets first */
-	for (i=0; i<NumInterfaces; i++) {
-	    if (FD_ISSET(Interfaces[i].sessionSock, &readableCopy)) {
-		relayGotSessionPacket(&Interfaces[i]);
-	    }
+    for(;;) {
+	if (Event_HandleEvent(event_selector) < 0) {
+	    sysErr("Event_HandleEvent (relayLoop)");
 	}
+    }
+}
 
-	/* Now handle discovery packets */
-	for (i=0; i<NumInterfaces; i++) {
-	    if (FD_ISSET(Interfaces[i].discoverySock, &readableCopy)) {
-		relayGotDiscoveryPacket(&Interfaces[i]);
-	    }
+/**********************************************************************
+*%FUNCTION: relayReceive
+*%ARGUMENTS:
+* iface -- interface owning the socket
+* sock -- socket to read from
+* pkt -- place to store the received packet
+* size -- set to size of packet in bytes
+* vlan -- set to the frame's VLAN tags
+*%RETURNS:
+* >= 0 if all OK; < 0 if error
+*%DESCRIPTION:
+* Receives a packet.  On a trunk interface, the tag the kernel stripped
+* is recovered from PACKET_AUXDATA.  The four bytes following the MAC
+* addresses are read into a scratch buffer, so a frame that still carries
+* an in-band (QinQ inner) tag lands in "pkt" untagged without a copy;
+* a frame without one has to be moved back into place.
+***********************************************************************/
+int
+relayReceive(PPPoEInterface const *iface, int sock, PPPoEPacket *pkt,
+	     int *size, VlanTags *vlan)
+{
+#if defined(PACKET_AUXDATA) && defined(TP_STATUS_VLAN_VALID)
+    struct msghdr msg;
+    struct iovec iov[3];
+    unsigned char inner[VLAN_TAG_LEN];
+    union {
+	struct cmsghdr cmsg;
+	char buf[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
+    } cbuf;
+    struct cmsghdr *cmsg;
+    uint16_t type;
+    ssize_t r;
+#endif
+
+    /* Whole struct: the tags end up in the Relay-Session-Id tag */
+    memset(vlan, 0, sizeof(*vlan));
+    if (!iface->trunk) {
+	return receivePacket(sock, pkt, size);
+    }
+
+#if defined(PACKET_AUXDATA) && defined(TP_STATUS_VLAN_VALID)
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = pkt;
+    iov[0].iov_len = 2 * ETH_ALEN;
+    iov[1].iov_base = inner;
+    iov[1].iov_len = VLAN_TAG_LEN;
+    iov[2].iov_base = &pkt->ethHdr.h_proto;
+    iov[2].iov_len = sizeof(PPPoEPacket) - 2 * ETH_ALEN - VLAN_TAG_LEN;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+    msg.msg_control = cbuf.buf;
+    msg.msg_controllen = sizeof(cbuf.buf);
+
+    r = recvmsg(sock, &msg, MSG_TRUNC);
+    if (r < 0) {
+	sysErr("recvmsg (relayReceive)");
+	return -1;
+    }
+    if (r < 2 * ETH_ALEN + VLAN_TAG_LEN) {
+	return -1;
+    }
+    if (r > (ssize_t) sizeof(PPPoEPacket)) {
+	/* Longer than the iovecs could hold */
+	syslog(LOG_ERR, "Oversized frame (%d bytes) on %s", (int) r, iface->name);
+	return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	struct tpacket_auxdata aux;
+	if (cmsg->cmsg_level != SOL_PACKET || cmsg->cmsg_type != PACKET_AUXDATA ||
+	    cmsg->cmsg_len < CMSG_LEN(sizeof(aux))) {
+	    continue;
 	}
+	memcpy(&aux, CMSG_DATA(cmsg), sizeof(aux));
+	if (aux.tp_status & TP_STATUS_VLAN_VALID) {
+	    vlan->tci[vlan->count++] = aux.tp_vlan_tci;
+#ifdef TP_STATUS_VLAN_TPID_VALID
+	    vlan->tpid = (aux.tp_status & TP_STATUS_VLAN_TPID_VALID) ?
+		aux.tp_vlan_tpid : ETH_P_8021Q;
+#else
+	    vlan->tpid = ETH_P_8021Q;
+#endif
+	}
+    }
 
-	/* Handle the session-cleaning process */
-	if (FD_ISSET(CleanPipe[0], &readableCopy)) {
-	    char dummy;
-	    CleanCounter = 0;
-#pragma GCC diagnostic ignored "-Wunused-result"      
-	    read(CleanPipe[0], &dummy, 1);
-#pragma GCC diagnostic warning "-Wunused-result"      
-	    if (IdleTimeout) cleanSessions();
+    type = (inner[0] << 8) | inner[1];
+    if (type == ETH_P_8021Q || type == ETH_P_8021AD) {
+	/* In-band tag: already out of the way */
+	if (!vlan->count) {
+	    vlan->tpid = type;
 	}
+	vlan->tci[vlan->count++] = (inner[2] << 8) | inner[3];
+	r -= VLAN_TAG_LEN;
+    } else {
+	/* No in-band tag: scratch holds the start of the PPPoE header */
+	memmove(((unsigned char *) pkt) + 2 * ETH_ALEN + VLAN_TAG_LEN,
+		&pkt->ethHdr.h_proto, r - 2 * ETH_ALEN - VLAN_TAG_LEN);
+	memcpy(&pkt->ethHdr.h_proto, inner, VLAN_TAG_LEN);
+    }
+    *size = r;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/***********************************************************************
+*%FUNCTION: relaySend
+*%ARGUMENTS:
+* sock -- socket to send to
+* pkt -- the packet to transmit
+* size -- size of packet (in bytes)
+* vlan -- VLAN tags to push, or NULL
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Transmits a packet, inserting VLAN tags after the MAC addresses.  The
+* tags are gathered in with sendmsg() so the packet is not moved.
+***********************************************************************/
+void
+relaySend(int sock, PPPoEPacket *pkt, int size, VlanTags const *vlan)
+{
+    struct msghdr msg;
+    struct iovec iov[3];
+    unsigned char tags[MAX_VLAN_TAGS * VLAN_TAG_LEN];
+    int i;
+
+    if (!vlan || !vlan->count) {
+	sendPacket(NULL, sock, pkt, size);
+	return;
+    }
+
+    for (i=0; i<vlan->count; i++) {
+	uint16_t tpid = i ? ETH_P_8021Q : vlan->tpid;
+	tags[i*VLAN_TAG_LEN]   = tpid >> 8;
+	tags[i*VLAN_TAG_LEN+1] = tpid & 0xFF;
+	tags[i*VLAN_TAG_LEN+2] = vlan->tci[i] >> 8;
+	tags[i*VLAN_TAG_LEN+3] = vlan->tci[i] & 0xFF;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = pkt;
+    iov[0].iov_len = 2 * ETH_ALEN;
+    iov[1].iov_base = tags;
+    iov[1].iov_len = vlan->count * VLAN_TAG_LEN;
+    iov[2].iov_base = &pkt->ethHdr.h_proto;
+    iov[2].iov_len = size - 2 * ETH_ALEN;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+
+    if (sendmsg(sock, &msg, 0) < 0 && errno != ENOBUFS) {
+	sysErr("sendmsg (relaySend)");
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: vlanValid
+*%ARGUMENTS:
+* iface -- interface a frame is to be sent on
+* vlan -- VLAN tags decoded from a Relay-Session-Id tag
+*%RETURNS:
+* 1 if "vlan" makes sense for "iface"; 0 otherwise.
+***********************************************************************/
+static int
+vlanValid(PPPoEInterface const *iface, VlanTags const *vlan)
+{
+    if (vlan->count > MAX_VLAN_TAGS) return 0;
+    if (vlan->count && !iface->trunk) return 0;
+    return 1;
+}
+
+/**********************************************************************
+*%FUNCTION: vlanEqual
+*%ARGUMENTS:
+* a, b -- VLAN tag sets
+*%RETURNS:
+* 1 if both carry the same VLAN IDs; 0 otherwise.  Priority bits are
+* ignored, since a client may change them from frame to frame.
+***********************************************************************/
+static int
+vlanEqual(VlanTags const *a, VlanTags const *b)
+{
+    int i;
+    if (a->count != b->count) return 0;
+    for (i=0; i<a->count; i++) {
+	if ((a->tci[i] & 0x0FFF) != (b->tci[i] & 0x0FFF)) return 0;
     }
+    return 1;
 }
 
 /**********************************************************************
@@ -799,127 +1397,208 @@ relayLoop()
 * Receives and processes a discovery packet.
 ***********************************************************************/
 void
-relayGotDiscoveryPacket(PPPoEInterface const *iface)
+relayGotDiscoveryPacket(PPPoEInterface *iface)
+{
+    PPPoEPacket packet;
+    VlanTags vlan;
+    int size;
+
+    if (relayReceive(iface, iface->discoverySock, &packet, &size, &vlan) < 0) {
+	return;
+    }
+    relayDiscoveryFrame(iface, &packet, size, &vlan);
+}
+
+/**********************************************************************
+*%FUNCTION: relayGotSessionPacket
+*%ARGUMENTS:
+* iface -- interface on which packet is waiting
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Receives and processes a session packet.
+***********************************************************************/
+void
+relayGotSessionPacket(PPPoEInterface *iface)
 {
     PPPoEPacket packet;
+    VlanTags vlan;
     int size;
 
-    if (receivePacket(iface->discoverySock, &packet, &size) < 0) {
+    if (relayReceive(iface, iface->sessionSock, &packet, &size, &vlan) < 0) {
 	return;
     }
+    relaySessionFrame(iface, &packet, size, &vlan);
+}
+
+/**********************************************************************
+*%FUNCTION: relayGotTrunkPacket
+*%ARGUMENTS:
+* iface -- trunk interface on which a packet is waiting
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Receives a possibly-tagged packet and dispatches it by Ethernet type.
+***********************************************************************/
+void
+relayGotTrunkPacket(PPPoEInterface *iface)
+{
+    PPPoEPacket packet;
+    VlanTags vlan;
+    int size;
+    uint16_t type;
+
+    if (relayReceive(iface, iface->sessionSock, &packet, &size, &vlan) < 0) {
+	return;
+    }
+    type = ntohs(packet.ethHdr.h_proto);
+    if (type == Eth_PPPOE_Session) {
+	relaySessionFrame(iface, &packet, size, &vlan);
+    } else if (type == Eth_PPPOE_Discovery) {
+	relayDiscoveryFrame(iface, &packet, size, &vlan);
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: relayDiscoveryFrame
+*%ARGUMENTS:
+* iface -- interface on which packet was received
+* packet -- the packet
+* size -- size of packet in bytes
+* vlan -- VLAN tags the packet arrived with
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Processes a discovery packet.
+***********************************************************************/
+void
+relayDiscoveryFrame(PPPoEInterface *iface, PPPoEPacket *packet, int size,
+		    VlanTags const *vlan)
+{
+    TagIndex tags;
+
     /* Ignore unknown code/version */
-    if (PPPOE_VER(packet.vertype) != 1 || PPPOE_TYPE(packet.vertype) != 1) {
+    if (PPPOE_VER(packet->vertype) != 1 || PPPOE_TYPE(packet->vertype) != 1) {
 	return;
     }
 
     /* Validate length */
-    if (ntohs(packet.length) + HDR_SIZE > size) {
+    if (ntohs(packet->length) + HDR_SIZE > size) {
 	syslog(LOG_ERR, "Bogus PPPoE length field (%u)",
-	       (unsigned int) ntohs(packet.length));
+	       (unsigned int) ntohs(packet->length));
 	return;
     }
 
     /* Drop Ethernet frame padding */
-    if (size > ntohs(packet.length) + HDR_SIZE) {
-	size = ntohs(packet.length) + HDR_SIZE;
+    if (size > ntohs(packet->length) + HDR_SIZE) {
+	size = ntohs(packet->length) + HDR_SIZE;
     }
 
-    switch(packet.code) {
+    switch(packet->code) {
     case CODE_PADT:
-	relayHandlePADT(iface, &packet, size);
+	iface->discPackets[DISC_STAT_PADT]++;
+	relayHandlePADT(iface, packet, size, vlan);
 	break;
     case CODE_PADI:
-	relayHandlePADI(iface, &packet, size);
+	iface->discPackets[DISC_STAT_PADI]++;
+	if (indexPacket(packet, &tags) < 0) break;
+	relayHandlePADI(iface, packet, size, vlan, &tags);
 	break;
     case CODE_PADO:
-	relayHandlePADO(iface, &packet, size);
+	iface->discPackets[DISC_STAT_PADO]++;
+	if (indexPacket(packet, &tags) < 0) break;
+	relayHandlePADO(iface, packet, size, vlan, &tags);
 	break;
     case CODE_PADR:
-	relayHandlePADR(iface, &packet, size);
+	iface->discPackets[DISC_STAT_PADR]++;
+	if (indexPacket(packet, &tags) < 0) break;
+	relayHandlePADR(iface, packet, size, vlan, &tags);
 	break;
     case CODE_PADS:
-	relayHandlePADS(iface, &packet, size);
+	iface->discPackets[DISC_STAT_PADS]++;
+	if (indexPacket(packet, &tags) < 0) break;
+	relayHandlePADS(iface, packet, size, vlan, &tags);
 	break;
     default:
+	iface->discPackets[DISC_STAT_OTHER]++;
 	syslog(LOG_ERR, "Discovery packet on %s with unknown code %d",
-	       iface->name, (int) packet.code);
+	       iface->name, (int) packet->code);
     }
 }
 
 /**********************************************************************
-*%FUNCTION: relayGotSessionPacket
+*%FUNCTION: relaySessionFrame
 *%ARGUMENTS:
-* iface -- interface on which packet is waiting
+* iface -- interface on which packet was received
+* packet -- the packet
+* size -- size of packet in bytes
+* vlan -- VLAN tags the packet arrived with
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
-* Receives and processes a session packet.
+* Processes a session packet.
 ***********************************************************************/
 void
-relayGotSessionPacket(PPPoEInterface const *iface)
+relaySessionFrame(PPPoEInterface *iface, PPPoEPacket *packet, int size,
+		  VlanTags const *vlan)
 {
-    PPPoEPacket packet;
-    int size;
     SessionHash *sh;
     PPPoESession *ses;
-
-    if (receivePacket(iface->sessionSock, &packet, &size) < 0) {
-	return;
-    }
+    int dir;
 
     /* Ignore unknown code/version */
-    if (PPPOE_VER(packet.vertype) != 1 || PPPOE_TYPE(packet.vertype) != 1) {
+    if (PPPOE_VER(packet->vertype) != 1 || PPPOE_TYPE(packet->vertype) != 1) {
 	return;
     }
 
     /* Must be a session packet */
-    if (packet.code != CODE_SESS) {
-	syslog(LOG_ERR, "Session packet with code %d", (int) packet.code);
+    if (packet->code != CODE_SESS) {
+	syslog(LOG_ERR, "Session packet with code %d", (int) packet->code);
 	return;
     }
 
     /* Ignore session packets whose destination address isn't ours */
-    if (memcmp(packet.ethHdr.h_dest, iface->mac, ETH_ALEN)) {
+    if (memcmp(packet->ethHdr.h_dest, iface->mac, ETH_ALEN)) {
 	return;
     }
 
     /* Validate length */
-    if (ntohs(packet.length) + HDR_SIZE > size) {
+    if (ntohs(packet->length) + HDR_SIZE > size) {
 	syslog(LOG_ERR, "Bogus PPPoE length field (%u)",
-	       (unsigned int) ntohs(packet.length));
+	       (unsigned int) ntohs(packet->length));
 	return;
     }
 
     /* Drop Ethernet frame padding */
-    if (size > ntohs(packet.length) + HDR_SIZE) {
-	size = ntohs(packet.length) + HDR_SIZE;
+    if (size > ntohs(packet->length) + HDR_SIZE) {
+	size = ntohs(packet->length) + HDR_SIZE;
     }
 
     /* We're in business!  Find the hash */
-    sh = findSession(packet.ethHdr.h_source, packet.session);
-    if (!sh) {
+    sh = findSession(packet->ethHdr.h_source, packet->session);
+    if (!sh || sh->interface != iface ||
+	(iface->trunk && !vlanEqual(&sh->vlan, vlan))) {
 	/* Don't log this.  Someone could be running the client and the
 	   relay on the same box. */
+	iface->sessUnknown++;
 	return;
     }
 
     /* Relay it */
     ses = sh->ses;
+    dir = (sh == ses->acHash) ? FROM_AC : FROM_CLIENT;
     ses->epoch = Epoch;
+    ses->packets[dir]++;
+    ses->bytes[dir] += size;
+    iface->sessPacketsIn++;
+    iface->sessBytesIn += size;
     sh = sh->peer;
-    packet.session = sh->sesNum;
-    memcpy(packet.ethHdr.h_source, sh->interface->mac, ETH_ALEN);
-    memcpy(packet.ethHdr.h_dest, sh->peerMac, ETH_ALEN);
-#if 0
-    fprintf(stderr, "Relaying %02x:%02x:%02x:%02x:%02x:%02x(%s:%d) to %02x:%02x:%02x:%02x:%02x:%02x(%s:%d)\n",
-	    sh->peer->peerMac[0], sh->peer->peerMac[1], sh->peer->peerMac[2],
-	    sh->peer->peerMac[3], sh->peer->peerMac[4], sh->peer->peerMac[5],
-	    sh->peer->interface->name, ntohs(sh->peer->sesNum),
-	    sh->peerMac[0], sh->peerMac[1], sh->peerMac[2],
-	    sh->peerMac[3], sh->peerMac[4], sh->peerMac[5],
-	    sh->interface->name, ntohs(sh->sesNum));
-#endif
-    sendPacket(NULL, sh->interface->sessionSock, &packet, size);
+    sh->interface->sessPacketsOut++;
+    sh->interface->sessBytesOut += size;
+    packet->session = sh->sesNum;
+    memcpy(packet->ethHdr.h_source, sh->interface->mac, ETH_ALEN);
+    memcpy(packet->ethHdr.h_dest, sh->peerMac, ETH_ALEN);
+    relaySend(sh->interface->sessionSock, packet, size, &sh->vlan);
 }
 
 /**********************************************************************
@@ -927,15 +1606,18 @@ relayGotSessionPacket(PPPoEInterface const *iface)
 *%ARGUMENTS:
 * iface -- interface on which packet was received
 * packet -- the PADT packet
+* size -- size of packet in bytes
+* vlan -- VLAN tags the packet arrived with
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
 * Receives and processes a PADT packet.
 ***********************************************************************/
 void
-relayHandlePADT(PPPoEInterface const *iface,
+relayHandlePADT(PPPoEInterface *iface,
 		PPPoEPacket *packet,
-		int size)
+		int size,
+		VlanTags const *vlan)
 {
     SessionHash *sh;
     PPPoESession *ses;
@@ -946,7 +1628,8 @@ relayHandlePADT(PPPoEInterface const *iface,
     }
 
     sh = findSession(packet->ethHdr.h_source, packet->session);
-    if (!sh) {
+    if (!sh || sh->interface != iface ||
+	(iface->trunk && !vlanEqual(&sh->vlan, vlan))) {
 	return;
     }
     /* Relay the PADT to the peer */
@@ -955,7 +1638,7 @@ relayHandlePADT(PPPoEInterface const *iface,
     packet->session = sh->sesNum;
     memcpy(packet->ethHdr.h_source, sh->interface->mac, ETH_ALEN);
     memcpy(packet->ethHdr.h_dest, sh->peerMac, ETH_ALEN);
-    sendPacket(NULL, sh->interface->sessionSock, packet, size);
+    relaySend(sh->interface->sessionSock, packet, size, &sh->vlan);
 
     /* Destroy the session */
     freeSession(ses, "Received PADT");
@@ -966,15 +1649,20 @@ relayHandlePADT(PPPoEInterface const *iface,
 *%ARGUMENTS:
 * iface -- interface on which packet was received
 * packet -- the PADI packet
+* size -- size of packet in bytes
+* vlan -- VLAN tags the packet arrived with
+* tags -- tags of "packet", indexed
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
 * Receives and processes a PADI packet.
 ***********************************************************************/
 void
-relayHandlePADI(PPPoEInterface const *iface,
+relayHandlePADI(PPPoEInterface *iface,
 		PPPoEPacket *packet,
-		int size)
+		int size,
+		VlanTags const *vlan,
+		TagIndex const *tags)
 {
     PPPoETag tag;
     unsigned char *loc;
@@ -1027,12 +1715,13 @@ relayHandlePADI(PPPoEInterface const *iface,
     /* Get array index of interface */
     ifIndex = iface - Interfaces;
 
-    loc = findTag(packet, TAG_RELAY_SESSION_ID, &tag);
+    loc = indexTag(tags, TAG_RELAY_SESSION_ID, &tag);
     if (!loc) {
 	tag.type = htons(TAG_RELAY_SESSION_ID);
 	tag.length = htons(MY_RELAY_TAG_LEN);
 	memcpy(tag.payload, &ifIndex, sizeof(ifIndex));
-	memcpy(tag.payload+sizeof(ifIndex), packet->ethHdr.h_source, ETH_ALEN);
+	memcpy(RELAY_TAG_MAC(tag.payload), packet->ethHdr.h_source, ETH_ALEN);
+	memcpy(RELAY_TAG_VLAN(tag.payload), vlan, sizeof(VlanTags));
 	/* Add a relay tag if there's room */
 	r = addTag(packet, &tag);
 	if (r < 0) return;
@@ -1060,20 +1749,26 @@ relayHandlePADI(PPPoEInterface const *iface,
 *%ARGUMENTS:
 * iface -- interface on which packet was received
 * packet -- the PADO packet
+* size -- size of packet in bytes
+* vlan -- VLAN tags the packet arrived with
+* tags -- tags of "packet", indexed
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
 * Receives and processes a PADO packet.
 ***********************************************************************/
 void
-relayHandlePADO(PPPoEInterface const *iface,
+relayHandlePADO(PPPoEInterface *iface,
 		PPPoEPacket *packet,
-		int size)
+		int size,
+		VlanTags const *vlan,
+		TagIndex const *tags)
 {
     PPPoETag tag;
     unsigned char *loc;
     int ifIndex;
     int acIndex;
+    VlanTags peerVlan;
 
     /* Can a server legally be behind this interface? */
     if (!iface->acOK) {
@@ -1111,7 +1806,7 @@ relayHandlePADO(PPPoEInterface const *iface,
     }
 
     /* Find relay tag */
-    loc = findTag(packet, TAG_RELAY_SESSION_ID, &tag);
+    loc = indexTag(tags, TAG_RELAY_SESSION_ID, &tag);
     if (!loc) {
 	syslog(LOG_ERR,
 	       "PADO packet from %02x:%02x:%02x:%02x:%02x:%02x on interface %s does not have Relay-Session-Id tag",
@@ -1139,12 +1834,14 @@ relayHandlePADO(PPPoEInterface const *iface,
 	return;
     }
 
-    /* Extract interface index */
+    /* Extract interface index and peer's VLAN tags */
     memcpy(&ifIndex, tag.payload, sizeof(ifIndex));
+    memcpy(&peerVlan, RELAY_TAG_VLAN(tag.payload), sizeof(peerVlan));
 
     if (ifIndex < 0 || ifIndex >= NumInterfaces ||
 	!Interfaces[ifIndex].clientOK ||
-	iface == &Interfaces[ifIndex]) {
+	iface == &Interfaces[ifIndex] ||
+	!vlanValid(&Interfaces[ifIndex], &peerVlan)) {
 	syslog(LOG_ERR,
 	       "PADO packet from %02x:%02x:%02x:%02x:%02x:%02x on interface %s has invalid interface in Relay-Session-Id tag",
 	       packet->ethHdr.h_source[0],
@@ -1159,16 +1856,17 @@ relayHandlePADO(PPPoEInterface const *iface,
 
     /* Replace Relay-ID tag with opposite-direction tag */
     memcpy(loc+TAG_HDR_SIZE, &acIndex, sizeof(acIndex));
-    memcpy(loc+TAG_HDR_SIZE+sizeof(ifIndex), packet->ethHdr.h_source, ETH_ALEN);
+    memcpy(RELAY_TAG_MAC(loc+TAG_HDR_SIZE), packet->ethHdr.h_source, ETH_ALEN);
+    memcpy(RELAY_TAG_VLAN(loc+TAG_HDR_SIZE), vlan, sizeof(VlanTags));
 
     /* Set destination address to MAC address in relay ID */
-    memcpy(packet->ethHdr.h_dest, tag.payload + sizeof(ifIndex), ETH_ALEN);
+    memcpy(packet->ethHdr.h_dest, RELAY_TAG_MAC(tag.payload), ETH_ALEN);
 
     /* Set source address to MAC address of interface */
     memcpy(packet->ethHdr.h_source, Interfaces[ifIndex].mac, ETH_ALEN);
 
     /* Send the PADO to the proper client */
-    sendPacket(NULL, Interfaces[ifIndex].discoverySock, packet, size);
+    relaySend(Interfaces[ifIndex].discoverySock, packet, size, &peerVlan);
 }
 
 /**********************************************************************
@@ -1176,20 +1874,26 @@ relayHandlePADO(PPPoEInterface const *iface,
 *%ARGUMENTS:
 * iface -- interface on which packet was received
 * packet -- the PADR packet
+* size -- size of packet in bytes
+* vlan -- VLAN tags the packet arrived with
+* tags -- tags of "packet", indexed
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
 * Receives and processes a PADR packet.
 ***********************************************************************/
 void
-relayHandlePADR(PPPoEInterface const *iface,
+relayHandlePADR(PPPoEInterface *iface,
 		PPPoEPacket *packet,
-		int size)
+		int size,
+		VlanTags const *vlan,
+		TagIndex const *tags)
 {
     PPPoETag tag;
     unsigned char *loc;
     int ifIndex;
     int cliIndex;
+    VlanTags peerVlan;
 
     /* Can a client legally be behind this interface? */
     if (!iface->clientOK) {
@@ -1227,7 +1931,7 @@ relayHandlePADR(PPPoEInterface const *iface,
     }
 
     /* Find relay tag */
-    loc = findTag(packet, TAG_RELAY_SESSION_ID, &tag);
+    loc = indexTag(tags, TAG_RELAY_SESSION_ID, &tag);
     if (!loc) {
 	syslog(LOG_ERR,
 	       "PADR packet from %02x:%02x:%02x:%02x:%02x:%02x on interface %s does not have Relay-Session-Id tag",
@@ -1255,12 +1959,14 @@ relayHandlePADR(PPPoEInterface const *iface,
 	return;
     }
 
-    /* Extract interface index */
+    /* Extract interface index and peer's VLAN tags */
     memcpy(&ifIndex, tag.payload, sizeof(ifIndex));
+    memcpy(&peerVlan, RELAY_TAG_VLAN(tag.payload), sizeof(peerVlan));
 
     if (ifIndex < 0 || ifIndex >= NumInterfaces ||
 	!Interfaces[ifIndex].acOK ||
-	iface == &Interfaces[ifIndex]) {
+	iface == &Interfaces[ifIndex] ||
+	!vlanValid(&Interfaces[ifIndex], &peerVlan)) {
 	syslog(LOG_ERR,
 	       "PADR packet from %02x:%02x:%02x:%02x:%02x:%02x on interface %s has invalid interface in Relay-Session-Id tag",
 	       packet->ethHdr.h_source[0],
@@ -1275,16 +1981,17 @@ relayHandlePADR(PPPoEInterface const *iface,
 
     /* Replace Relay-ID tag with opposite-direction tag */
     memcpy(loc+TAG_HDR_SIZE, &cliIndex, sizeof(cliIndex));
-    memcpy(loc+TAG_HDR_SIZE+sizeof(ifIndex), packet->ethHdr.h_source, ETH_ALEN);
+    memcpy(RELAY_TAG_MAC(loc+TAG_HDR_SIZE), packet->ethHdr.h_source, ETH_ALEN);
+    memcpy(RELAY_TAG_VLAN(loc+TAG_HDR_SIZE), vlan, sizeof(VlanTags));
 
     /* Set destination address to MAC address in relay ID */
-    memcpy(packet->ethHdr.h_dest, tag.payload + sizeof(ifIndex), ETH_ALEN);
+    memcpy(packet->ethHdr.h_dest, RELAY_TAG_MAC(tag.payload), ETH_ALEN);
 
     /* Set source address to MAC address of interface */
     memcpy(packet->ethHdr.h_source, Interfaces[ifIndex].mac, ETH_ALEN);
 
     /* Send the PADR to the proper access concentrator */
-    sendPacket(NULL, Interfaces[ifIndex].discoverySock, packet, size);
+    relaySend(Interfaces[ifIndex].discoverySock, packet, size, &peerVlan);
 }
 
 /**********************************************************************
@@ -1292,19 +1999,25 @@ relayHandlePADR(PPPoEInterface const *iface,
 *%ARGUMENTS:
 * iface -- interface on which packet was received
 * packet -- the PADS packet
+* size -- size of packet in bytes
+* vlan -- VLAN tags the packet arrived with
+* tags -- tags of "packet", indexed
 *%RETURNS:
 * Nothing
 *%DESCRIPTION:
 * Receives and processes a PADS packet.
 ***********************************************************************/
 void
-relayHandlePADS(PPPoEInterface const *iface,
+relayHandlePADS(PPPoEInterface *iface,
 		PPPoEPacket *packet,
-		int size)
+		int size,
+		VlanTags const *vlan,
+		TagIndex const *tags)
 {
     PPPoETag tag;
     unsigned char *loc;
     int ifIndex;
+    VlanTags peerVlan;
 
     PPPoESession *ses = NULL;
     SessionHash *sh;
@@ -1343,7 +2056,7 @@ relayHandlePADS(PPPoEInterface const *iface,
     }
 
     /* Find relay tag */
-    loc = findTag(packet, TAG_RELAY_SESSION_ID, &tag);
+    loc = indexTag(tags, TAG_RELAY_SESSION_ID, &tag);
     if (!loc) {
 	syslog(LOG_ERR,
 	       "PADS packet from %02x:%02x:%02x:%02x:%02x:%02x on interface %s does not have Relay-Session-Id tag",
@@ -1371,12 +2084,14 @@ relayHandlePADS(PPPoEInterface const *iface,
 	return;
     }
 
-    /* Extract interface index */
+    /* Extract interface index and peer's VLAN tags */
     memcpy(&ifIndex, tag.payload, sizeof(ifIndex));
+    memcpy(&peerVlan, RELAY_TAG_VLAN(tag.payload), sizeof(peerVlan));
 
     if (ifIndex < 0 || ifIndex >= NumInterfaces ||
 	!Interfaces[ifIndex].clientOK ||
-	iface == &Interfaces[ifIndex]) {
+	iface == &Interfaces[ifIndex] ||
+	!vlanValid(&Interfaces[ifIndex], &peerVlan)) {
 	syslog(LOG_ERR,
 	       "PADS packet from %02x:%02x:%02x:%02x:%02x:%02x on interface %s has invalid interface in Relay-Session-Id tag",
 	       packet->ethHdr.h_source[0],
@@ -1406,21 +2121,22 @@ relayHandlePADS(PPPoEInterface const *iface,
 	    /* Create a new session */
 	    ses = createSession(iface, &Interfaces[ifIndex],
 				packet->ethHdr.h_source,
-				loc + TAG_HDR_SIZE + sizeof(ifIndex), packet->session);
+				RELAY_TAG_MAC(tag.payload), &peerVlan,
+				packet->session);
 	    if (!ses) {
 		/* Can't allocate session -- send error PADS to client and
 		   PADT to server */
 		PPPoETag hostUniq, *hu;
-		if (findTag(packet, TAG_HOST_UNIQ, &hostUniq)) {
+		if (indexTag(tags, TAG_HOST_UNIQ, &hostUniq)) {
 		    hu = &hostUniq;
 		} else {
 		    hu = NULL;
 		}
 		relaySendError(CODE_PADS, htons(0), &Interfaces[ifIndex],
-			       loc + TAG_HDR_SIZE + sizeof(ifIndex),
+			       RELAY_TAG_MAC(tag.payload), &peerVlan,
 			       hu, "RP-PPPoE: Relay: Unable to allocate session");
 		relaySendError(CODE_PADT, packet->session, iface,
-			       packet->ethHdr.h_source, NULL,
+			       packet->ethHdr.h_source, vlan, NULL,
 			       "RP-PPPoE: Relay: Unable to allocate session");
 		return;
 	    }
@@ -1434,13 +2150,13 @@ relayHandlePADS(PPPoEInterface const *iface,
     size -= (MY_RELAY_TAG_LEN + TAG_HDR_SIZE);
 
     /* Set destination address to MAC address in relay ID */
-    memcpy(packet->ethHdr.h_dest, tag.payload + sizeof(ifIndex), ETH_ALEN);
+    memcpy(packet->ethHdr.h_dest, RELAY_TAG_MAC(tag.payload), ETH_ALEN);
 
     /* Set source address to MAC address of interface */
     memcpy(packet->ethHdr.h_source, Interfaces[ifIndex].mac, ETH_ALEN);
 
     /* Send the PADS to the proper client */
-    sendPacket(NULL, Interfaces[ifIndex].discoverySock, packet, size);
+    relaySend(Interfaces[ifIndex].discoverySock, packet, size, &peerVlan);
 }
 
 /**********************************************************************
@@ -1450,6 +2166,7 @@ relayHandlePADS(PPPoEInterface const *iface,
 * session -- PPPoE session number
 * iface -- interface on which to send frame
 * mac -- Ethernet address to which frame should be sent
+* vlan -- VLAN tags to push, or NULL
 * hostUniq -- if non-NULL, a hostUniq tag to add to error frame
 * errMsg -- error message to insert into Generic-Error tag.
 *%RETURNS:
@@ -1463,6 +2180,7 @@ relaySendError(unsigned char code,
 	       uint16_t session,
 	       PPPoEInterface const *iface,
 	       unsigned char const *mac,
+	       VlanTags const *vlan,
 	       PPPoETag const *hostUniq,
 	       char const *errMsg)
 {
@@ -1486,32 +2204,9 @@ relaySendError(unsigned char code,
     if (addTag(&packet, &errTag) < 0) return;
     size = ntohs(packet.length) + HDR_SIZE;
     if (code == CODE_PADT) {
-	sendPacket(NULL, iface->discoverySock, &packet, size);
+	relaySend(iface->discoverySock, &packet, size, vlan);
     } else {
-	sendPacket(NULL, iface->sessionSock, &packet, size);
-    }
-}
-
-/**********************************************************************
-*%FUNCTION: alarmHandler
-*%ARGUMENTS:
-* sig -- signal number
-*%RETURNS:
-* Nothing
-*%DESCRIPTION:
-* SIGALRM handler.  Increments Epoch; if necessary, writes a byte of
-* data to the alarm pipe to trigger the stale-session cleaner.
-***********************************************************************/
-void
-alarmHandler(int sig)
-{
-    alarm(1);
-    Epoch++;
-    CleanCounter++;
-    if (CleanCounter == CleanPeriod) {
-#pragma GCC diagnostic ignored "-Wunused-result"      
-	write(CleanPipe[1], "", 1);
-#pragma GCC diagnostic warning "-Wunused-result"      
+	relaySend(iface->sessionSock, &packet, size, vlan);
     }
 }
 
@@ -1535,14 +2230,465 @@ void cleanSessions(void)
 	    /* Send PADT to each peer */
 	    relaySendError(CODE_PADT, cur->acHash->sesNum,
 			   cur->acHash->interface,
-			   cur->acHash->peerMac, NULL,
+			   cur->acHash->peerMac, &cur->acHash->vlan, NULL,
 			   "RP-PPPoE: Relay: Session exceeded idle timeout");
 	    relaySendError(CODE_PADT, cur->clientHash->sesNum,
 			   cur->clientHash->interface,
-			   cur->clientHash->peerMac, NULL,
+			   cur->clientHash->peerMac, &cur->clientHash->vlan, NULL,
 			   "RP-PPPoE: Relay: Session exceeded idle timeout");
 	    freeSession(cur, "Idle Timeout");
 	}
 	cur = next;
     }
 }
+
+/**********************************************************************
+*%FUNCTION: acctOpen
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* 0 on success, -1 on failure
+*%DESCRIPTION:
+* Opens (or re-opens) the accounting file for appending.
+***********************************************************************/
+static int
+acctOpen(void)
+{
+    struct stat sbuf;
+
+    AcctFd = open(AcctPath, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+    if (AcctFd < 0) {
+	syslog(LOG_ERR, "Cannot open accounting file %s: %s",
+	       AcctPath, strerror(errno));
+	return -1;
+    }
+    if (fstat(AcctFd, &sbuf) == 0) {
+	AcctFileSize = sbuf.st_size;
+    } else {
+	AcctFileSize = 0;
+    }
+    return 0;
+}
+
+/**********************************************************************
+*%FUNCTION: acctRotate
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Renames the accounting file to <path>.YYYYmmddHHMMSS and starts a new
+* one.  Old files are never overwritten, so a collector can pick them
+* up at leisure: if that name is taken (two rotations in one second),
+* a ".N" suffix is added.  link() fails rather than replacing an
+* existing file, which rename() would not.
+***********************************************************************/
+static void
+acctRotate(void)
+{
+    char newname[4096];
+    char stamp[32];
+    time_t now = time(NULL);
+    int seq, r;
+
+    strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", localtime(&now));
+    close(AcctFd);
+    AcctFd = -1;
+    for (seq=0; seq<1000; seq++) {
+	if (seq) {
+	    snprintf(newname, sizeof(newname), "%s.%s.%d", AcctPath, stamp, seq);
+	} else {
+	    snprintf(newname, sizeof(newname), "%s.%s", AcctPath, stamp);
+	}
+	r = link(AcctPath, newname);
+	if (r == 0 || errno != EEXIST) break;
+    }
+    if (r < 0) {
+	syslog(LOG_ERR, "Cannot rename accounting file %s to %s: %s",
+	       AcctPath, newname, strerror(errno));
+    } else if (unlink(AcctPath) < 0) {
+	syslog(LOG_ERR, "Cannot remove accounting file %s after rotation: %s",
+	       AcctPath, strerror(errno));
+    }
+    acctOpen();
+}
+
+/**********************************************************************
+*%FUNCTION: acctFlush
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Writes all buffered accounting records and rotates the file if it has
+* grown past the rotation size.  Records are removed from the buffer only
+* once they are on disk; if a write fails part-way, the file is truncated
+* back to the last whole record so later records stay aligned, and the
+* unwritten records are kept for the next flush.
+***********************************************************************/
+void
+acctFlush(void)
+{
+    size_t len = AcctCount * sizeof(AcctRecord);
+    size_t done = 0;
+    ssize_t r;
+    int whole;
+
+    if (!AcctCount) return;
+
+    if (AcctFd < 0 && acctOpen() < 0) {
+	return;
+    }
+
+    while (done < len) {
+	r = write(AcctFd, (char *) AcctBuffer + done, len - done);
+	if (r < 0 && errno == EINTR) continue;
+	if (r <= 0) {
+	    syslog(LOG_ERR, "Error writing accounting file %s: %s",
+		   AcctPath, r < 0 ? strerror(errno) : "nothing written");
+	    break;
+	}
+	done += r;
+    }
+
+    whole = done / sizeof(AcctRecord);
+    if (done < len) {
+	if (done % sizeof(AcctRecord) &&
+	    ftruncate(AcctFd, AcctFileSize + whole * sizeof(AcctRecord)) < 0) {
+	    syslog(LOG_ERR, "Cannot truncate partial record in accounting file %s: %s",
+		   AcctPath, strerror(errno));
+	}
+	memmove(AcctBuffer, AcctBuffer + whole,
+		(AcctCount - whole) * sizeof(AcctRecord));
+    }
+    AcctCount -= whole;
+    AcctFileSize += whole * sizeof(AcctRecord);
+
+    if (AcctRotateSize && AcctFileSize >= AcctRotateSize) {
+	acctRotate();
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: acctSession
+*%ARGUMENTS:
+* ses -- a session
+* type -- ACCT_INTERIM or ACCT_STOP
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Queues an accounting record for "ses", flushing the batch if it is full.
+***********************************************************************/
+void
+acctSession(PPPoESession const *ses, int type)
+{
+    AcctRecord *rec;
+    int i;
+
+    if (AcctCount >= ACCT_BATCH) {
+	acctFlush();
+	if (AcctCount >= ACCT_BATCH) {
+	    syslog(LOG_ERR, "Accounting buffer full; dropping record for session %d",
+		   (int) ntohs(ses->acHash->sesNum));
+	    return;
+	}
+    }
+    rec = &AcctBuffer[AcctCount++];
+    memset(rec, 0, sizeof(*rec));
+    rec->version = ACCT_RECORD_VERSION;
+    rec->type = type;
+    rec->acSesNum = ses->acHash->sesNum;
+    rec->clientSesNum = ses->clientHash->sesNum;
+    memcpy(rec->acMac, ses->acHash->peerMac, ETH_ALEN);
+    memcpy(rec->clientMac, ses->clientHash->peerMac, ETH_ALEN);
+    for (i=0; i<ses->clientHash->vlan.count; i++) {
+	rec->clientVlan[i] = htons(ses->clientHash->vlan.tci[i] & 0x0FFF);
+    }
+    rp_strlcpy(rec->acIfName, ses->acHash->interface->name, sizeof(rec->acIfName));
+    rp_strlcpy(rec->clientIfName, ses->clientHash->interface->name, sizeof(rec->clientIfName));
+    rec->startTime = htobe64((uint64_t) ses->startTime);
+    rec->recordTime = htobe64((uint64_t) time(NULL));
+    for (i=0; i<2; i++) {
+	rec->packets[i] = htobe64(ses->packets[i]);
+	rec->bytes[i] = htobe64(ses->bytes[i]);
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: acctTimer
+*%ARGUMENTS:
+* es -- event selector
+* fd, flags -- ignored
+* data -- ignored
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Periodic exporter.  Queues an interim record for every active session,
+* flushes the batch and re-arms itself.
+***********************************************************************/
+static void
+acctTimer(EventSelector *es, int fd, unsigned int flags, void *data)
+{
+    PPPoESession *ses;
+    struct timeval t;
+
+    for (ses = ActiveSessions; ses; ses = ses->next) {
+	acctSession(ses, ACCT_INTERIM);
+    }
+    acctFlush();
+
+    t.tv_sec = AcctInterval;
+    t.tv_usec = 0;
+    if (!Event_AddTimerHandler(es, t, acctTimer, NULL)) {
+	syslog(LOG_ERR, "Cannot re-arm accounting timer -- accounting export stopped");
+    }
+}
+
+/**********************************************************************
+*%FUNCTION: acctTermHandler
+*%ARGUMENTS:
+* sig -- signal number
+*%RETURNS:
+* Nothing -- exits
+*%DESCRIPTION:
+* Called by SIGTERM or SIGINT.  Writes a final interim record for each
+* active session so no traffic goes unaccounted, then exits.
+***********************************************************************/
+static void
+acctTermHandler(int sig)
+{
+    PPPoESession *ses;
+
+    syslog(LOG_INFO, "Terminating on signal %d -- flushing accounting records", sig);
+    for (ses = ActiveSessions; ses; ses = ses->next) {
+	acctSession(ses, ACCT_INTERIM);
+    }
+    acctFlush();
+    exit(EXIT_SUCCESS);
+}
+
+/**********************************************************************
+*%FUNCTION: acctInit
+*%ARGUMENTS:
+* path -- accounting file
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Opens the accounting file and starts the periodic exporter.  Exits
+* on failure.
+***********************************************************************/
+void
+acctInit(char const *path)
+{
+    struct timeval t;
+
+    if (sizeof(AcctRecord) != ACCT_RECORD_SIZE) {
+	rp_fatal("Internal error: accounting record has unexpected size");
+    }
+
+    AcctPath = path;
+    if (acctOpen() < 0) {
+	rp_fatal("Cannot open accounting file");
+    }
+
+    t.tv_sec = AcctInterval;
+    t.tv_usec = 0;
+    if (!Event_AddTimerHandler(event_selector, t, acctTimer, NULL)) {
+	fatalSys("Event_AddTimerHandler");
+    }
+    if (Event_HandleSignal(event_selector, SIGTERM, acctTermHandler) < 0 ||
+	Event_HandleSignal(event_selector, SIGINT, acctTermHandler) < 0) {
+	fatalSys("Event_HandleSignal");
+    }
+}
+
+/**********************************************************************
+* %FUNCTION: handle_status
+***********************************************************************/
+#define opt_matches(o)		(wlen == 0 || strncmp(opt, o, wlen) == 0)
+#define opt_outp(o, fmt, ...)	cs_ret_printf(client, "%20s: " fmt "\n", o, ## __VA_ARGS__)
+#define opt_status(o, fmt, ...)	do { if (opt_matches(o)) { opt_outp(o, fmt, ## __VA_ARGS__); }} while(0)
+
+static int handle_status(ClientConnection *client, const char* const* argv, int argi, void* pvt, void* clientpvt)
+{
+    char opt[64]; /* WARNING: may not be null terminated!!!! */
+    size_t wlen = 0;
+    while (wlen < sizeof(opt) && argv[argi]) {
+	int r = snprintf(&opt[wlen], sizeof(opt) - wlen, "%s ", argv[argi++]);
+	if (r < 0) {
+	    syslog(LOG_WARNING, "snprintf error: %s", strerror(errno));
+	    return -1;
+	}
+	wlen += r;
+    }
+    if (wlen > sizeof(opt))
+	wlen = sizeof(opt);
+    if (wlen && opt[wlen-1] == ' ')
+	--wlen;
+
+    opt_status("active sessions", "%d", NumSessions);
+    opt_status("maximum sessions", "%d", MaxSessions);
+    opt_status("sessions opened", "%llu", SessionsOpened);
+    opt_status("sessions closed", "%llu", SessionsClosed);
+    opt_status("sessions refused", "%llu", SessionsRefused);
+    opt_status("interface count", "%d", NumInterfaces);
+    opt_status("server count", "%d", NumAcPeers);
+    opt_status("idle timeout", "%u", IdleTimeout);
+    cs_ret_printf(client, "-- end --\n");
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: handle_interfaces
+***********************************************************************/
+static int handle_interfaces(ClientConnection *client, const char* const* argv, int argi, void* pvt, void* clientpvt)
+{
+    int i;
+    PPPoEInterface *iface;
+
+    for (i = 0; i < NumInterfaces; ++i) {
+	iface = &Interfaces[i];
+	if (argv[argi] && strcmp(argv[argi], iface->name) != 0)
+	    continue;
+	cs_ret_printf(client, "Interface details: %s\n", iface->name);
+	opt_outp("local mac", "%02x:%02x:%02x:%02x:%02x:%02x",
+		 iface->mac[0], iface->mac[1], iface->mac[2],
+		 iface->mac[3], iface->mac[4], iface->mac[5]);
+	opt_outp("role", "%s", iface->clientOK ?
+		 (iface->acOK ? "both" : "client") : "server");
+	opt_outp("session packets in", "%llu", iface->sessPacketsIn);
+	opt_outp("session bytes in", "%llu", iface->sessBytesIn);
+	opt_outp("session packets out", "%llu", iface->sessPacketsOut);
+	opt_outp("session bytes out", "%llu", iface->sessBytesOut);
+	opt_outp("unknown session", "%llu", iface->sessUnknown);
+	opt_outp("PADI received", "%llu", iface->discPackets[DISC_STAT_PADI]);
+	opt_outp("PADO received", "%llu", iface->discPackets[DISC_STAT_PADO]);
+	opt_outp("PADR received", "%llu", iface->discPackets[DISC_STAT_PADR]);
+	opt_outp("PADS received", "%llu", iface->discPackets[DISC_STAT_PADS]);
+	opt_outp("PADT received", "%llu", iface->discPackets[DISC_STAT_PADT]);
+	opt_outp("other received", "%llu", iface->discPackets[DISC_STAT_OTHER]);
+    }
+    cs_ret_printf(client, "-- end --\n");
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: handle_hash
+***********************************************************************/
+static int handle_hash(ClientConnection *client, const char* const* argv, int argi, void* pvt, void* clientpvt)
+{
+    int i, len, used = 0, longest = 0, entries = 0;
+    SessionHash *sh;
+
+    for (i = 0; i < (int) HashSize; ++i) {
+	len = 0;
+	for (sh = Buckets[i]; sh; sh = sh->next)
+	    ++len;
+	if (len) {
+	    ++used;
+	    entries += len;
+	    if (len > longest)
+		longest = len;
+	}
+    }
+
+    opt_outp("buckets", "%u", HashSize);
+    opt_outp("buckets used", "%d", used);
+    opt_outp("entries", "%d", entries);
+    opt_outp("load factor", "%.3f", (double) entries / HashSize);
+    opt_outp("mean chain length", "%.3f", used ? (double) entries / used : 0.0);
+    opt_outp("longest chain", "%d", longest);
+    cs_ret_printf(client, "-- end --\n");
+    return 0;
+}
+
+#undef opt_status
+#undef opt_outp
+#undef opt_matches
+
+/**********************************************************************
+* %FUNCTION: sessionCompare
+* %DESCRIPTION:
+* qsort() comparator ordering sessions busiest first.
+***********************************************************************/
+static int sessionCompare(void const *a, void const *b)
+{
+    PPPoESession const *sa = *(PPPoESession * const *) a;
+    PPPoESession const *sb = *(PPPoESession * const *) b;
+    unsigned long long ba = sa->bytes[FROM_AC] + sa->bytes[FROM_CLIENT];
+    unsigned long long bb = sb->bytes[FROM_AC] + sb->bytes[FROM_CLIENT];
+    if (ba > bb) return -1;
+    if (ba < bb) return 1;
+    return 0;
+}
+
+/**********************************************************************
+* %FUNCTION: handle_sessions
+* %DESCRIPTION:
+* "show sessions [n]" -- lists active sessions, busiest first.  If n
+* is given, only the n busiest are listed.
+***********************************************************************/
+static int handle_sessions(ClientConnection *client, const char* const* argv, int argi, void* pvt, void* clientpvt)
+{
+    PPPoESession **list;
+    PPPoESession *ses;
+    SessionHash *ac, *cli;
+    char vlanStr[16];
+    int i, n = 0, limit = NumSessions;
+
+    if (argv[argi] && (sscanf(argv[argi], "%d", &limit) != 1 || limit < 0)) {
+	cs_ret_printf(client, "USAGE: show sessions [count]\n");
+	return 0;
+    }
+
+    if (NumSessions) {
+	list = malloc(NumSessions * sizeof(*list));
+	if (!list) {
+	    cs_ret_printf(client, "Out of memory\n");
+	    return 0;
+	}
+	for (ses = ActiveSessions; ses && n < NumSessions; ses = ses->next)
+	    list[n++] = ses;
+	qsort(list, n, sizeof(*list), sessionCompare);
+    } else {
+	list = NULL;
+    }
+
+    if (cs_printf(client, "%-17s %-8s %5s  %-17s %-8s %5s %-9s %10s %14s %10s %14s %6s %6s\n",
+		  "server", "if", "sess", "client", "if", "sess", "vlan",
+		  "pkts down", "bytes down", "pkts up", "bytes up", "idle", "age") < 0)
+	goto fail;
+    for (i = 0; i < n && i < limit; ++i) {
+	ses = list[i];
+	ac = ses->acHash;
+	cli = ses->clientHash;
+	if (cli->vlan.count == 2) {
+	    snprintf(vlanStr, sizeof(vlanStr), "%u.%u",
+		     cli->vlan.tci[0] & 0x0FFF, cli->vlan.tci[1] & 0x0FFF);
+	} else if (cli->vlan.count == 1) {
+	    snprintf(vlanStr, sizeof(vlanStr), "%u", cli->vlan.tci[0] & 0x0FFF);
+	} else {
+	    strcpy(vlanStr, "-");
+	}
+	if (cs_printf(client,
+		      "%02x:%02x:%02x:%02x:%02x:%02x %-8s %5u  "
+		      "%02x:%02x:%02x:%02x:%02x:%02x %-8s %5u %-9s %10llu %14llu %10llu %14llu %6u %6u\n",
+		      ac->peerMac[0], ac->peerMac[1], ac->peerMac[2],
+		      ac->peerMac[3], ac->peerMac[4], ac->peerMac[5],
+		      ac->interface->name, (unsigned int) ntohs(ac->sesNum),
+		      cli->peerMac[0], cli->peerMac[1], cli->peerMac[2],
+		      cli->peerMac[3], cli->peerMac[4], cli->peerMac[5],
+		      cli->interface->name, (unsigned int) ntohs(cli->sesNum), vlanStr,
+		      ses->packets[FROM_AC], ses->bytes[FROM_AC],
+		      ses->packets[FROM_CLIENT], ses->bytes[FROM_CLIENT],
+		      Epoch - ses->epoch, Epoch - ses->startEpoch) < 0)
+	    goto fail;
+    }
+    free(list);
+    cs_ret_printf(client, "-- end --\n");
+    return 0;
+
+fail:
+    free(list);
+    return -1;
+}
@@ -23,64 +23,159 @@
 #include <linux/if.h>
 #endif
 
+/* Indexes into the per-interface discovery counters */
+#define DISC_STAT_PADI  0
+#define DISC_STAT_PADO  1
+#define DISC_STAT_PADR  2
+#define DISC_STAT_PADS  3
+#define DISC_STAT_PADT  4
+#define DISC_STAT_OTHER 5
+#define DISC_STAT_COUNT 6
+
+/* VLAN tags carried by a frame on a trunk interface.  The outer tag is
+   reported by the kernel in PACKET_AUXDATA; a second (QinQ) tag is taken
+   from the frame itself.  Tags are pushed back on when transmitting. */
+#define MAX_VLAN_TAGS 2
+typedef struct VlanTagsStruct {
+    uint16_t count;		/* Number of tags: 0, 1 or 2 */
+    uint16_t tpid;		/* TPID of outer tag (0x8100 or 0x88a8) */
+    uint16_t tci[MAX_VLAN_TAGS]; /* TCIs, outermost first */
+} VlanTags;
+
 /* Description for each active Ethernet interface */
 typedef struct InterfaceStruct {
-    char name[IFNAMSIZ+1];	/* Interface name */
+    char name[IFNAME_MAX+1];	/* Interface name */
     int discoverySock;		/* Socket for discovery frames */
     int sessionSock;		/* Socket for session frames */
     int clientOK;		/* Client requests allowed (PADI, PADR) */
     int acOK;			/* AC replies allowed (PADO, PADS) */
+    int trunk;			/* VLAN-tagged client trunk.  A trunk has a
+				   single socket for all PPPoE frames, so
+				   discoverySock == sessionSock */
     unsigned char mac[ETH_ALEN]; /* MAC address */
+
+    /* Statistics */
+    unsigned long long sessPacketsIn;	/* Session frames relayed from here */
+    unsigned long long sessBytesIn;
+    unsigned long long sessPacketsOut;	/* Session frames relayed to here */
+    unsigned long long sessBytesOut;
+    unsigned long long sessUnknown;	/* Session frames for unknown sessions */
+    unsigned long long discPackets[DISC_STAT_COUNT]; /* Discovery frames received */
 } PPPoEInterface;
 
-/* Session state for relay */
+/* Traffic direction, used to index per-session counters */
+#define FROM_AC     0
+#define FROM_CLIENT 1
+
+/* An access concentrator, identified by MAC address and the interface
+   it is reached through.  Relay-assigned session numbers are allocated
+   from a separate 16-bit space for each one. */
+#define SESNUM_WORDS (65536 / 32)
+typedef struct AcPeerStruct {
+    struct AcPeerStruct *next;	/* Link in list of peers */
+    PPPoEInterface const *interface; /* Interface AC is behind */
+    unsigned char mac[ETH_ALEN]; /* AC's MAC address */
+    unsigned int numSessions;	/* Sessions currently through this AC */
+    unsigned int hint;		/* Where to start looking for a free number */
+    uint32_t used[SESNUM_WORDS]; /* Bitmap of session numbers in use */
+} AcPeer;
+
+/* Session state for relay.  The first group of fields is touched for
+   every relayed frame; sessions are cache-line aligned so that group
+   always lives in a single line. */
 struct SessionHashStruct;
 typedef struct SessionStruct {
-    struct SessionStruct *next;	/* Free list link */
-    struct SessionStruct *prev;	/* Free list link */
     struct SessionHashStruct *acHash; /* Hash bucket for AC MAC/Session */
-    struct SessionHashStruct *clientHash; /* Hash bucket for client MAC/Session */
     unsigned int epoch;		/* Epoch when last activity was seen */
     uint16_t sesNum;		/* Session number assigned by relay */
-} PPPoESession;
+    unsigned long long packets[2]; /* Frames relayed, by direction */
+    unsigned long long bytes[2];   /* Bytes relayed, by direction */
+
+    struct SessionStruct *next;	/* Free list link */
+    struct SessionStruct *prev;	/* Free list link */
+    struct SessionHashStruct *clientHash; /* Hash bucket for client MAC/Session */
+    AcPeer *acPeer;		/* AC whose number space sesNum is from */
+    unsigned int startEpoch;	/* Epoch when session was created */
+    time_t startTime;		/* Wall-clock time session was created */
+} __attribute__((aligned(64))) PPPoESession;
+
+/* Accounting record appended to the -a file.  Multi-byte fields are in
+   network byte order, and the layout has no implicit padding, so every
+   record is exactly ACCT_RECORD_SIZE bytes. */
+#define ACCT_RECORD_VERSION 1
+#define ACCT_RECORD_SIZE 104
+#define ACCT_INTERIM 1		/* Periodic update for an active session */
+#define ACCT_STOP    2		/* Final record for a closed session */
+
+typedef struct AcctRecordStruct {
+    uint8_t version;		/* ACCT_RECORD_VERSION */
+    uint8_t type;		/* ACCT_INTERIM or ACCT_STOP */
+    uint16_t acSesNum;		/* Session number seen by AC */
+    uint16_t clientSesNum;	/* Session number seen by client */
+    uint8_t acMac[ETH_ALEN];	/* AC's MAC address */
+    uint8_t clientMac[ETH_ALEN]; /* Client's MAC address */
+    uint16_t clientVlan[MAX_VLAN_TAGS]; /* Client's VLAN TCIs, 0 if none */
+    uint8_t reserved[2];	/* Zero */
+    char acIfName[16];		/* Interface facing the AC */
+    char clientIfName[16];	/* Interface facing the client */
+    uint64_t startTime;		/* Session start, seconds since the Epoch */
+    uint64_t recordTime;	/* Time of this record (end time for STOP) */
+    uint64_t packets[2];	/* Frames relayed, FROM_AC and FROM_CLIENT */
+    uint64_t bytes[2];		/* Bytes relayed, FROM_AC and FROM_CLIENT */
+} AcctRecord;
 
 /* Hash table entry to find sessions */
 typedef struct SessionHashStruct {
     struct SessionHashStruct *next; /* Link in hash chain */
     struct SessionHashStruct *prev; /* Link in hash chain */
     struct SessionHashStruct *peer; /* Peer for this session */
-    PPPoEInterface const *interface;	/* Interface */
+    PPPoEInterface *interface;	/* Interface */
     unsigned char peerMac[ETH_ALEN]; /* Peer's MAC address */
     uint16_t sesNum;		/* Session number */
     PPPoESession *ses;		/* Session data */
+    VlanTags vlan;		/* Peer's VLAN tags on a trunk interface */
 } SessionHash;
 
 /* Function prototypes */
 
-void relayGotSessionPacket(PPPoEInterface const *i);
-void relayGotDiscoveryPacket(PPPoEInterface const *i);
+void relayGotSessionPacket(PPPoEInterface *i);
+void relayGotDiscoveryPacket(PPPoEInterface *i);
+void relayGotTrunkPacket(PPPoEInterface *i);
+void relayDiscoveryFrame(PPPoEInterface *iface, PPPoEPacket *packet, int size,
+			 VlanTags const *vlan);
+void relaySessionFrame(PPPoEInterface *iface, PPPoEPacket *packet, int size,
+		       VlanTags const *vlan);
+int relayReceive(PPPoEInterface const *iface, int sock, PPPoEPacket *pkt,
+		 int *size, VlanTags *vlan);
+void relaySend(int sock, PPPoEPacket *pkt, int size, VlanTags const *vlan);
 PPPoEInterface *findInterface(int sock);
 unsigned int hash(unsigned char const *mac, uint16_t sesNum);
 SessionHash *findSession(unsigned char const *mac, uint16_t sesNum);
 void deleteHash(SessionHash *hash);
-PPPoESession *createSession(PPPoEInterface const *ac,
-			    PPPoEInterface const *cli,
+PPPoESession *createSession(PPPoEInterface *ac,
+			    PPPoEInterface *cli,
 			    unsigned char const *acMac,
 			    unsigned char const *cliMac,
+			    VlanTags const *cliVlan,
 			    uint16_t acSes);
 void freeSession(PPPoESession *ses, char const *msg);
-void addInterface(char const *ifname, int clientOK, int acOK);
+void addInterface(char const *ifname, int clientOK, int acOK, int trunk);
 void usage(char const *progname);
 void initRelay(int nsess);
 void relayLoop(void);
 void addHash(SessionHash *sh);
 void unhash(SessionHash *sh);
 
-void relayHandlePADT(PPPoEInterface const *iface, PPPoEPacket *packet, int size);
-void relayHandlePADI(PPPoEInterface const *iface, PPPoEPacket *packet, int size);
-void relayHandlePADO(PPPoEInterface const *iface, PPPoEPacket *packet, int size);
-void relayHandlePADR(PPPoEInterface const *iface, PPPoEPacket *packet, int size);
-void relayHandlePADS(PPPoEInterface const *iface, PPPoEPacket *packet, int size);
+void relayHandlePADT(PPPoEInterface *iface, PPPoEPacket *packet, int size,
+		     VlanTags const *vlan);
+void relayHandlePADI(PPPoEInterface *iface, PPPoEPacket *packet, int size,
+		     VlanTags const *vlan, TagIndex const *tags);
+void relayHandlePADO(PPPoEInterface *iface, PPPoEPacket *packet, int size,
+		     VlanTags const *vlan, TagIndex const *tags);
+void relayHandlePADR(PPPoEInterface *iface, PPPoEPacket *packet, int size,
+		     VlanTags const *vlan, TagIndex const *tags);
+void relayHandlePADS(PPPoEInterface *iface, PPPoEPacket *packet, int size,
+		     VlanTags const *vlan, TagIndex const *tags);
 
 int addTag(PPPoEPacket *packet, PPPoETag const *tag);
 int insertBytes(PPPoEPacket *packet, unsigned char *loc,
@@ -91,15 +186,21 @@ void relaySendError(unsigned char code,
 		    uint16_t session,
 		    PPPoEInterface const *iface,
 		    unsigned char const *mac,
+		    VlanTags const *vlan,
 		    PPPoETag const *hostUniq,
 		    char const *errMsg);
 
-void alarmHandler(int sig);
 void cleanSessions(void);
 
+void acctInit(char const *path);
+void acctSession(PPPoESession const *ses, int type);
+void acctFlush(void);
+
 #define MAX_INTERFACES 8
 #define DEFAULT_SESSIONS 5000
+#define MAX_SESSIONS (1 << 22)
 
-/* Hash table size -- a prime number; gives load factor of around 6
-   for 65534 sessions */
+/* Minimum hash table size -- a prime number.  The table is grown to a
+   prime of at least the session limit, keeping the load factor around 2
+   or better */
 #define HASHTAB_SIZE 18917
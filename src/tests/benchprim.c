@@ -0,0 +1,676 @@
+/***********************************************************************
+*
+* benchprim.c
+*
+* Micro-benchmarks for the per-packet primitives: FCS, async HDLC
+* encode/decode, MSS clamping and TCP checksums, discovery tag parsing,
+* cookie generation, relay session lookup and the event loop.
+*
+* Session data uses an IMIX-like mix of PPP payload sizes.  Results are
+* ns/op and, where an op has a byte count, cycles/byte (TSC cycles on
+* x86-64).  "-w FILE" records the results as a baseline; "-c FILE"
+* prints the change against one.  benchprim.baseline holds the numbers
+* the current code was tuned against; run "make bench" to compare.
+*
+* Copyright (C) 2018-2023 Dianne Skoll
+*
+***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "relay.h"
+#include "event.h"
+#include "md5.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+/* Minimum time to run each benchmark for */
+#define MIN_NS 200000000.0
+
+/* Frames in a workload; a power of two */
+#define NUM_FRAMES 1024
+
+/* Largest PPP payload (protocol plus IP datagram) on plain Ethernet */
+#define PPP_PAYLOAD (ETH_DATA_LEN - PPPOE_OVERHEAD)
+
+/* Relay sessions to look up */
+#define RELAY_SESSIONS 8192
+
+/* Results, in the order run */
+#define MAX_RESULTS 32
+static struct {
+    char name[32];
+    double nsPerOp;
+    double cyclesPerByte;	/* Negative if not meaningful */
+} Results[MAX_RESULTS];
+static int NumResults;
+
+/* IMIX-like payload mix: 7 small, 4 medium, 1 full-size */
+static unsigned char *Frames[NUM_FRAMES];
+static int FrameLen[NUM_FRAMES];
+
+/* Decoded frames from decodeFromPPP end up here */
+static unsigned long DecodedFrames;
+
+void
+sendSessionPacket(PPPoEConnection *conn, PPPoEPacket *packet, int len)
+{
+    DecodedFrames++;
+}
+
+void
+sendSessionPackets(PPPoEConnection *conn, PPPoEPacket *pkts,
+		   int const *lens, int n)
+{
+    DecodedFrames += n;
+}
+
+static double
+nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long long
+cycles(void)
+{
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**********************************************************************
+*%FUNCTION: record
+*%ARGUMENTS:
+* name -- benchmark name
+* ops -- operations done
+* bytes -- bytes processed by those operations, or 0
+* ns -- elapsed time
+* cyc -- elapsed TSC cycles
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Prints and stores one result.
+***********************************************************************/
+static void
+record(char const *name, double ops, double bytes, double ns, double cyc)
+{
+    double cpb = (bytes > 0 && cyc > 0) ? cyc / bytes : -1.0;
+
+    if (NumResults < MAX_RESULTS) {
+	snprintf(Results[NumResults].name, sizeof(Results[0].name), "%s", name);
+	Results[NumResults].nsPerOp = ns / ops;
+	Results[NumResults].cyclesPerByte = cpb;
+	NumResults++;
+    }
+    if (cpb >= 0) {
+	printf("%-24s %10.1f ns/op %8.3f cycles/byte\n", name, ns / ops, cpb);
+    } else {
+	printf("%-24s %10.1f ns/op\n", name, ns / ops);
+    }
+}
+
+/* Runs BODY (which must add to "ops" and "bytes") for at least MIN_NS */
+#define BENCH(name, body) do {						\
+    double ops = 0, bytes = 0, t0, t;					\
+    unsigned long long c0;						\
+    body;	/* Warm up */						\
+    ops = bytes = 0;							\
+    t0 = nowNs();							\
+    c0 = cycles();							\
+    do {								\
+	body;								\
+    } while ((t = nowNs() - t0) < MIN_NS);				\
+    record(name, ops, bytes, t, (double) (cycles() - c0));		\
+} while(0)
+
+/**********************************************************************
+*%FUNCTION: makeFrames
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Builds the session payload workload: random bytes behind an IPv4 PPP
+* protocol field, sized 7:4:1 as 40, 576 and full-size IP datagrams.
+***********************************************************************/
+static void
+makeFrames(void)
+{
+    static int const sizes[12] = { 40, 40, 40, 40, 40, 40, 40,
+				   576, 576, 576, 576, PPP_PAYLOAD - 2 };
+    int i, j;
+
+    for (i=0; i<NUM_FRAMES; i++) {
+	FrameLen[i] = sizes[rand() % 12] + 2;
+	Frames[i] = malloc(FrameLen[i]);
+	if (!Frames[i]) {
+	    perror("malloc");
+	    exit(EXIT_FAILURE);
+	}
+	Frames[i][0] = 0x00;
+	Frames[i][1] = 0x21;
+	for (j=2; j<FrameLen[i]; j++) {
+	    Frames[i][j] = (unsigned char) rand();
+	}
+    }
+}
+
+static void
+benchFCS(void)
+{
+    volatile uint16_t sink;
+    int i;
+
+    BENCH("pppFCS16", {
+	for (i=0; i<NUM_FRAMES; i++) {
+	    sink = pppFCS16(PPPINITFCS16, Frames[i], FrameLen[i]);
+	    bytes += FrameLen[i];
+	}
+	ops += NUM_FRAMES;
+    });
+    BENCH("pppFCS16Fast", {
+	for (i=0; i<NUM_FRAMES; i++) {
+	    sink = pppFCS16Fast(PPPINITFCS16, Frames[i], FrameLen[i]);
+	    bytes += FrameLen[i];
+	}
+	ops += NUM_FRAMES;
+    });
+    (void) sink;
+}
+
+/**********************************************************************
+*%FUNCTION: encodeFrame
+*%ARGUMENTS:
+* dst -- output buffer; must hold ASYNC_FRAME_LEN(len) bytes
+* src -- PPP payload
+* len -- its length
+*%RETURNS:
+* Length of the async HDLC frame written to dst, as pppd would send it
+***********************************************************************/
+static int
+encodeFrame(unsigned char *dst, unsigned char const *src, int len)
+{
+    static unsigned char const header[] = { FRAME_ADDR, FRAME_CTRL };
+    unsigned char tail[2];
+    uint16_t fcs = PPPINITFCS16;
+    uint16_t dummy = 0;
+    unsigned char *out = dst;
+
+    *out++ = FRAME_FLAG;
+    *out++ = FRAME_ADDR;
+    *out++ = FRAME_ESC;
+    *out++ = FRAME_CTRL ^ FRAME_ENC;
+    fcs = pppFCS16Fast(fcs, header, 2);
+    out += pppAsyncEncode(out, src, len, &fcs);
+    fcs ^= 0xffff;
+    tail[0] = fcs & 0xff;
+    tail[1] = fcs >> 8;
+    out += pppAsyncEncode(out, tail, 2, &dummy);
+    *out++ = FRAME_FLAG;
+    return (int) (out - dst);
+}
+
+static void
+benchHDLC(void)
+{
+    static unsigned char out[ASYNC_FRAME_LEN(PPP_PAYLOAD)];
+    static PPPoEConnection conn;
+    PPPoEPacket header;
+    unsigned char *stream;
+    int i, len = 0, off, n;
+    uint16_t fcs;
+
+    BENCH("async encode", {
+	for (i=0; i<NUM_FRAMES; i++) {
+	    fcs = PPPINITFCS16;
+	    pppAsyncEncode(out, Frames[i], FrameLen[i], &fcs);
+	    bytes += FrameLen[i];
+	}
+	ops += NUM_FRAMES;
+    });
+
+    /* What pppd would write for the whole workload */
+    stream = malloc((size_t) NUM_FRAMES * ASYNC_FRAME_LEN(PPP_PAYLOAD));
+    if (!stream) {
+	perror("malloc");
+	exit(EXIT_FAILURE);
+    }
+    for (i=0; i<NUM_FRAMES; i++) {
+	len += encodeFrame(stream + len, Frames[i], FrameLen[i]);
+    }
+
+    memset(&header, 0, sizeof(header));
+    conn.maxPayload = PPP_PAYLOAD;
+    initPPP(&conn);
+    DecodedFrames = 0;
+    /* Fed to the decoder in READ_CHUNK pieces, like reads from pppd */
+    BENCH("async decode", {
+	for (off=0; off<len; off+=n) {
+	    n = (len - off < READ_CHUNK) ? len - off : READ_CHUNK;
+	    decodeFromPPP(&conn, &header, stream + off, n);
+	}
+	ops += NUM_FRAMES;
+	bytes += len;
+    });
+    if (DecodedFrames % NUM_FRAMES) {
+	printf("async decode: lost frames!\n");
+    }
+    free(stream);
+}
+
+/**********************************************************************
+*%FUNCTION: makeSyn
+*%ARGUMENTS:
+* pkt -- set to a PPPoE session frame
+* tcpLen -- TCP segment length, at least 24
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Builds an IPv4 TCP segment with SYN set and an MSS option of 1460.
+***********************************************************************/
+static void
+makeSyn(PPPoEPacket *pkt, int tcpLen)
+{
+    unsigned char *ip = pkt->payload + 2;
+    unsigned char *tcp = ip + 20;
+    uint16_t csum;
+    int i;
+
+    memset(pkt, 0, sizeof(*pkt));
+    pkt->vertype = PPPOE_VER_TYPE(1, 1);
+    pkt->length = htons(2 + 20 + tcpLen);
+    pkt->payload[0] = 0x00;
+    pkt->payload[1] = 0x21;
+    ip[0] = 0x45;
+    ip[2] = (20 + tcpLen) >> 8;
+    ip[3] = (20 + tcpLen) & 0xFF;
+    ip[8] = 64;
+    ip[9] = 6;
+    for (i=12; i<20; i++) ip[i] = (unsigned char) rand();
+    for (i=0; i<tcpLen; i++) tcp[i] = (unsigned char) rand();
+    tcp[12] = 6 << 4;		/* 24-byte header */
+    tcp[13] = 0x02;		/* SYN */
+    tcp[16] = tcp[17] = 0;
+    tcp[20] = 2;		/* MSS 1460 */
+    tcp[21] = 4;
+    tcp[22] = 1460 >> 8;
+    tcp[23] = 1460 & 0xFF;
+    csum = computeTCPChecksum(ip, tcp);
+    memcpy(tcp + 16, &csum, sizeof(csum));
+}
+
+static void
+benchTCP(void)
+{
+    static PPPoEPacket syns[64], work;
+    volatile uint16_t sink;
+    int i, len;
+
+    for (i=0; i<64; i++) {
+	makeSyn(&syns[i], 24 + (rand() % 16) * 4);
+    }
+    BENCH("clampMSS", {
+	for (i=0; i<64; i++) {
+	    work = syns[i];
+	    clampMSS(&work, "outgoing", 1412);
+	}
+	ops += 64;
+    });
+
+    ClampMSSVerify = 1;
+    BENCH("clampMSS (verify)", {
+	for (i=0; i<64; i++) {
+	    work = syns[i];
+	    clampMSS(&work, "outgoing", 1412);
+	}
+	ops += 64;
+    });
+    ClampMSSVerify = 0;
+
+    /* Checksum segments of the workload's sizes */
+    for (i=0; i<NUM_FRAMES; i++) {
+	unsigned char *ip = Frames[i] + 2;
+	len = FrameLen[i] - 2;
+	ip[0] = 0x45;
+	ip[2] = len >> 8;
+	ip[3] = len & 0xFF;
+    }
+    BENCH("computeTCPChecksum", {
+	for (i=0; i<NUM_FRAMES; i++) {
+	    sink = computeTCPChecksum(Frames[i] + 2, Frames[i] + 22);
+	    bytes += FrameLen[i] - 22;
+	}
+	ops += NUM_FRAMES;
+    });
+    (void) sink;
+}
+
+/**********************************************************************
+*%FUNCTION: putTag
+*%ARGUMENTS:
+* pkt -- discovery packet
+* type -- tag type
+* data -- tag value
+* len -- its length
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+putTag(PPPoEPacket *pkt, uint16_t type, void const *data, int len)
+{
+    unsigned char *cursor = pkt->payload + ntohs(pkt->length);
+
+    cursor[0] = type >> 8;
+    cursor[1] = type & 0xFF;
+    cursor[2] = len >> 8;
+    cursor[3] = len & 0xFF;
+    memcpy(cursor + TAG_HDR_SIZE, data, len);
+    pkt->length = htons(ntohs(pkt->length) + TAG_HDR_SIZE + len);
+}
+
+static void
+countTag(uint16_t type, uint16_t len, unsigned char *data, void *extra)
+{
+    (*(int *) extra)++;
+}
+
+static void
+benchDiscovery(void)
+{
+    static unsigned char seed[16], cookie[16 + sizeof(pid_t)];
+    unsigned char peer[ETH_ALEN] = { 0x02, 0, 0, 0, 0, 1 };
+    unsigned char me[ETH_ALEN] = { 0x02, 0, 0, 0, 0, 2 };
+    unsigned char blob[24];
+    struct MD5Context ctx;
+    PPPoEPacket pado;
+    PPPoETag tag;
+    TagIndex ti;
+    pid_t pid = getpid();
+    int i, count = 0;
+
+    /* A typical PADO */
+    memset(&pado, 0, sizeof(pado));
+    pado.vertype = PPPOE_VER_TYPE(1, 1);
+    pado.code = CODE_PADO;
+    for (i=0; i<(int) sizeof(blob); i++) blob[i] = (unsigned char) rand();
+    putTag(&pado, TAG_AC_NAME, "bras-01.example.net", 19);
+    putTag(&pado, TAG_SERVICE_NAME, "", 0);
+    putTag(&pado, TAG_SERVICE_NAME, "internet", 8);
+    putTag(&pado, TAG_AC_COOKIE, blob, 20);
+    putTag(&pado, TAG_HOST_UNIQ, blob, 8);
+    putTag(&pado, TAG_RELAY_SESSION_ID, blob, 12);
+
+    BENCH("parsePacket", {
+	parsePacket(&pado, countTag, &count);
+	ops++;
+	bytes += ntohs(pado.length);
+    });
+    BENCH("findTag (last tag)", {
+	findTag(&pado, TAG_RELAY_SESSION_ID, &tag);
+	ops++;
+    });
+    BENCH("indexPacket", {
+	indexPacket(&pado, &ti);
+	ops++;
+	bytes += ntohs(pado.length);
+    });
+    indexPacket(&pado, &ti);
+    BENCH("indexTag (last tag)", {
+	indexTag(&ti, TAG_RELAY_SESSION_ID, &tag);
+	ops++;
+    });
+
+    /* genCookie lives in pppoe-server.c, which cannot share a binary
+       with relay.c; this is the same MD5 sequence */
+    BENCH("genCookie", {
+	MD5Init(&ctx);
+	MD5Update(&ctx, peer, ETH_ALEN);
+	MD5Update(&ctx, me, ETH_ALEN);
+	MD5Update(&ctx, seed, sizeof(seed));
+	MD5Final(cookie, &ctx);
+	memcpy(cookie + 16, &pid, sizeof(pid));
+	peer[5]++;
+	ops++;
+    });
+}
+
+static void
+benchRelay(void)
+{
+    static PPPoEInterface ac, cli;
+    static unsigned char macs[RELAY_SESSIONS][ETH_ALEN];
+    static uint16_t sess[RELAY_SESSIONS];
+    unsigned char acMac[ETH_ALEN] = { 0x02, 0xac, 0, 0, 0, 1 };
+    VlanTags vlan;
+    PPPoESession *ses;
+    volatile unsigned int sink;
+    int i, j;
+
+    /* Keep createSession's syslog chatter out of the system log */
+    setlogmask(LOG_UPTO(LOG_ERR));
+    memset(&vlan, 0, sizeof(vlan));
+    strcpy(ac.name, "ac");
+    strcpy(cli.name, "cli");
+    initRelay(RELAY_SESSIONS);
+    for (i=0; i<RELAY_SESSIONS; i++) {
+	macs[i][0] = 0x02;
+	for (j=1; j<ETH_ALEN; j++) macs[i][j] = (unsigned char) rand();
+	ses = createSession(&ac, &cli, acMac, macs[i], &vlan, htons(i+1));
+	if (!ses) {
+	    printf("createSession failed\n");
+	    return;
+	}
+	sess[i] = ses->sesNum;
+    }
+
+    BENCH("relay hash", {
+	for (i=0; i<RELAY_SESSIONS; i++) {
+	    sink = hash(macs[i], sess[i]);
+	}
+	ops += RELAY_SESSIONS;
+    });
+    BENCH("relay findSession", {
+	for (i=0; i<RELAY_SESSIONS; i++) {
+	    j = (i * 2654435761U) % RELAY_SESSIONS;
+	    if (!findSession(macs[j], sess[j])) {
+		printf("findSession missed\n");
+	    }
+	}
+	ops += RELAY_SESSIONS;
+    });
+    (void) sink;
+}
+
+static void
+nullHandler(EventSelector *es, int fd, unsigned int flags, void *data)
+{
+}
+
+static void
+benchEvents(void)
+{
+    static int const counts[] = { 1, 64, 512 };
+    static int fds[512];
+    char name[32];
+    EventSelector *es;
+    int idle[2], ready[2];
+    size_t k;
+    int i, n;
+
+    if (pipe(idle) < 0 || pipe(ready) < 0 || write(ready[1], "x", 1) != 1) {
+	perror("pipe");
+	return;
+    }
+    for (k=0; k<sizeof(counts)/sizeof(counts[0]); k++) {
+	n = counts[k];
+	es = Event_CreateSelector();
+	if (!es) return;
+	/* n descriptors that never become ready... */
+	for (i=0; i<n; i++) {
+	    fds[i] = dup(idle[0]);
+	    if (fds[i] < 0 || fds[i] >= FD_SETSIZE) {
+		printf("Out of descriptors\n");
+		return;
+	    }
+	    Event_AddHandler(es, fds[i], EVENT_FLAG_READABLE, nullHandler, NULL);
+	}
+	/* ...and one that always is */
+	Event_AddHandler(es, ready[0], EVENT_FLAG_READABLE, nullHandler, NULL);
+	snprintf(name, sizeof(name), "Event_HandleEvent/%d", n);
+	BENCH(name, {
+	    Event_HandleEvent(es);
+	    ops++;
+	});
+	for (i=0; i<n; i++) {
+	    close(fds[i]);
+	}
+	Event_DestroySelector(es);
+    }
+    close(idle[0]);
+    close(idle[1]);
+    close(ready[0]);
+    close(ready[1]);
+}
+
+/**********************************************************************
+*%FUNCTION: cpuName
+*%ARGUMENTS:
+* None
+*%RETURNS:
+* The CPU model from /proc/cpuinfo, or "unknown"
+***********************************************************************/
+static char const *
+cpuName(void)
+{
+    static char name[128] = "unknown";
+    char line[256], *p;
+    FILE *fp = fopen("/proc/cpuinfo", "r");
+
+    if (!fp) return name;
+    while (fgets(line, sizeof(line), fp)) {
+	if (strncmp(line, "model name", 10) || !(p = strchr(line, ':'))) continue;
+	p += strspn(p + 1, " \t") + 1;
+	p[strcspn(p, "\n")] = 0;
+	snprintf(name, sizeof(name), "%s", p);
+	break;
+    }
+    fclose(fp);
+    return name;
+}
+
+/**********************************************************************
+*%FUNCTION: writeBaseline
+*%ARGUMENTS:
+* fname -- file to write
+*%RETURNS:
+* Nothing
+***********************************************************************/
+static void
+writeBaseline(char const *fname)
+{
+    FILE *fp = fopen(fname, "w");
+    int i;
+
+    if (!fp) {
+	perror(fname);
+	exit(EXIT_FAILURE);
+    }
+    fprintf(fp, "# CPU: %s\n", cpuName());
+    fprintf(fp, "# name\tns/op\tcycles/byte\n");
+    for (i=0; i<NumResults; i++) {
+	if (Results[i].cyclesPerByte >= 0) {
+	    fprintf(fp, "%s\t%.1f\t%.3f\n", Results[i].name,
+		    Results[i].nsPerOp, Results[i].cyclesPerByte);
+	} else {
+	    fprintf(fp, "%s\t%.1f\t-\n", Results[i].name, Results[i].nsPerOp);
+	}
+    }
+    fclose(fp);
+}
+
+/**********************************************************************
+*%FUNCTION: compareBaseline
+*%ARGUMENTS:
+* fname -- baseline written by an earlier -w
+*%RETURNS:
+* Nothing
+*%DESCRIPTION:
+* Prints each result's ns/op next to the baseline's.  Baselines are
+* only comparable on the same machine.
+***********************************************************************/
+static void
+compareBaseline(char const *fname)
+{
+    FILE *fp = fopen(fname, "r");
+    char line[128], *tab;
+    double ns;
+    int i;
+
+    if (!fp) {
+	perror(fname);
+	exit(EXIT_FAILURE);
+    }
+    printf("\n%-24s %12s %12s %8s\n", "", "baseline", "now", "change");
+    while (fgets(line, sizeof(line), fp)) {
+	if (line[0] == '#' || !(tab = strchr(line, '\t'))) continue;
+	*tab = 0;
+	ns = atof(tab + 1);
+	for (i=0; i<NumResults; i++) {
+	    if (strcmp(Results[i].name, line) || ns <= 0) continue;
+	    printf("%-24s %9.1f ns %9.1f ns %+7.1f%%\n", line, ns,
+		   Results[i].nsPerOp, 100.0 * (Results[i].nsPerOp - ns) / ns);
+	}
+    }
+    fclose(fp);
+}
+
+int
+main(int argc, char *argv[])
+{
+    char const *baseline = NULL, *output = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:w:")) != -1) {
+	switch(opt) {
+	case 'c':
+	    baseline = optarg;
+	    break;
+	case 'w':
+	    output = optarg;
+	    break;
+	default:
+	    fprintf(stderr, "Usage: %s [-c baseline] [-w baseline]\n", argv[0]);
+	    return EXIT_FAILURE;
+	}
+    }
+
+    srand(1);
+    makeFrames();
+    printf("AVX2: %s, PCLMULQDQ: %s\n",
+	   cpuHasAVX2() ? "yes" : "no", pppFCS16HaveClmul() ? "yes" : "no");
+
+    benchFCS();
+    benchHDLC();
+    benchTCP();
+    benchDiscovery();
+    benchRelay();
+    benchEvents();
+
+    if (output) writeBaseline(output);
+    if (baseline) compareBaseline(baseline);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,62 @@
+/***********************************************************************
+*
+* testfcs.c
+*
+* Cross-check the PPP FCS implementations against the reference
+* byte-at-a-time version.
+*
+* Copyright (C) 2018-2023 Dianne Skoll
+*
+***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pppoe.h"
+
+#define MAX_LEN 4096
+#define ROUNDS 20000
+
+int
+main(int argc, char *argv[])
+{
+    unsigned char buf[MAX_LEN + 16];
+    unsigned char good[] = {FRAME_ADDR, FRAME_CTRL, 0xc0, 0x21, 0x01, 0x01,
+			    0x00, 0x04, 0, 0};
+    uint16_t fcs, ref, sliced, clmul, fast;
+    int i, n, off, len, errors = 0;
+
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+    printf("PCLMULQDQ kernel: %s\n",
+	   pppFCS16HaveClmul() ? "available" : "not available");
+
+    for (n=0; n<ROUNDS; n++) {
+	len = (n < MAX_LEN) ? n : rand() % MAX_LEN;
+	off = rand() % 16;
+	fcs = (n & 1) ? PPPINITFCS16 : (uint16_t) rand();
+	for (i=0; i<len; i++) {
+	    buf[off+i] = (unsigned char) rand();
+	}
+	ref = pppFCS16(fcs, buf+off, len);
+	sliced = pppFCS16Sliced(fcs, buf+off, len);
+	clmul = pppFCS16Clmul(fcs, buf+off, len);
+	fast = pppFCS16Fast(fcs, buf+off, len);
+	if (sliced != ref || clmul != ref || fast != ref) {
+	    printf("MISMATCH: len=%d off=%d fcs=%04x ref=%04x sliced=%04x clmul=%04x fast=%04x\n",
+		   len, off, fcs, ref, sliced, clmul, fast);
+	    errors++;
+	}
+    }
+
+    /* A frame followed by its own FCS must leave the "good" residue */
+    fcs = pppFCS16(PPPINITFCS16, good, 8) ^ 0xffff;
+    good[8] = fcs & 0xff;
+    good[9] = fcs >> 8;
+    if (pppFCS16Fast(PPPINITFCS16, good, 10) != PPPGOODFCS16) {
+	printf("MISMATCH: bad FCS residue\n");
+	errors++;
+    }
+
+    printf("%d rounds, %d errors\n", ROUNDS, errors);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}